@@ -3,13 +3,19 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <spawn.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -32,6 +38,81 @@ struct proc
 static int nprocs;         // Number of started filter processes
 static struct proc *procs; // Dynamically-allocated array of procs
 
+// The filters are chained into a pipeline. Each link of that chain
+// is a pair of an input and an output descriptor:
+//
+//   stdin -> procs[0] -> procs[1] -> ... -> procs[nprocs-1] -> stdout
+//
+// Therefore, we have nprocs+1 pairs. Between input and output, each
+// pair has a bounded queue (a ring buffer) that decouples a fast
+// producer from a slow consumer: If the queue fills up to the high
+// watermark, we stop listening for EPOLLIN on the input until the
+// consumer has drained it to the low watermark. Thereby, a slow filter
+// throttles only its producer, while all other pairs continue.
+struct pair
+{
+    int in;  // We read from this descriptor
+    int out; // and write the data to this descriptor
+
+    // The input and the output side of a pair can become ready at the
+    // same time and are then handled by different workers.
+    pthread_mutex_t lock;
+
+    // The queue. head and tail are running byte counters; the queue
+    // holds the bytes [tail, head) at offset (counter % queue_size).
+    char *queue;
+    uint64_t head; // Total bytes read from in
+    uint64_t tail; // Total bytes written to out
+
+    bool in_poll;      // in can be polled (not a regular file)
+    bool out_poll;     // out can be polled (not a regular file)
+    bool out_nonblock; // out is a pipe end owned by us with O_NONBLOCK
+    bool in_armed;     // EPOLLIN is armed for in
+    bool out_armed;    // EPOLLOUT is armed for out
+    bool paused;       // The queue hit the high watermark
+    bool eof;          // in has reached its end of file
+    bool broken;       // The reader of out went away
+    bool closed;       // The pair is closed
+
+    uint64_t paused_at;    // Timestamp (ns) when the pair was paused
+    uint64_t throttled_ns; // Time spent paused since the last report
+};
+
+static int npairs;         // Number of pairs (nprocs + 1)
+static struct pair *pairs; // Dynamically-allocated array of pairs
+static uint64_t *bytes;    // Per-pair counter of copied bytes
+
+// Queue configuration. The queue size can be given in KiB with the
+// QUEUE environment variable. The watermarks are derived from it.
+static size_t queue_size;     // Capacity of each queue in bytes
+static size_t high_watermark; // Pause the input at this queue depth
+static size_t low_watermark;  // Resume the input at this queue depth
+#define CHUNK (64 * 1024)     // Read at most this much per event
+
+// Worker-pool state. All workers share a single epoll instance. As
+// soon as the last pair has seen its end of file, we signal done_fd,
+// which wakes up all workers at once.
+static int epoll_fd;          // The shared epoll instance
+static atomic_int active;     // Number of pairs that are not yet closed
+static int done_fd;           // eventfd(2) that signals the shutdown
+#define DONE_EVENT UINT32_MAX // epoll_event.data.u32 for done_fd
+
+// Within epoll_event.data.u32, we encode the pair index and whether
+// the event belongs to the input or to the output side of the pair.
+#define EV_IN 0
+#define EV_OUT 1
+#define EV_TAG(idx, side) ((idx) * 2 + (side))
+
+// Atomically add to/exchange a plain counter. The counters are
+// shared between the workers that copy the data and the worker that
+// currently prints the throughput.
+#define atomic_add(p, v)                                                       \
+    atomic_fetch_add_explicit((_Atomic typeof(*(p)) *)(p), (v),                \
+                              memory_order_relaxed)
+#define atomic_xchg(p, v)                                                      \
+    atomic_exchange_explicit((_Atomic typeof(*(p)) *)(p), (v),                 \
+                             memory_order_relaxed)
+
 ////////////////////////////////////////////////////////////////
 // HINT: You have already seen this in the in the select exercise
 ////////////////////////////////////////////////////////////////
@@ -102,18 +183,32 @@ static int start_proc(struct proc *proc)
     }
 }
 
-// FIXME: Implement a 'int copy_splice(int in_fd, int out_fd);'
+// Current CLOCK_MONOTONIC time in nanoseconds
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        die("clock_gettime");
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
 
 // This function prints an array of uint64_t (elements) as line with
-// throughput measures. The function throttles its output to one line
-// per second.
+// throughput measures, followed by their sum. For each pair, we also
+// print the current queue depth and the share of the last interval
+// that its input was throttled. The function throttles its output to
+// one line per second. As it is called by all workers, only one
+// worker prints at a time while the others skip it.
 
 // Example Output:
-//  2860.20MiB/s 2860.26MiB/s 2860.23MiB/s 2860.25MiB/s 2860.29MiB/s
+//  2860.20MiB/s[64K,0%] 2860.26MiB/s[1024K,97%] | 5720.46MiB/s total
 void print_throughput(uint64_t *bytes, int elements)
 {
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
     static struct timespec last = {0};
 
+    if (pthread_mutex_trylock(&lock) != 0)
+        return;
+
     struct timespec now;
     if (clock_gettime(CLOCK_REALTIME, &now) < 0)
         die("clock_gettime");
@@ -122,18 +217,260 @@ void print_throughput(uint64_t *bytes, int elements)
     {
         double delta = now.tv_sec - last.tv_sec;
         delta += (now.tv_nsec - last.tv_nsec) / 1e9;
+        double total = 0;
         for (int i = 0; i < elements; i++)
         {
-            fprintf(stderr, " %.2fMiB/s", bytes[i] / delta / 1024 / 1024);
+            struct pair *p = &pairs[i];
+            pthread_mutex_lock(&p->lock);
+            uint64_t depth = p->head - p->tail;
+            uint64_t throttled = p->throttled_ns;
+            p->throttled_ns = 0;
+            if (p->paused)
+            {
+                uint64_t ns = now_ns();
+                throttled += ns - p->paused_at;
+                p->paused_at = ns;
+            }
+            pthread_mutex_unlock(&p->lock);
+
+            double mib = atomic_xchg(&bytes[i], 0) / delta / 1024 / 1024;
+            fprintf(stderr, " %.2fMiB/s[%luK,%.0f%%]", mib, depth / 1024,
+                    100.0 * throttled / 1e9 / delta);
+            total += mib;
         }
-        fprintf(stderr, "\n");
-        memset(bytes, 0, elements * sizeof(uint64_t));
+        fprintf(stderr, " | %.2fMiB/s total\n", total);
         last = now;
     }
     else if (last.tv_sec == 0)
     {
         last = now;
     }
+    pthread_mutex_unlock(&lock);
+}
+
+// (Re-)Arm one side of pair[idx] in the epoll set. All descriptors
+// are registered with EPOLLONESHOT: After the kernel has delivered an
+// event to one worker, the descriptor is disabled until that worker
+// re-arms it with EPOLL_CTL_MOD. Thereby, a side is owned by exactly
+// one worker while it is handled, and a paused input does not wake
+// anyone up, even if its writer has hung up (EPOLLHUP).
+static void pair_arm(int op, int idx, int side, int events)
+{
+    struct pair *p = &pairs[idx];
+    struct epoll_event ev = {.events = events | EPOLLONESHOT,
+                             .data.u32 = EV_TAG(idx, side)};
+    if (epoll_ctl(epoll_fd, op, side == EV_IN ? p->in : p->out, &ev) < 0)
+        die("epoll_ctl");
+}
+
+// Read at most one chunk from the input into the free space of the
+// queue. We only call this if the input is readable or is a regular
+// file. Therefore, the read(2) does not block.
+static void pair_fill(int idx)
+{
+    struct pair *p = &pairs[idx];
+    uint64_t space = queue_size - (p->head - p->tail);
+    size_t off = p->head % queue_size;
+    size_t len = queue_size - off; // Up to the end of the ring
+    if (len > space)
+        len = space;
+    if (len > CHUNK)
+        len = CHUNK;
+    if (len == 0)
+        return;
+
+    ssize_t rc = read(p->in, p->queue + off, len);
+    if (rc > 0)
+        p->head += rc;
+    else if (rc == 0)
+        p->eof = true;
+    else if (errno != EINTR && errno != EAGAIN)
+        die("read");
+}
+
+// Write the queue to the output until it is empty or until the output
+// would block. For our own pipe ends, we use O_NONBLOCK. Our stdout,
+// however, is shared with other processes. Therefore, we write at most
+// PIPE_BUF bytes per readiness event, which a writable pipe accepts
+// without blocking.
+static void pair_flush(int idx)
+{
+    struct pair *p = &pairs[idx];
+    while (p->head != p->tail)
+    {
+        uint64_t depth = p->head - p->tail;
+        size_t off = p->tail % queue_size;
+        size_t len = queue_size - off;
+        if (len > depth)
+            len = depth;
+        if (p->out_poll && !p->out_nonblock && len > PIPE_BUF)
+            len = PIPE_BUF;
+
+        ssize_t rc = write(p->out, p->queue + off, len);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc < 0 && errno == EAGAIN)
+            break;
+        if (rc < 0 && errno == EPIPE)
+        {
+            p->broken = true;
+            break;
+        }
+        if (rc < 0)
+            die("write");
+
+        p->tail += rc;
+        atomic_add(&bytes[idx], rc);
+        if (p->out_poll && !p->out_nonblock)
+            break;
+    }
+}
+
+// Close a pair, which propagates the end of file to the next filter
+// in the pipeline. The last closed pair wakes up all workers via
+// done_fd.
+static void pair_close(int idx)
+{
+    struct pair *p = &pairs[idx];
+    if (p->in_poll && epoll_ctl(epoll_fd, EPOLL_CTL_DEL, p->in, NULL) < 0)
+        die("epoll_ctl");
+    if (p->out_poll && epoll_ctl(epoll_fd, EPOLL_CTL_DEL, p->out, NULL) < 0)
+        die("epoll_ctl");
+    close(p->in);
+    if (p->out != STDOUT_FILENO)
+        close(p->out);
+    free(p->queue);
+    p->queue = NULL;
+    p->closed = true;
+
+    if (atomic_fetch_sub(&active, 1) == 1)
+    {
+        uint64_t one = 1;
+        if (write(done_fd, &one, sizeof(one)) < 0)
+            die("write");
+    }
+}
+
+// After the queue has changed, we decide which sides of the pair have
+// to be re-armed. This is the place where the watermarks are applied:
+// an input is paused when its queue reaches the high watermark and it
+// is only resumed when the queue has drained to the low watermark.
+// For regular files, which epoll cannot watch, we read and write
+// directly in a loop until the queue fills up or the file ends.
+static void pair_update(int idx)
+{
+    struct pair *p = &pairs[idx];
+    while (true)
+    {
+        uint64_t depth = p->head - p->tail;
+        if (p->broken || (p->eof && depth == 0))
+        {
+            pair_close(idx);
+            return;
+        }
+
+        if (!p->paused && !p->eof && depth >= high_watermark)
+        {
+            p->paused = true;
+            p->paused_at = now_ns();
+        }
+        else if (p->paused && depth <= low_watermark)
+        {
+            p->paused = false;
+            p->throttled_ns += now_ns() - p->paused_at;
+        }
+
+        if (depth > 0 && p->out_poll && !p->out_armed)
+        {
+            pair_arm(EPOLL_CTL_MOD, idx, EV_OUT, EPOLLOUT);
+            p->out_armed = true;
+        }
+
+        if (p->paused || p->eof)
+            return;
+        if (p->in_poll)
+        {
+            if (!p->in_armed)
+            {
+                pair_arm(EPOLL_CTL_MOD, idx, EV_IN, EPOLLIN);
+                p->in_armed = true;
+            }
+            return;
+        }
+        pair_fill(idx);
+        if (!p->out_poll || p->out_nonblock)
+            pair_flush(idx);
+    }
+}
+
+// Handle an event for one side of a pair. On an input event, we fill
+// the queue and optimistically try to write it out at once. On an
+// output event, we only drain the queue.
+static void handle_pair(int idx, int side)
+{
+    struct pair *p = &pairs[idx];
+    pthread_mutex_lock(&p->lock);
+    if (!p->closed)
+    {
+        if (side == EV_IN)
+        {
+            p->in_armed = false;
+            pair_fill(idx);
+            if (!p->out_armed && (!p->out_poll || p->out_nonblock))
+                pair_flush(idx);
+        }
+        else
+        {
+            p->out_armed = false;
+            pair_flush(idx);
+        }
+        pair_update(idx);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+// The body of all workers. In single-threaded mode, main() calls it
+// directly. In the worker-pool mode, each worker takes only one event
+// per epoll_wait(2) so that ready pairs spread over all workers
+// instead of queuing up behind a single one.
+static void *worker(void *arg)
+{
+    int max_events = (intptr_t)arg;
+    struct epoll_event events[16];
+    while (true)
+    {
+        int nfds = epoll_wait(epoll_fd, events, max_events, -1);
+        if (nfds < 0 && errno == EINTR)
+            continue;
+        if (nfds < 0)
+            die("epoll_wait");
+
+        for (int n = 0; n < nfds; n++)
+        {
+            // The done_fd is level triggered and never read.
+            // Therefore, every worker sees it and terminates.
+            uint32_t tag = events[n].data.u32;
+            if (tag == DONE_EVENT)
+                return NULL;
+            handle_pair(tag / 2, tag % 2);
+        }
+        print_throughput(bytes, npairs);
+    }
+}
+
+// Register one descriptor of a pair with epoll. Regular files cannot
+// be polled (EPERM) but are always ready.
+static bool pair_register(int idx, int side, int events)
+{
+    struct pair *p = &pairs[idx];
+    struct epoll_event ev = {.events = events | EPOLLONESHOT,
+                             .data.u32 = EV_TAG(idx, side)};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, side == EV_IN ? p->in : p->out,
+                  &ev) == 0)
+        return true;
+    if (errno != EPERM)
+        die("epoll_ctl");
+    return false;
 }
 
 int main(int argc, char *argv[])
@@ -161,8 +498,100 @@ int main(int argc, char *argv[])
                 procs[i].pid);
     }
 
-    // FIXME: Arrange file descriptors in pairs of input -> output
-    // FIXME: Setup epoll to listen on the input descriptors
-    // FIXME: Receive events and copy data around.
-    // FIXME: call print_throughput from time to time.
+    // We run with a single thread, unless the user specified a number
+    // of workers in the THREADS environment variable.
+    char *THREADS = getenv("THREADS");
+    int nthreads = atoi(THREADS ? THREADS : "1");
+    if (nthreads < 1)
+        nthreads = 1;
+
+    // A filter that exits early should not kill us with SIGPIPE. We
+    // see EPIPE instead and close the pair.
+    signal(SIGPIPE, SIG_IGN);
+
+    // The queue size (in KiB) between two filters. We pause the input
+    // at a full queue and resume it when the queue is a quarter full.
+    char *QUEUE = getenv("QUEUE");
+    queue_size = atoi(QUEUE ? QUEUE : "256") * 1024;
+    if (queue_size < PIPE_BUF)
+        queue_size = PIPE_BUF;
+    high_watermark = queue_size;
+    low_watermark = queue_size / 4;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+        die("epoll_create1");
+
+    // Arrange file descriptors in pairs of input -> output. The pipe
+    // ends that we share with our filters are only used by us.
+    // Therefore, we can switch them to O_NONBLOCK.
+    npairs = nprocs + 1;
+    pairs = calloc(npairs, sizeof(struct pair));
+    bytes = calloc(npairs, sizeof(uint64_t));
+    if (!pairs || !bytes)
+        die("calloc");
+    for (int i = 0; i < npairs; i++)
+    {
+        struct pair *p = &pairs[i];
+        p->in = (i == 0) ? STDIN_FILENO : procs[i - 1].stdout;
+        p->out = (i == nprocs) ? STDOUT_FILENO : procs[i].stdin;
+        if (p->out != STDOUT_FILENO)
+        {
+            if (fcntl(p->out, F_SETFL, O_NONBLOCK) < 0)
+                die("fcntl");
+            p->out_nonblock = true;
+        }
+        pthread_mutex_init(&p->lock, NULL);
+        p->queue = malloc(queue_size);
+        if (!p->queue)
+            die("malloc");
+
+        // Setup epoll to listen on the input descriptors. The output
+        // is registered, but EPOLLOUT is only armed when the queue is
+        // not empty.
+        p->in_poll = pair_register(i, EV_IN, EPOLLIN);
+        p->in_armed = p->in_poll;
+        p->out_poll = pair_register(i, EV_OUT, 0);
+    }
+    atomic_store(&active, npairs);
+
+    done_fd = eventfd(0, EFD_CLOEXEC);
+    if (done_fd < 0)
+        die("eventfd");
+    struct epoll_event ev = {.events = EPOLLIN, .data.u32 = DONE_EVENT};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, done_fd, &ev) < 0)
+        die("epoll_ctl");
+
+    // Inputs that are regular files never signal readiness. We start
+    // copying them right away.
+    for (int i = 0; i < npairs; i++)
+    {
+        if (!pairs[i].in_poll)
+            pair_update(i);
+    }
+
+    // Receive events and copy data around.
+    if (nthreads == 1)
+    {
+        worker((void *)16);
+    }
+    else
+    {
+        pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+        if (!threads)
+            die("malloc");
+        for (int i = 0; i < nthreads; i++)
+        {
+            if (pthread_create(&threads[i], NULL, worker, (void *)1) != 0)
+                die("pthread_create");
+        }
+        for (int i = 0; i < nthreads; i++)
+            pthread_join(threads[i], NULL);
+        free(threads);
+    }
+
+    // All pairs are closed, so all filters have seen their end of
+    // file. Collect them.
+    for (int i = 0; i < nprocs; i++)
+        waitpid(procs[i].pid, NULL, 0);
 }
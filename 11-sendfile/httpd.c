@@ -0,0 +1,419 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define die(msg)                                                               \
+    do                                                                         \
+    {                                                                          \
+        perror(msg);                                                           \
+        exit(EXIT_FAILURE);                                                    \
+    } while (0)
+
+// A tiny HTTP/1.1 static file server. It serves GET requests for the
+// files in a directory over keep-alive connections. For the response
+// body, it uses one of two paths:
+//
+// sendfile: We cork the socket with TCP_CORK, write the header, and
+//           let sendfile(2) copy the file within the kernel. Uncorking
+//           flushes the header and the file data in full segments.
+//
+// zerocopy: We map the file and send(2) it with MSG_ZEROCOPY. The
+//           kernel pins our pages instead of copying them. As we must
+//           not unmap the pages before the kernel is done with them,
+//           the kernel sends completion notifications over the error
+//           queue of the socket (EPOLLERR, recvmsg(MSG_ERRQUEUE)).
+//
+// Please note that on the loopback device, the kernel has to copy
+// zerocopy pages anyway before they reach the receiving socket
+// (SO_EE_CODE_ZEROCOPY_COPIED). There, we measure the overhead of the
+// notifications and not their benefit.
+
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+static bool zerocopy; // MODE=zerocopy
+static int dir_fd;    // The directory that we serve
+
+// Statistics that we print on SIGINT
+static struct
+{
+    uint64_t responses;
+    uint64_t bytes;
+    uint64_t zc_sends;  // send(MSG_ZEROCOPY) calls
+    uint64_t zc_copied; // ... where the kernel fell back to copying
+} stats;
+
+enum state
+{
+    READING,    // Waiting for a complete request header
+    RESPONDING, // Sending the response header and body
+    DRAINING,   // Waiting for outstanding zerocopy completions
+};
+
+// For each connection, we allocate a conn object, which is also the
+// data.ptr of its epoll registration.
+struct conn
+{
+    int fd;
+    enum state state;
+    bool keepalive;
+
+    char req[4096]; // The request, which can contain pipelined requests
+    size_t req_len;
+
+    char hdr[256]; // The response header
+    size_t hdr_len, hdr_sent;
+
+    int file_fd; // The response body
+    off_t off, size;
+    char *map; // zerocopy: the mapped file
+
+    uint32_t zc_next; // zerocopy: id of the next send(MSG_ZEROCOPY)
+    uint32_t zc_done; // zerocopy: number of completed sends
+};
+
+static void conn_close(struct conn *c)
+{
+    // If zerocopy sends are outstanding, closing the socket is still
+    // safe as long as we keep the mapping. We leak it in this case.
+    if (c->map && c->zc_done == c->zc_next)
+        munmap(c->map, c->size);
+    if (c->file_fd >= 0)
+        close(c->file_fd);
+    close(c->fd);
+    free(c);
+}
+
+// Read the completion notifications from the error queue. Each
+// notification covers a range [ee_info, ee_data] of send ids.
+static int drain_errqueue(struct conn *c)
+{
+    while (c->zc_done != c->zc_next)
+    {
+        char control[128];
+        struct msghdr msg = {.msg_control = control,
+                             .msg_controllen = sizeof(control)};
+        if (recvmsg(c->fd, &msg, MSG_ERRQUEUE) < 0)
+            return (errno == EAGAIN) ? 0 : -1;
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm;
+             cm = CMSG_NXTHDR(&msg, cm))
+        {
+            struct sock_extended_err *ee = (void *)CMSG_DATA(cm);
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            uint32_t n = ee->ee_data - ee->ee_info + 1;
+            c->zc_done += n;
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                stats.zc_copied += n;
+        }
+    }
+    return 0;
+}
+
+// Parse the request at the beginning of c->req (of length len, including
+// the empty line) and prepare the response.
+static void start_response(struct conn *c, size_t len)
+{
+    char method[8], path[1024];
+    int status = 200;
+    c->file_fd = -1;
+    c->size = 0;
+    c->keepalive = memmem(c->req, len, "Connection: close", 17) == NULL;
+
+    if (sscanf(c->req, "%7s %1023s HTTP/1.1", method, path) != 2 ||
+        strcmp(method, "GET") != 0)
+        status = 400;
+    else if (path[0] != '/' || strstr(path, ".."))
+        status = 404;
+    else if ((c->file_fd = openat(dir_fd, path[1] ? path + 1 : ".",
+                                  O_RDONLY | O_CLOEXEC)) < 0)
+        status = 404;
+    else
+    {
+        struct stat st;
+        if (fstat(c->file_fd, &st) < 0 || !S_ISREG(st.st_mode))
+        {
+            close(c->file_fd);
+            c->file_fd = -1;
+            status = 404;
+        }
+        else
+        {
+            c->size = st.st_size;
+        }
+    }
+
+    c->hdr_len = snprintf(c->hdr, sizeof(c->hdr),
+                          "HTTP/1.1 %d %s\r\nContent-Length: %ld\r\n%s\r\n",
+                          status, status == 200 ? "OK" : "Error",
+                          (long)c->size,
+                          c->keepalive ? "" : "Connection: close\r\n");
+    c->hdr_sent = 0;
+    c->off = 0;
+    c->map = NULL;
+    if (zerocopy && c->size > 0)
+    {
+        c->map = mmap(NULL, c->size, PROT_READ, MAP_SHARED, c->file_fd, 0);
+        if (c->map == MAP_FAILED)
+            die("mmap");
+    }
+
+    // Remove the request from the buffer. Pipelined requests remain.
+    memmove(c->req, c->req + len, c->req_len - len);
+    c->req_len -= len;
+
+    // With TCP_CORK, the kernel only sends full segments until we
+    // uncork the socket after the last byte of the body.
+    int one = 1;
+    if (!zerocopy && setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &one,
+                                sizeof(one)) < 0)
+        die("setsockopt");
+    c->state = RESPONDING;
+}
+
+// Send the response header and body. Returns 1 if the response is
+// complete, 0 if the socket would block, and -1 on error.
+static int send_response(struct conn *c)
+{
+    while (c->hdr_sent < c->hdr_len)
+    {
+        ssize_t n = send(c->fd, c->hdr + c->hdr_sent, c->hdr_len - c->hdr_sent,
+                         MSG_NOSIGNAL | (c->size ? MSG_MORE : 0));
+        if (n < 0)
+            return (errno == EAGAIN) ? 0 : -1;
+        c->hdr_sent += n;
+    }
+
+    while (c->off < c->size)
+    {
+        ssize_t n;
+        if (zerocopy)
+        {
+            n = send(c->fd, c->map + c->off, c->size - c->off,
+                     MSG_ZEROCOPY | MSG_NOSIGNAL);
+            if (n > 0)
+                c->zc_next++, stats.zc_sends++;
+            // ENOBUFS: Too many pinned pages. We have to wait for
+            // completions, which are signaled with EPOLLERR.
+            if (n < 0 && errno == ENOBUFS)
+                return 0;
+        }
+        else
+        {
+            off_t off = c->off;
+            n = sendfile(c->fd, c->file_fd, &off, c->size - c->off);
+        }
+        if (n < 0)
+            return (errno == EAGAIN) ? 0 : -1;
+        if (n == 0) // The file was truncated under our feet
+            return -1;
+        c->off += n;
+        stats.bytes += n;
+    }
+
+    int zero = 0;
+    if (!zerocopy && setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &zero,
+                                sizeof(zero)) < 0)
+        die("setsockopt");
+    return 1;
+}
+
+// The response is completely sent (and all zerocopy sends are
+// complete). We release the file and get ready for the next request.
+static void finish_response(struct conn *c)
+{
+    if (c->map)
+        munmap(c->map, c->size);
+    c->map = NULL;
+    if (c->file_fd >= 0)
+        close(c->file_fd);
+    c->file_fd = -1;
+    stats.responses++;
+    c->state = READING;
+}
+
+// Drive the state machine of a connection as far as possible. We use
+// edge-triggered epoll, so we have to continue until the socket would
+// block. Returns -1 if the connection has to be closed.
+static int conn_run(struct conn *c)
+{
+    if (zerocopy && drain_errqueue(c) < 0)
+        return -1;
+
+    while (true)
+    {
+        switch (c->state)
+        {
+        case READING:
+        {
+            char *end = memmem(c->req, c->req_len, "\r\n\r\n", 4);
+            if (end)
+            {
+                start_response(c, end + 4 - c->req);
+                break;
+            }
+            if (c->req_len == sizeof(c->req))
+                return -1; // Request header too large
+            ssize_t n = recv(c->fd, c->req + c->req_len,
+                             sizeof(c->req) - c->req_len, 0);
+            if (n < 0 && errno == EAGAIN)
+                return 0;
+            if (n <= 0)
+                return -1;
+            c->req_len += n;
+            break;
+        }
+        case RESPONDING:
+        {
+            int rc = send_response(c);
+            if (rc <= 0)
+                return rc;
+            c->state = DRAINING;
+            break;
+        }
+        case DRAINING:
+            if (c->zc_done != c->zc_next)
+                return 0;
+            finish_response(c);
+            if (!c->keepalive)
+                return -1;
+            break;
+        }
+    }
+}
+
+static volatile sig_atomic_t stop;
+static void on_sigint(int sig)
+{
+    stop = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s PORT DIR\n", argv[0]);
+        return -1;
+    }
+    dir_fd = open(argv[2], O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0)
+        die("open");
+    char *MODE = getenv("MODE");
+    zerocopy = MODE && !strcmp(MODE, "zerocopy");
+
+    // We terminate on SIGINT and print our statistics. As we install
+    // the handler without SA_RESTART, epoll_wait(2) returns EINTR.
+    struct sigaction sa = {.sa_handler = on_sigint};
+    sigaction(SIGINT, &sa, NULL);
+
+    // We listen on the loopback device only.
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listen_fd < 0)
+        die("socket");
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = {.sin_family = AF_INET,
+                               .sin_port = htons(atoi(argv[1])),
+                               .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        die("bind");
+    if (listen(listen_fd, SOMAXCONN) < 0)
+        die("listen");
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+        die("epoll_create1");
+    // The listen socket is the only registration without a conn object
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0)
+        die("epoll_ctl");
+
+    printf("Serving %s on http://127.0.0.1:%s/ with %s\n", argv[2], argv[1],
+           zerocopy ? "send(MSG_ZEROCOPY)" : "sendfile(2) and TCP_CORK");
+    fflush(stdout);
+
+    while (!stop)
+    {
+        struct epoll_event events[64];
+        int nfds = epoll_wait(epoll_fd, events, 64, -1);
+        if (nfds < 0 && errno == EINTR)
+            continue;
+        if (nfds < 0)
+            die("epoll_wait");
+
+        for (int n = 0; n < nfds; n++)
+        {
+            struct conn *c = events[n].data.ptr;
+            if (c == NULL)
+            {
+                // Accept all pending connections. A connection that was
+                // aborted before we got to it, or a signal, is no reason to
+                // stop. If we run out of descriptors or memory, the listen
+                // socket stays readable; we back off for a moment, so that
+                // closing connections can free some, instead of spinning.
+                while (true)
+                {
+                    int fd = accept4(listen_fd, NULL, NULL,
+                                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (fd < 0 && (errno == ECONNABORTED || errno == EINTR))
+                        continue;
+                    if (fd < 0 && (errno == EMFILE || errno == ENFILE ||
+                                   errno == ENOBUFS || errno == ENOMEM))
+                    {
+                        perror("accept4");
+                        usleep(10000);
+                        break;
+                    }
+                    if (fd < 0 && errno == EAGAIN)
+                        break;
+                    if (fd < 0)
+                        die("accept4");
+                    if (zerocopy && setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY,
+                                               &one, sizeof(one)) < 0)
+                        die("setsockopt(SO_ZEROCOPY)");
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one,
+                               sizeof(one));
+                    c = calloc(1, sizeof(struct conn));
+                    if (!c)
+                        die("calloc");
+                    c->fd = fd;
+                    c->file_fd = -1;
+                    c->state = READING;
+                    struct epoll_event cev = {
+                        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                        .data.ptr = c};
+                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &cev) < 0)
+                        die("epoll_ctl");
+                }
+                continue;
+            }
+            if (conn_run(c) < 0)
+                conn_close(c);
+        }
+    }
+
+    printf("%lu responses, %.2f MiB body", stats.responses,
+           stats.bytes / 1024.0 / 1024.0);
+    if (zerocopy)
+        printf(", %lu zerocopy sends (%lu copied by the kernel)",
+               stats.zc_sends, stats.zc_copied);
+    printf("\n");
+}
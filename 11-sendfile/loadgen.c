@@ -0,0 +1,188 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define die(msg)                                                               \
+    do                                                                         \
+    {                                                                          \
+        perror(msg);                                                           \
+        exit(EXIT_FAILURE);                                                    \
+    } while (0)
+
+// A closed-loop HTTP/1.1 load generator for httpd. We open CONNS
+// keep-alive connections to 127.0.0.1:PORT. Each connection requests
+// PATH, reads the complete response, and immediately sends the next
+// request. After DURATION seconds, we report the achieved requests/s and
+// throughput.
+
+struct conn
+{
+    int fd;
+    char hdr[1024]; // The response header, until we have seen it completely
+    size_t hdr_len;
+    off_t remaining; // Bytes of the body that are still to be read
+    struct timespec sent;
+};
+
+static char request[1200];
+static size_t request_len;
+
+// Statistics
+static uint64_t requests, bytes;
+static double latency_sum; // in seconds
+
+static double now()
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        die("clock_gettime");
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void send_request(struct conn *c)
+{
+    // The request is small and the socket buffer is empty, as we do
+    // not pipeline requests. Therefore, a blocking send(2) suffices.
+    if (send(c->fd, request, request_len, MSG_NOSIGNAL) != request_len)
+        die("send");
+    c->hdr_len = 0;
+    c->remaining = -1;
+    clock_gettime(CLOCK_MONOTONIC, &c->sent);
+}
+
+// Consume the received data. Returns true if the response is complete.
+static bool receive(struct conn *c, char *buf, size_t len)
+{
+    if (c->remaining < 0)
+    {
+        // We are still reading the header
+        size_t n = len < sizeof(c->hdr) - c->hdr_len - 1
+                       ? len
+                       : sizeof(c->hdr) - c->hdr_len - 1;
+        memcpy(c->hdr + c->hdr_len, buf, n);
+        c->hdr_len += n;
+        c->hdr[c->hdr_len] = 0;
+        char *end = strstr(c->hdr, "\r\n\r\n");
+        if (!end)
+        {
+            if (c->hdr_len == sizeof(c->hdr) - 1)
+                die("response header too large");
+            return false;
+        }
+        if (strncmp(c->hdr, "HTTP/1.1 200", 12) != 0)
+        {
+            fprintf(stderr, "unexpected response: %.*s\n",
+                    (int)(strchr(c->hdr, '\r') - c->hdr), c->hdr);
+            exit(EXIT_FAILURE);
+        }
+        char *cl = strcasestr(c->hdr, "Content-Length:");
+        if (!cl)
+            die("no Content-Length");
+        c->remaining = atol(cl + 15);
+
+        // The rest of the data belongs to the body
+        size_t hdr_bytes = end + 4 - c->hdr - (c->hdr_len - n);
+        buf += hdr_bytes;
+        len -= hdr_bytes;
+    }
+    c->remaining -= len;
+    bytes += len;
+    if (c->remaining < 0)
+        die("response longer than its Content-Length");
+    return c->remaining == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s PORT PATH\n", argv[0]);
+        return -1;
+    }
+    char *CONNS = getenv("CONNS");
+    int nconns = atoi(CONNS ? CONNS : "16");
+    char *DURATION = getenv("DURATION");
+    double seconds = atof(DURATION ? DURATION : "5");
+
+    request_len = snprintf(request, sizeof(request),
+                           "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n",
+                           argv[2]);
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+        die("epoll_create1");
+
+    struct sockaddr_in addr = {.sin_family = AF_INET,
+                               .sin_port = htons(atoi(argv[1])),
+                               .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    struct conn *conns = calloc(nconns, sizeof(struct conn));
+    if (!conns)
+        die("calloc");
+    for (int i = 0; i < nconns; i++)
+    {
+        struct conn *c = &conns[i];
+        c->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (c->fd < 0)
+            die("socket");
+        if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+            die("connect");
+        int one = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) < 0)
+            die("epoll_ctl");
+        send_request(c);
+    }
+
+    static char buf[256 * 1024];
+    double start = now(), end = start + seconds;
+    while (now() < end)
+    {
+        struct epoll_event events[64];
+        int nfds = epoll_wait(epoll_fd, events, 64, 100);
+        if (nfds < 0 && errno != EINTR)
+            die("epoll_wait");
+
+        for (int n = 0; n < nfds; n++)
+        {
+            struct conn *c = events[n].data.ptr;
+            ssize_t len = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (len < 0 && errno == EAGAIN)
+                continue;
+            if (len < 0)
+                die("recv");
+            if (len == 0)
+            {
+                fprintf(stderr, "server closed the connection\n");
+                exit(EXIT_FAILURE);
+            }
+            if (receive(c, buf, len))
+            {
+                struct timespec done;
+                clock_gettime(CLOCK_MONOTONIC, &done);
+                latency_sum += (done.tv_sec - c->sent.tv_sec) +
+                               (done.tv_nsec - c->sent.tv_nsec) / 1e9;
+                requests++;
+                send_request(c);
+            }
+        }
+    }
+    double delta = now() - start;
+
+    printf("%s: %lu requests in %.2f s with %d connections: %.0f req/s, "
+           "%.2f MiB/s, %.3f ms mean latency\n",
+           argv[2], requests, delta, nconns, requests / delta,
+           bytes / delta / 1024 / 1024,
+           requests ? latency_sum / requests * 1e3 : 0.0);
+}
@@ -3,14 +3,19 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <linux/io_uring.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/utsname.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -21,26 +26,468 @@
         exit(EXIT_FAILURE);                                                    \
     } while (0)
 
+// All copy strategies move the data in chunks of chunk_size bytes.
+// main() sweeps over different chunk sizes (CHUNKS).
+static size_t chunk_size = 64 * 1024;
+
+// A chunk-sized buffer for the strategies that copy through user space
+static char *chunk_buffer(void)
+{
+    static char *buf = NULL;
+    static size_t buf_size = 0;
+    if (buf_size < chunk_size)
+    {
+        free(buf);
+        if (posix_memalign((void **)&buf, 4096, chunk_size) != 0)
+            die("posix_memalign");
+        buf_size = chunk_size;
+    }
+    return buf;
+}
+
+// Copy fd_in to fd_out with a classic read(2)/write(2) loop. Every
+// byte is copied twice: from the page cache into our buffer and back
+// into the kernel.
 ssize_t copy_write(int fd_in, int fd_out, int *syscalls)
 {
+    char *buf = chunk_buffer();
     ssize_t ret = 0;
     *syscalls = 0;
+    while (true)
+    {
+        ssize_t len = read(fd_in, buf, chunk_size);
+        (*syscalls)++;
+        if (len < 0)
+            die("read");
+        if (len == 0)
+            break;
+        for (ssize_t off = 0; off < len;)
+        {
+            ssize_t rc = write(fd_out, buf + off, len - off);
+            (*syscalls)++;
+            if (rc < 0)
+                die("write");
+            off += rc;
+        }
+        ret += len;
+    }
     return ret;
 }
 
+// Copy fd_in to fd_out with sendfile(2), which copies the data within
+// the kernel.
 ssize_t copy_sendfile(int fd_in, int fd_out, int *syscalls)
 {
     ssize_t ret = 0;
     *syscalls = 0;
+    while (true)
+    {
+        ssize_t len = sendfile(fd_out, fd_in, NULL, chunk_size);
+        (*syscalls)++;
+        if (len < 0)
+            die("sendfile");
+        if (len == 0)
+            break;
+        ret += len;
+    }
     return ret;
 }
 
+// Copy fd_in to fd_out with copy_file_range(2). If both files are on
+// the same file system, the file system can implement this without
+// copying any data at all, for example, by sharing the extents
+// (reflink on Btrfs or XFS). Between different file systems, the
+// kernel may refuse with EXDEV, in which case we return -1.
+ssize_t copy_range(int fd_in, int fd_out, int *syscalls)
+{
+    ssize_t ret = 0;
+    *syscalls = 0;
+    while (true)
+    {
+        ssize_t len = copy_file_range(fd_in, NULL, fd_out, NULL, chunk_size, 0);
+        (*syscalls)++;
+        if (len < 0 && (errno == EXDEV || errno == EOPNOTSUPP ||
+                        errno == EINVAL || errno == ENOSYS))
+            return -1;
+        if (len < 0)
+            die("copy_file_range");
+        if (len == 0)
+            break;
+        ret += len;
+    }
+    return ret;
+}
+
+// Copy fd_in to fd_out with splice(2). As splice(2) requires one end to
+// be a pipe, we splice the input into an intermediate pipe and from
+// there into the output. Thereby, only page references move through
+// the pipe, not the data itself.
+ssize_t copy_splice(int fd_in, int fd_out, int *syscalls)
+{
+    static int pipe_fd[2] = {-1, -1};
+    if (pipe_fd[0] < 0 && pipe2(pipe_fd, O_CLOEXEC) < 0)
+        die("pipe2");
+
+    // A pipe can hold 64 KiB by default. We try to grow it to the
+    // chunk size, which may fail for unprivileged users beyond
+    // /proc/sys/fs/pipe-max-size.
+    int pipe_size = fcntl(pipe_fd[1], F_SETPIPE_SZ, chunk_size);
+    if (pipe_size < 0)
+        pipe_size = fcntl(pipe_fd[1], F_GETPIPE_SZ);
+    *syscalls = 1;
+
+    ssize_t ret = 0;
+    while (true)
+    {
+        ssize_t len = splice(fd_in, NULL, pipe_fd[1], NULL, pipe_size, 0);
+        (*syscalls)++;
+        if (len < 0)
+            die("splice");
+        if (len == 0)
+            break;
+        for (ssize_t off = 0; off < len;)
+        {
+            ssize_t rc = splice(pipe_fd[0], NULL, fd_out, NULL, len - off, 0);
+            (*syscalls)++;
+            if (rc < 0)
+                die("splice");
+            off += rc;
+        }
+        ret += len;
+    }
+    return ret;
+}
+
+// Map the whole input file into our address space. Returns NULL for
+// empty files, which cannot be mapped.
+static char *map_input(int fd_in, off_t *size, int *syscalls)
+{
+    struct stat st;
+    if (fstat(fd_in, &st) < 0)
+        die("fstat");
+    *size = st.st_size;
+    (*syscalls)++;
+    if (*size == 0)
+        return NULL;
+
+    char *src = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd_in, 0);
+    if (src == MAP_FAILED)
+        die("mmap");
+    (*syscalls)++;
+    return src;
+}
+
+// Copy fd_in to fd_out by mapping the input and writing chunks of the
+// mapping with write(2). Compared to read/write, we save one copy, but
+// pay for the page faults on the mapping.
+ssize_t copy_mmap_write(int fd_in, int fd_out, int *syscalls)
+{
+    off_t size;
+    *syscalls = 0;
+    char *src = map_input(fd_in, &size, syscalls);
+
+    for (off_t off = 0; off < size;)
+    {
+        size_t len = size - off < chunk_size ? size - off : chunk_size;
+        ssize_t rc = write(fd_out, src + off, len);
+        (*syscalls)++;
+        if (rc < 0)
+            die("write");
+        off += rc;
+    }
+    if (src && munmap(src, size) < 0)
+        die("munmap");
+    (*syscalls)++;
+    return size;
+}
+
+// Copy fd_in to fd_out by mapping both files and using memcpy(3). We
+// have to size the output with ftruncate(2) before we can map it.
+ssize_t copy_mmap_memcpy(int fd_in, int fd_out, int *syscalls)
+{
+    off_t size;
+    *syscalls = 0;
+    char *src = map_input(fd_in, &size, syscalls);
+    if (!src)
+        return 0;
+
+    if (ftruncate(fd_out, size) < 0)
+        die("ftruncate");
+    char *dst = mmap(NULL, size, PROT_WRITE, MAP_SHARED, fd_out, 0);
+    if (dst == MAP_FAILED)
+        die("mmap");
+    *syscalls += 2;
+
+    for (off_t off = 0; off < size; off += chunk_size)
+        memcpy(dst + off, src + off,
+               size - off < chunk_size ? size - off : chunk_size);
+
+    if (munmap(dst, size) < 0 || munmap(src, size) < 0)
+        die("munmap");
+    *syscalls += 2;
+    return size;
+}
+
+////////////////////////////////////////////////////////////////
+// A minimal io_uring for copy_uring. For a detailed discussion of the
+// rings and the memory barriers, see 16-iouring.
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int ring_fd, unsigned int to_submit,
+                              unsigned int min_complete, unsigned int flags)
+{
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                        min_complete, flags, NULL, 0);
+}
+
+#define store_release(p, v)                                                    \
+    atomic_store_explicit((_Atomic typeof(*(p)) *)(p), (v),                    \
+                          memory_order_release)
+#define load_aquire(p)                                                         \
+    atomic_load_explicit((_Atomic typeof(*(p)) *)(p), memory_order_acquire)
+
+// The number of chunks that copy_uring keeps in flight (QD)
+static unsigned queue_depth = 8;
+
+static struct
+{
+    int fd;
+    unsigned *sq_tail, sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_cqe *cqes;
+} uring = {.fd = -1};
+
+static void uring_setup(void)
+{
+    struct io_uring_params p = {0};
+    uring.fd = sys_io_uring_setup(queue_depth, &p);
+    if (uring.fd < 0)
+        die("io_uring_setup");
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    char *sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+    char *cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+    uring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      uring.fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || uring.sqes == MAP_FAILED)
+        die("mmap");
+
+    uring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    uring.sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    uring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    uring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    uring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    uring.cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+}
+
+// Queue a read or write of buf[0..len) at file offset off
+static void uring_prep(int op, int fd, char *buf, size_t len, off_t off,
+                       unsigned slot)
+{
+    unsigned tail = *uring.sq_tail;
+    unsigned idx = tail & uring.sq_mask;
+    struct io_uring_sqe *sqe = &uring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = slot;
+    uring.sq_array[idx] = idx;
+    store_release(uring.sq_tail, tail + 1);
+}
+
+// Copy fd_in to fd_out with io_uring. We keep up to queue_depth chunks
+// in flight. Each chunk (slot) alternates between a read from the
+// input and a write of the same data at the same offset to the output.
+// With a single io_uring_enter(2), we submit all prepared operations
+// and wait for at least one completion.
+ssize_t copy_uring(int fd_in, int fd_out, int *syscalls)
+{
+    static char *bufs = NULL;
+    static size_t bufs_size = 0;
+    if (uring.fd < 0)
+        uring_setup();
+    if (bufs_size < queue_depth * chunk_size)
+    {
+        free(bufs);
+        bufs_size = queue_depth * chunk_size;
+        if (posix_memalign((void **)&bufs, 4096, bufs_size) != 0)
+            die("posix_memalign");
+    }
+
+    // For each slot, we remember its current chunk [off, off+len) and
+    // how much of it is already copied (got). As reads and writes can
+    // be short, a chunk can take several read-write rounds, where
+    // the current round has read rlen bytes of which wdone are written.
+    // Like the buffers, the slots live on the heap and are reused.
+    static struct slot
+    {
+        off_t off;
+        size_t len, got, rlen, wdone;
+        bool busy, writing;
+    } *slot = NULL;
+    static unsigned slots = 0;
+    if (slots < queue_depth)
+    {
+        free(slot);
+        slots = queue_depth;
+        slot = calloc(slots, sizeof(*slot));
+        if (!slot)
+            die("calloc");
+    }
+
+    struct stat st;
+    if (fstat(fd_in, &st) < 0)
+        die("fstat");
+    *syscalls = 1;
+
+    off_t next = 0;     // Offset of the next chunk that is not yet read
+    ssize_t copied = 0; // Completely written bytes
+    unsigned in_flight = 0, to_submit = 0;
+    for (unsigned i = 0; i < queue_depth; i++)
+    {
+        slot[i].len = 0;
+        slot[i].got = 0;
+        slot[i].busy = false;
+    }
+
+    do
+    {
+        // Every idle slot starts the read of the next chunk or continues
+        // the current chunk after a short read.
+        for (unsigned i = 0; i < queue_depth; i++)
+        {
+            if (slot[i].busy)
+                continue;
+            if (slot[i].got == slot[i].len)
+            {
+                if (next >= st.st_size)
+                    continue;
+                slot[i].off = next;
+                slot[i].len = st.st_size - next < chunk_size
+                                  ? st.st_size - next
+                                  : chunk_size;
+                slot[i].got = 0;
+                next += slot[i].len;
+            }
+            slot[i].busy = true;
+            slot[i].writing = false;
+            uring_prep(IORING_OP_READ, fd_in, bufs + i * chunk_size,
+                       slot[i].len - slot[i].got, slot[i].off + slot[i].got,
+                       i);
+            in_flight++, to_submit++;
+        }
+        if (in_flight == 0)
+            break;
+
+        int rc = sys_io_uring_enter(uring.fd, to_submit, 1,
+                                    IORING_ENTER_GETEVENTS);
+        (*syscalls)++;
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc < 0)
+            die("io_uring_enter");
+        to_submit -= rc;
+
+        unsigned head = *uring.cq_head;
+        while (head != load_aquire(uring.cq_tail))
+        {
+            struct io_uring_cqe *cqe = &uring.cqes[head & uring.cq_mask];
+            unsigned i = cqe->user_data;
+            char *buf = bufs + i * chunk_size;
+            head++;
+            in_flight--;
+            if (cqe->res < 0)
+            {
+                errno = -cqe->res;
+                die(slot[i].writing ? "uring write" : "uring read");
+            }
+
+            if (!slot[i].writing)
+            {
+                // The file shrunk under our feet. Give up this chunk.
+                if (cqe->res == 0)
+                {
+                    slot[i].len = slot[i].got;
+                    slot[i].busy = false;
+                    continue;
+                }
+                slot[i].rlen = cqe->res;
+                slot[i].wdone = 0;
+                slot[i].writing = true;
+            }
+            else
+            {
+                slot[i].wdone += cqe->res;
+                if (slot[i].wdone == slot[i].rlen)
+                {
+                    // This round is written. The slot becomes idle.
+                    slot[i].got += slot[i].rlen;
+                    copied += slot[i].rlen;
+                    slot[i].busy = false;
+                    continue;
+                }
+            }
+            uring_prep(IORING_OP_WRITE, fd_out, buf + slot[i].wdone,
+                       slot[i].rlen - slot[i].wdone,
+                       slot[i].off + slot[i].got + slot[i].wdone, i);
+            in_flight++, to_submit++;
+        }
+        store_release(uring.cq_head, head);
+    } while (true);
+    return copied;
+}
+
+// Our copy strategies. Each one is measured separately.
+struct strategy
+{
+    char *name;
+    ssize_t (*copy)(int, int, int *);
+};
+
+static struct strategy strategies[] = {
+    {"sendfile", copy_sendfile},
+    {"read/write", copy_write},
+    {"copy_file_range", copy_range},
+    {"splice", copy_splice},
+    {"mmap/write", copy_mmap_write},
+    {"mmap/memcpy", copy_mmap_memcpy},
+    {"io_uring", copy_uring},
+};
+
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof(*(arr)))
+
+// The harness can emit its results as human-readable text, or as CSV
+// or JSON to compare them between machines and kernel versions.
+enum format
+{
+    FORMAT_TEXT,
+    FORMAT_CSV,
+    FORMAT_JSON,
+};
+static enum format format = FORMAT_TEXT;
+
+// Whether emit() has already opened the JSON array with its first row.
+static bool json_open = false;
+
 // This function measures the given copy implementation.
 // fd_in:  file descriptor to copy from
 // fd_out: file descriptor to copy to
 // banner: Just a nice string to print the output
 // copy:   The copy implementation
-// returns the number of bytes per second
+// returns the duration of the copy in seconds, or -1 if the copy
+// implementation is not supported for the given files.
 double measure(int fd_in, int fd_out, char *banner,
                ssize_t (*copy)(int, int, int *))
 {
@@ -51,10 +498,13 @@ double measure(int fd_in, int fd_out, char *banner,
         die("lseek");
     if (ftruncate(fd_out, 0) < 0)
         die("ftruncate");
+    if (lseek(fd_out, 0, SEEK_SET) < 0)
+        die("lseek");
 
-    // Measure the start time.
+    // Measure the start time. We use CLOCK_MONOTONIC, as
+    // CLOCK_REALTIME can jump if the system time is adjusted.
     struct timespec start, end;
-    if (clock_gettime(CLOCK_REALTIME, &start) < 0)
+    if (clock_gettime(CLOCK_MONOTONIC, &start) < 0)
         die("clock_gettime");
 
     // Perform the actual copy. We give the copy function also a
@@ -62,9 +512,11 @@ double measure(int fd_in, int fd_out, char *banner,
     // number of issued system calls.
     int syscalls;
     ssize_t bytes = copy(fd_in, fd_out, &syscalls);
+    if (bytes < 0)
+        return -1;
 
     // Measure the end time
-    if (clock_gettime(CLOCK_REALTIME, &end) < 0)
+    if (clock_gettime(CLOCK_MONOTONIC, &end) < 0)
         die("clock_gettime");
 
     // Calculate the time delta between both points in time.
@@ -72,10 +524,162 @@ double measure(int fd_in, int fd_out, char *banner,
     delta += (end.tv_nsec - start.tv_nsec) / 1e9;
 
     // Print out some nicely formatted message
-    printf("[%10s] copied with %.2f MiB/s (in %.2f s, %d syscalls)\n", banner,
-           (bytes / delta) / 1024.0 / 1024.0, delta, syscalls);
+    if (format == FORMAT_TEXT)
+        printf("[%15s] copied with %.2f MiB/s (in %.2f s, %d syscalls)\n",
+               banner, (bytes / delta) / 1024.0 / 1024.0, delta, syscalls);
+
+    return delta;
+}
 
-    return bytes / delta;
+// Drop the input file from the page cache. As we only read the input,
+// all its pages are clean and POSIX_FADV_DONTNEED evicts them. The next
+// copy then has to fetch the file from the storage device.
+static void evict(int fd)
+{
+    int rc = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    if (rc != 0)
+    {
+        errno = rc;
+        die("posix_fadvise");
+    }
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// The p-th percentile of n sorted samples (nearest rank)
+static double percentile(double *sorted, int n, double p)
+{
+    int rank = (int)(p / 100.0 * n + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    if (rank > n)
+        rank = n;
+    return sorted[rank - 1];
+}
+
+// A 95% confidence interval for the median, calculated with the
+// percentile bootstrap: We draw 1000 resamples (with replacement) from
+// our samples and take the 2.5th and 97.5th percentile of their
+// medians. Unlike the mean +- t*stddev, this makes no assumption about
+// the (usually skewed) distribution of run times.
+static void median_ci(double *samples, int n, double *lo, double *hi)
+{
+    enum
+    {
+        RESAMPLES = 1000
+    };
+    double *medians = malloc(RESAMPLES * sizeof(double));
+    double *resample = malloc(n * sizeof(double));
+    if (!medians || !resample)
+        die("malloc");
+
+    unsigned seed = 42; // Deterministic results for the same samples
+    for (int r = 0; r < RESAMPLES; r++)
+    {
+        for (int i = 0; i < n; i++)
+            resample[i] = samples[rand_r(&seed) % n];
+        qsort(resample, n, sizeof(double), cmp_double);
+        medians[r] = percentile(resample, n, 50);
+    }
+    qsort(medians, RESAMPLES, sizeof(double), cmp_double);
+    *lo = percentile(medians, RESAMPLES, 2.5);
+    *hi = percentile(medians, RESAMPLES, 97.5);
+
+    free(resample);
+    free(medians);
+}
+
+// Emit one result row in the selected output format. All times are in
+// milliseconds; the throughput is derived from the median time.
+static void emit(char *strategy, bool cold, int rounds, off_t size,
+                 double *seconds)
+{
+    static bool first = true;
+    static struct utsname uts;
+    if (first && uname(&uts) < 0)
+        die("uname");
+
+    qsort(seconds, rounds, sizeof(double), cmp_double);
+    double median = percentile(seconds, rounds, 50);
+    double p95 = percentile(seconds, rounds, 95);
+    double lo, hi;
+    median_ci(seconds, rounds, &lo, &hi);
+    double mibs = size / median / 1024.0 / 1024.0;
+    char *cache = cold ? "cold" : "warm";
+
+    switch (format)
+    {
+    case FORMAT_TEXT:
+        printf("%s/%zuK (%s cache): %.2f MiB/s, median %.3f ms, p95 %.3f ms, "
+               "95%% CI [%.3f, %.3f] ms (n=%d)\n",
+               strategy, chunk_size / 1024, cache, mibs, median * 1e3,
+               p95 * 1e3, lo * 1e3, hi * 1e3, rounds);
+        break;
+    case FORMAT_CSV:
+        if (first)
+            printf("kernel,strategy,chunk,cache,bytes,rounds,mib_s,median_ms,"
+                   "p95_ms,ci95_lo_ms,ci95_hi_ms\n");
+        printf("%s,%s,%zu,%s,%ld,%d,%.2f,%.3f,%.3f,%.3f,%.3f\n", uts.release,
+               strategy, chunk_size, cache, (long)size, rounds, mibs,
+               median * 1e3, p95 * 1e3, lo * 1e3, hi * 1e3);
+        break;
+    case FORMAT_JSON:
+        printf("%s{\"kernel\": \"%s\", \"strategy\": \"%s\", "
+               "\"chunk\": %zu, \"cache\": \"%s\", \"bytes\": %ld, "
+               "\"rounds\": %d, "
+               "\"mib_s\": %.2f, \"median_ms\": %.3f, \"p95_ms\": %.3f, "
+               "\"ci95_ms\": [%.3f, %.3f]}",
+               first ? "[\n  " : ",\n  ", uts.release, strategy, chunk_size,
+               cache,
+               (long)size, rounds, mibs, median * 1e3, p95 * 1e3, lo * 1e3,
+               hi * 1e3);
+        json_open = true;
+        break;
+    }
+    first = false;
+}
+
+// Benchmark one copy strategy: We do a few warmup runs, which are not
+// recorded, and then measure the given number of rounds. For a cold
+// benchmark, we evict the input from the page cache before every run.
+// After each run, we check that the output has the size of the input.
+static void benchmark(int fd_in, int fd_out, struct strategy *s, bool cold,
+                      int warmup, int rounds, off_t size)
+{
+    double *seconds = malloc(rounds * sizeof(double));
+    if (!seconds)
+        die("malloc");
+
+    for (int i = 0; i < warmup + rounds; i++)
+    {
+        if (cold)
+            evict(fd_in);
+        double t = measure(fd_in, fd_out, s->name, s->copy);
+        if (t < 0)
+        {
+            fprintf(stderr, "[%s] not supported for these files: %s\n",
+                    s->name, strerror(errno));
+            free(seconds);
+            return;
+        }
+        struct stat st;
+        if (fstat(fd_out, &st) < 0)
+            die("fstat");
+        if (st.st_size != size)
+        {
+            fprintf(stderr, "[%s] copied %ld of %ld bytes\n", s->name,
+                    (long)st.st_size, (long)size);
+            exit(EXIT_FAILURE);
+        }
+        if (i >= warmup)
+            seconds[i - warmup] = t;
+    }
+    emit(s->name, cold, rounds, size, seconds);
+    free(seconds);
 }
 
 int main(int argc, char *argv[])
@@ -90,32 +694,80 @@ int main(int argc, char *argv[])
     int fd_in = open(argv[1], O_RDONLY);
     if (fd_in < 0)
         die("open");
+    struct stat st;
+    if (fstat(fd_in, &st) < 0)
+        die("fstat");
 
     // As an output, we create an anonymous in-memory file. By using
     // such an in-memory file, do not measure the influence of on-disk
-    // file systems.
-    int fd_out = memfd_create("target", 0);
+    // file systems. With OUT=PATH, the user can instead copy to a file
+    // on a real file system, for example, next to the input file to
+    // let copy_file_range(2) reflink the data.
+    char *OUT = getenv("OUT");
+    int fd_out = OUT ? open(OUT, O_RDWR | O_CREAT | O_TRUNC, 0644)
+                     : memfd_create("target", 0);
+    if (fd_out < 0)
+        die("open output");
 
-    // We will run for ten rounds, unless the user specified something
-    // else in the ROUNDS environment variable.
+    // We will run for ten rounds after one warmup round, unless the
+    // user specified something else in the ROUNDS and WARMUP
+    // environment variables. With CACHE=cold or CACHE=warm, only one
+    // of both cache states is measured.
     char *ROUNDS = getenv("ROUNDS");
     int rounds = atoi(ROUNDS ? ROUNDS : "10");
+    char *WARMUP = getenv("WARMUP");
+    int warmup = atoi(WARMUP ? WARMUP : "1");
+    char *CACHE = getenv("CACHE");
+    bool do_cold = !CACHE || !strcmp(CACHE, "cold");
+    bool do_warm = !CACHE || !strcmp(CACHE, "warm");
+    if (rounds < 1 || warmup < 0 || !(do_cold || do_warm))
+    {
+        fprintf(stderr, "invalid ROUNDS, WARMUP, or CACHE\n");
+        return -1;
+    }
 
-    // We run the copy_write algorithm once to warm up the buffer
-    // cache. With this, the input file should now, if small enough,
-    // reside in in the buffer cache.
-    int dummy;
-    copy_write(fd_in, fd_out, &dummy);
+    // FORMAT=csv or FORMAT=json switches to machine-readable output.
+    char *FORMAT = getenv("FORMAT");
+    if (FORMAT && !strcmp(FORMAT, "csv"))
+        format = FORMAT_CSV;
+    else if (FORMAT && !strcmp(FORMAT, "json"))
+        format = FORMAT_JSON;
 
-    // The actual measurement
-    double sendfile = 0, write = 0;
-    for (int i = 0; i < rounds; i++)
+    // QD sets the number of chunks that io_uring keeps in flight.
+    char *QD = getenv("QD");
+    int qd = atoi(QD ? QD : "8");
+    if (qd < 1 || qd > 4096)
     {
-        sendfile += measure(fd_in, fd_out, "sendfile", copy_sendfile);
-        write += measure(fd_in, fd_out, "read/write", copy_write);
+        fprintf(stderr, "invalid QD: must be between 1 and 4096\n");
+        return -1;
     }
+    queue_depth = qd;
+
+    // We sweep over the chunk sizes (in KiB) given as a comma-separated
+    // list in CHUNKS, and measure every strategy with each of them.
+    char *CHUNKS = strdup(getenv("CHUNKS") ? getenv("CHUNKS") : "4,64,1024");
+    for (char *save, *chunk = strtok_r(CHUNKS, ",", &save); chunk;
+         chunk = strtok_r(NULL, ",", &save))
+    {
+        chunk_size = atoi(chunk) * 1024ul;
+        if (chunk_size == 0)
+        {
+            fprintf(stderr, "invalid chunk size: %s\n", chunk);
+            return -1;
+        }
 
-    // Print the average MiB/s for both copy algorithms
-    printf("sendfile: %.2f MiB/s, read/write: %.2f MiB/s\n",
-           sendfile / rounds / (1024 * 1024), write / rounds / (1024 * 1024));
+        // The actual measurement
+        for (int i = 0; i < ARRAY_SIZE(strategies); i++)
+        {
+            if (do_cold)
+                benchmark(fd_in, fd_out, &strategies[i], true, warmup, rounds,
+                          st.st_size);
+            if (do_warm)
+                benchmark(fd_in, fd_out, &strategies[i], false, warmup,
+                          rounds, st.st_size);
+        }
+    }
+    free(CHUNKS);
+    if (format == FORMAT_JSON)
+        printf(json_open ? "\n]\n" : "[]\n");
 }
@@ -1,10 +1,23 @@
-
-int fifo_prepare(int epoll_fd)
+int fifo_prepare(void)
 {
     printf("... by fifo:   echo 1 > fifo\n");
-    return -1;
+
+    if (mkfifo("fifo", 0666) < 0 && errno != EEXIST)
+        die("mkfifo");
+
+    // We open the FIFO for reading *and* writing. Thereby, there is
+    // always at least one writer (us), and we do not get an EPOLLHUP
+    // every time an `echo` closes its end.
+    int fifo_fd = open("fifo", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fifo_fd < 0)
+        die("open");
+    return fifo_fd;
 }
 
-void fifo_handle(int epoll_fd, int fifo_fd, int events)
+void fifo_handle(int epoll_fd, struct handler *self, int events)
 {
+    char buf[PIPE_BUF];
+    ssize_t len = read(self->fd, buf, sizeof(buf));
+    if (len > 0)
+        deliver("fifo", buf, len);
 }
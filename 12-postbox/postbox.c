@@ -12,6 +12,7 @@
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -27,84 +28,217 @@
         exit(EXIT_FAILURE);                                                    \
     } while (0)
 
-// Adds a file descriptor to an open epoll instance's list of
+// Every file descriptor in our epoll set is represented by a handler
+// object. We register the address of the handler as epoll_event.data.ptr.
+// Thereby, the kernel hands us the handler with each event, and we can
+// dispatch it with a single indirect call, regardless of how many
+// descriptors we watch. Objects with more state (e.g., a client
+// connection) embed the handler as their first member.
+struct handler
+{
+    int fd;
+    void (*handle)(int epoll_fd, struct handler *self, int events);
+};
+
+// Adds a handler's file descriptor to an open epoll instance's list of
 // interesting file descriptors.
-//// events -  For which events are we waiting (usually EPOLLIN)
-//// data   -  The kernel returns this data when an event occurs
-void epoll_add(int epoll_fd, int fd, int events)
+//// events  -  For which events are we waiting (usually EPOLLIN)
+//// handler -  The kernel returns this pointer when an event occurs
+void epoll_add(int epoll_fd, struct handler *h, int events)
 {
     struct epoll_event ev;
     ev.events = events;
-    ev.data.fd = fd;
+    ev.data.ptr = h;
 
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, h->fd, &ev) == -1)
     {
         die("epoll_ctl: activate");
     }
 }
 
-// Remove a file descriptor from the interest list.
-void epoll_del(int epoll_fd, int fd)
+// Remove a handler's file descriptor from the interest list.
+void epoll_del(int epoll_fd, struct handler *h)
 {
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1)
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, h->fd, NULL) == -1)
     {
         die("epoll_ctl: reset");
     }
 }
 
+////////////////////////////////////////////////////////////////
+// Slab Allocator
+//
+// Per-connection objects all have the same size and come and go
+// frequently. A slab carves them in batches from one large allocation
+// and keeps freed objects on a single-linked free list, which uses the
+// memory of the free objects themselves.
+struct slab
+{
+    size_t size; // Size of one object (at least a pointer)
+    void *free;  // Stack of freed objects
+    char *chunk; // Unused rest of the last batch
+    size_t left; // Number of objects left in chunk
+};
+
+#define SLAB_BATCH 1024
+
+void *slab_alloc(struct slab *s)
+{
+    void *obj = s->free;
+    if (obj)
+    {
+        s->free = *(void **)obj; // Pop
+        return obj;
+    }
+    if (s->left == 0)
+    {
+        s->chunk = malloc(s->size * SLAB_BATCH);
+        if (!s->chunk)
+            die("malloc");
+        s->left = SLAB_BATCH;
+    }
+    obj = s->chunk;
+    s->chunk += s->size;
+    s->left--;
+    return obj;
+}
+
+void slab_free(struct slab *s, void *obj)
+{
+    *(void **)obj = s->free; // Push
+    s->free = obj;
+}
+
+////////////////////////////////////////////////////////////////
+// Message Delivery
+//
+// All transports hand their received messages to deliver(). With
+// QUIET set, we do not print the messages but only count them.
+static bool quiet;
+static uint64_t delivered;
+
+void deliver(const char *box, const char *msg, size_t len)
+{
+    delivered++;
+    if (quiet)
+        return;
+    while (len > 0 && msg[len - 1] == '\n')
+        len--;
+    printf("%s: %.*s\n", box, (int)len, msg);
+}
+
 #include "domain.c"
 #include "fifo.c"
 
 struct postbox
 {
-    int fd;
-    int (*prepare)(int epoll_fd);
-    void (*handle)(int epoll_fd, int fd, int events);
+    struct handler handler; // Registered with epoll
+    int (*prepare)(void);   // Returns the file descriptor of the postbox
 };
 
 struct postbox boxes[] = {
-    {-1, fifo_prepare, fifo_handle},
-    {-1, domain_prepare, domain_accept},
-    // This must be the last entry
-    {-1, NULL, domain_recv}, // Fallback
+    {{-1, fifo_handle}, fifo_prepare},
+    {{-1, domain_accept}, domain_prepare},
 };
 
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof(*(arr)))
 
+// For comparison (DISPATCH=scan), we emulate the dispatcher that we
+// had before handler objects: For every event, it searched boxes[]
+// for the event's file descriptor and used the fallback handler
+// (domain_recv) for everything else, that is, all client connections.
+static void dispatch_scan(int epoll_fd, struct handler *h, int events)
+{
+    for (int i = 0; i < ARRAY_SIZE(boxes); i++)
+    {
+        if (boxes[i].handler.fd == h->fd)
+        {
+            boxes[i].handler.handle(epoll_fd, h, events);
+            return;
+        }
+    }
+    domain_recv(epoll_fd, h, events);
+}
+
+// With QUIET set, we print the number of handled events and delivered
+// messages once per second.
+static void print_stats(uint64_t *events)
+{
+    static struct timespec last = {0};
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+        die("clock_gettime");
+    if (now.tv_sec > last.tv_sec && last.tv_sec > 0)
+    {
+        double delta = now.tv_sec - last.tv_sec;
+        delta += (now.tv_nsec - last.tv_nsec) / 1e9;
+        fprintf(stderr, "%.0f events/s, %.0f messages/s\n", *events / delta,
+                delivered / delta);
+        *events = 0;
+        delivered = 0;
+        last = now;
+    }
+    else if (last.tv_sec == 0)
+    {
+        last = now;
+    }
+}
+
 int main()
 {
+    quiet = getenv("QUIET") != NULL;
+    char *DISPATCH = getenv("DISPATCH");
+    bool scan = DISPATCH && !strcmp(DISPATCH, "scan");
+
+    // Every client connection costs us a file descriptor. We raise our
+    // soft limit to the hard limit.
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
     int epoll_fd = epoll_create1(0);
     if (epoll_fd == -1)
         die("epoll_create");
 
     printf("Santas Postbox is open! Send your requests ...\n");
-    // Initialize all backends by calling the prepare method
+    // Initialize all backends by calling the prepare method and add
+    // them to the epoll set.
     for (int i = 0; i < ARRAY_SIZE(boxes); i++)
     {
-        if (boxes[i].prepare)
-        {
-            boxes[i].fd = boxes[i].prepare(epoll_fd);
-        }
+        boxes[i].handler.fd = boxes[i].prepare();
+        epoll_add(epoll_fd, &boxes[i].handler, EPOLLIN);
     }
+    fflush(stdout);
+
+    uint64_t nevents = 0;
     while (true)
     {
         // We use epoll_wait(2) to wait for at least one event, but we
         // can receive up to ten events. We do not set a timeout but
-        // wait forever if necessary.
+        // wait forever if necessary (unless we print statistics, or the
+        // domain-socket listener is paused; see domain_accept()).
         struct epoll_event event[10];
-        int nfds = epoll_wait(epoll_fd, event, 10, -1);
+        int nfds =
+            epoll_wait(epoll_fd, event, 10, domain_timeout(quiet ? 1000 : -1));
+        domain_resume(epoll_fd);
+        if (nfds < 0 && errno == EINTR)
+            continue;
+        if (nfds < 0)
+            die("epoll_wait");
 
         for (int n = 0; n < nfds; n++)
         {
-            int fd = event[n].data.fd;
-            for (int i = 0; i < ARRAY_SIZE(boxes); i++)
-            {
-                if (boxes[i].fd == fd || boxes[i].fd == -1)
-                {
-                    boxes[i].handle(epoll_fd, fd, event[n].events);
-                    break;
-                }
-            }
+            struct handler *h = event[n].data.ptr;
+            if (scan)
+                dispatch_scan(epoll_fd, h, event[n].events);
+            else
+                h->handle(epoll_fd, h, event[n].events);
         }
+        nevents += nfds;
+        if (quiet)
+            print_stats(&nevents);
     }
 }
@@ -0,0 +1,60 @@
+// A datagram socket has no connections. All clients send to the same
+// socket, and every datagram is one message. Thereby, we can fetch a
+// whole batch of messages, from different clients, with a single
+// recvmmsg(2). The batch buffers are static, as the datagram box lives
+// on shard 0 only.
+#define DGRAM_BATCH 64
+#define DGRAM_SIZE 4096
+
+static char dgram_bufs[DGRAM_BATCH][DGRAM_SIZE];
+static struct iovec dgram_iovs[DGRAM_BATCH];
+static struct mmsghdr dgram_msgs[DGRAM_BATCH];
+
+int dgram_prepare(void)
+{
+    printf("... by dgram:  echo 5 | socat - UNIX-SENDTO:dgram\n");
+
+    int sock_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock_fd < 0)
+        die("socket");
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX, .sun_path = "dgram"};
+    unlink(addr.sun_path);
+    if (bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        die("bind");
+
+    for (int i = 0; i < DGRAM_BATCH; i++)
+    {
+        dgram_iovs[i] = (struct iovec){dgram_bufs[i], DGRAM_SIZE};
+        dgram_msgs[i].msg_hdr.msg_iov = &dgram_iovs[i];
+        dgram_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    return sock_fd;
+}
+
+// Every datagram that the io_uring backend has read is one message
+void dgram_consume(struct line_buf *lb, const char *data, size_t len)
+{
+    deliver("dgram", data, len);
+}
+
+void dgram_handle(int epoll_fd, struct handler *self, int events)
+{
+    // We receive batches until one comes back incomplete, which means
+    // that the socket is (very likely) empty. Thereby, we save the
+    // epoll round trip per batch and the final EAGAIN.
+    unsigned vlen = batch_size < DGRAM_BATCH ? batch_size : DGRAM_BATCH;
+    int n;
+    do
+    {
+        n = recvmmsg(self->fd, dgram_msgs, vlen, MSG_DONTWAIT, NULL);
+        count_syscalls(1);
+        if (n <= 0)
+            break;
+
+        struct message batch[DGRAM_BATCH];
+        for (int i = 0; i < n; i++)
+            batch[i] = (struct message){dgram_bufs[i], dgram_msgs[i].msg_len};
+        deliver_batch("dgram", batch, n);
+    } while (n == vlen && batch_size > 1);
+}
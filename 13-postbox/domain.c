@@ -1,13 +1,131 @@
-int domain_prepare(int epoll_fd)
+// Per-connection state of a domain-socket client. As epoll hands us a
+// pointer to the handler, it has to be the first member.
+struct client
+{
+    struct handler handler;
+    struct line_buf lines; // A partially received line
+};
+
+// Each shard has its own slab of clients, which it uses without locks.
+static __thread struct slab clients = {.size = sizeof(struct client)};
+
+int domain_prepare(void)
 {
     printf("... by socket: echo 2 | nc -U socket\n");
-    return -1;
+
+    int sock_fd =
+        socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock_fd < 0)
+        die("socket");
+
+    // Remove a stale socket file from a previous run
+    struct sockaddr_un addr = {.sun_family = AF_UNIX, .sun_path = "socket"};
+    unlink(addr.sun_path);
+    if (bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        die("bind");
+    if (listen(sock_fd, SOMAXCONN) < 0)
+        die("listen");
+    return sock_fd;
+}
+
+// Every line that was received is one message
+void domain_consume(struct line_buf *lb, const char *data, size_t len)
+{
+    deliver_lines("socket", lb, data, len);
+}
+
+void domain_recv(int epoll_fd, struct handler *self, int events)
+{
+    struct client *client = (struct client *)self;
+    char buf[4096];
+    ssize_t len = recv(self->fd, buf, sizeof(buf), 0);
+    count_syscalls(1);
+    if (len > 0)
+    {
+        domain_consume(&client->lines, buf, len);
+        return;
+    }
+    if (len < 0 && errno == EAGAIN)
+        return;
+
+    // The client has closed the connection (or it broke down)
+    epoll_del(epoll_fd, self);
+    close(self->fd);
+    count_syscalls(2);
+    line_free(&client->lines);
+    slab_free(&clients, client);
+}
+
+// If we run out of file descriptors (or memory), accept4 fails, but the
+// connection stays pending. As the listen socket is level-triggered,
+// epoll_wait would report it again at once and we would spin. Instead,
+// the shard takes its listener out of the epoll set and puts it back
+// after ACCEPT_BACKOFF milliseconds (see domain_resume()).
+#define ACCEPT_BACKOFF 100
+
+static __thread struct handler *paused; // The listener that we took out
+static __thread uint64_t resume_at;     // CLOCK_MONOTONIC, in ms
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void domain_accept(int epoll_fd, struct handler *self, int events)
+{
+    // We accept all pending connections at once. With several shards,
+    // however, we accept only one connection per event. Thereby, a burst
+    // of connections spreads over all shards that the kernel wakes up.
+    while (true)
+    {
+        int fd = accept4(self->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            count_syscalls(1); // The accept4 that failed
+            if (errno == ECONNABORTED || errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                return;
+            perror("accept4");
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+                errno == ENOMEM)
+            {
+                epoll_del(epoll_fd, self);
+                count_syscalls(1);
+                paused = self;
+                resume_at = now_ms() + ACCEPT_BACKOFF;
+            }
+            return;
+        }
+        count_syscalls(2); // accept4 and epoll_ctl
+        struct client *client = slab_alloc(&clients);
+        client->handler.fd = fd;
+        client->handler.handle = domain_recv;
+        client->lines = (struct line_buf){NULL, 0};
+        epoll_add(epoll_fd, &client->handler, EPOLLIN);
+        if (nshards > 1)
+            return;
+    }
 }
 
-void domain_accept(int epoll_fd, int sock_fd, int events)
+// The timeout for the shard's next epoll_wait: forever, unless we have
+// to put the listener back.
+int domain_timeout(void)
 {
+    if (!paused)
+        return -1;
+    uint64_t now = now_ms();
+    return resume_at > now ? resume_at - now : 0;
 }
 
-void domain_recv(int epoll_fd, int sock_fd, int events)
+// Put a paused listener back into the epoll set when its time has come
+void domain_resume(int epoll_fd)
 {
+    if (!paused || now_ms() < resume_at)
+        return;
+    epoll_add(epoll_fd, paused, EPOLLIN | EPOLLEXCLUSIVE);
+    count_syscalls(1);
+    paused = NULL;
 }
@@ -0,0 +1,76 @@
+////////////////////////////////////////////////////////////////
+// Latency Histograms
+//
+// Messages from loadgen carry their send time as "@<ns>" (on
+// CLOCK_MONOTONIC). On delivery, we sort the latency of each message
+// into a log-linear histogram: every power of two is split into
+// HIST_SUB linear buckets, which bounds the relative error to 1/HIST_SUB.
+// Thereby, recording costs only a few instructions, and percentiles
+// over many messages remain precise enough.
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 40 // ~18 minutes; larger latencies land in the last bucket
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB)
+
+// We keep one histogram per transport
+static const char *transports[] = {"fifo",  "socket", "signal",
+                                   "mqueue", "dgram", "ring"};
+#define NTRANSPORTS (sizeof(transports) / sizeof(*transports))
+
+static int transport_index(const char *box)
+{
+    for (int i = 0; i < NTRANSPORTS; i++)
+    {
+        if (!strcmp(transports[i], box))
+            return i;
+    }
+    assert(!"unknown transport");
+    return 0;
+}
+
+static int hist_bucket(uint64_t ns)
+{
+    if (ns < HIST_SUB)
+        return ns;
+    int exp = 63 - __builtin_clzll(ns);
+    int sub = (ns >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1);
+    int bucket = (exp - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+    return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+// The smallest latency that falls into bucket
+static uint64_t hist_value(int bucket)
+{
+    if (bucket < HIST_SUB)
+        return bucket;
+    int exp = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+    uint64_t sub = bucket % HIST_SUB;
+    return (HIST_SUB + sub) << (exp - HIST_SUB_BITS);
+}
+
+// The p-th percentile (nearest rank) of a histogram with total entries
+static uint64_t hist_percentile(const uint64_t *hist, uint64_t total, double p)
+{
+    uint64_t rank = (uint64_t)(p / 100 * total + 0.999999), seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++)
+    {
+        seen += hist[b];
+        if (seen >= rank && seen > 0)
+            return hist_value(b);
+    }
+    return hist_value(HIST_BUCKETS - 1);
+}
+
+// Messages from loadgen carry their send time as "@<ns>", optionally
+// followed by padding, and end with a newline. Returns 0 for other
+// messages, and also for a message that a stream transport has cut in
+// half.
+static uint64_t send_time(const char *data, size_t len)
+{
+    if (len < 3 || data[0] != '@' || data[len - 1] != '\n')
+        return 0;
+    uint64_t ns = 0;
+    for (size_t i = 1; i < len - 1 && data[i] >= '0' && data[i] <= '9'; i++)
+        ns = ns * 10 + (data[i] - '0');
+    return ns;
+}
@@ -0,0 +1,335 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <mqueue.h>
+#include <sched.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ring.h"
+
+#define die(msg)                                                               \
+    do                                                                         \
+    {                                                                          \
+        perror(msg);                                                           \
+        exit(EXIT_FAILURE);                                                    \
+    } while (0)
+
+// Connect CLIENTS clients to a postbox and send
+// one message from each client after the other for DURATION seconds.
+// With THREADS=N, the clients are split among N sending threads.
+// Start the postbox with QUIET=1 to see how many events it handles.
+//
+// TRANSPORT selects the postbox: socket (default), fifo, dgram, mqueue,
+// shm, or signal. For signal, PID names the postbox process, and the
+// clients only determine how many messages a round has. With BURST=N,
+// each client sends N messages back to back before the next client
+// follows. For dgram, a burst is a single sendmmsg(2).
+//
+// Every message carries its send time ("@<ns>" on CLOCK_MONOTONIC), from
+// which the postbox computes latency histograms. By default, we send
+// as fast as we can. With RATE=R, we send R messages/s in total, and
+// stamp every message with the time when it was due, not when we got to
+// send it. Thereby, a sender that falls behind cannot hide the latency
+// that the backlog causes (coordinated omission). With SIZE=N, every
+// message is padded to N bytes (at most PIPE_BUF).
+
+static double now()
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        die("clock_gettime");
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int *fds;            // The connected clients
+static int nclients;        // Number of clients
+static int nthreads;        // Number of sending threads
+static double end;          // Time when we stop sending
+static unsigned long *sent; // Sent messages per thread
+static int burst;           // Messages per client and round
+
+enum transport
+{
+    SOCKET,
+    DGRAM,
+    MQUEUE,
+    SHM,
+    FIFO,
+    SIGNAL,
+} transport;
+
+static int size = 32; // Buffer size for one message, see stamp()
+static int padded;    // SIZE, or 0 for unpadded messages
+static pid_t pid;     // TRANSPORT=signal: the postbox
+static double rate; // RATE: messages/s over all threads, 0 for no limit
+
+static struct shm_ring **rings; // TRANSPORT=shm: the ring of each client
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Format a message with send time t (or now, if t is 0) into msg[size].
+// Returns its length.
+static int stamp(char *msg, uint64_t t)
+{
+    int len = snprintf(msg, size, "@%" PRIu64 "\n", t ? t : now_ns());
+    if (padded > len)
+    {
+        memset(msg + len - 1, '.', padded - len);
+        msg[padded - 1] = '\n';
+        len = padded;
+    }
+    return len;
+}
+
+// Send a burst of messages from client i, which were due at time t
+static void send_burst(int i, uint64_t t)
+{
+    if (transport == DGRAM)
+    {
+        char bufs[burst][size];
+        struct iovec iovs[burst];
+        struct mmsghdr msgs[burst];
+        for (int m = 0; m < burst; m++)
+        {
+            iovs[m] = (struct iovec){bufs[m], stamp(bufs[m], t)};
+            msgs[m] = (struct mmsghdr){.msg_hdr = {.msg_iov = &iovs[m],
+                                                   .msg_iovlen = 1}};
+        }
+        // The socket blocks while the postbox's receive queue is full
+        for (int done = 0; done < burst;)
+        {
+            int n = sendmmsg(fds[i], msgs + done, burst - done, 0);
+            if (n < 0)
+                die("sendmmsg");
+            done += n;
+        }
+        return;
+    }
+    for (int m = 0; m < burst; m++)
+    {
+        if (transport == SIGNAL)
+        {
+            // The kernel queues only a limited number of real-time
+            // signals (RLIMIT_SIGPENDING). If they are used up, we wait
+            // for the postbox to catch up.
+            union sigval value = {.sival_ptr = (void *)(t ? t : now_ns())};
+            while (sigqueue(pid, SIGRTMIN, value) < 0)
+            {
+                if (errno != EAGAIN)
+                    die("sigqueue");
+                sched_yield();
+            }
+            continue;
+        }
+        char msg[size];
+        int len = stamp(msg, t);
+        if (transport == SHM)
+        {
+            // If the ring is full, the postbox is busy with draining it
+            bool wake;
+            while (!shm_ring_push(rings[i], msg, len, &wake))
+                sched_yield();
+            if (wake)
+                shm_ring_wake(fds[i]);
+            continue;
+        }
+        if (transport == FIFO ? write(fds[i], msg, len) != len
+            : transport == MQUEUE
+                ? mq_send(fds[i], msg, len, 0) < 0
+                : send(fds[i], msg, len, MSG_NOSIGNAL) != len)
+            die("send");
+    }
+}
+
+static void *sender(void *arg)
+{
+    long id = (long)arg;
+    int from = nclients * id / nthreads, to = nclients * (id + 1) / nthreads;
+
+    // With a RATE, the next burst of this thread is due every interval
+    uint64_t interval = rate > 0 ? 1e9 * burst * nthreads / rate : 0;
+    uint64_t due = now_ns();
+    while (now() < end)
+    {
+        for (int i = from; i < to; i++)
+        {
+            if (!interval)
+            {
+                send_burst(i, 0);
+                continue;
+            }
+            if (due > now_ns())
+            {
+                struct timespec ts = {due / 1000000000, due % 1000000000};
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+            }
+            send_burst(i, due);
+            due += interval;
+        }
+        sent[id] += (to - from) * burst;
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s CLIENTS\n", argv[0]);
+        return -1;
+    }
+    nclients = atoi(argv[1]);
+    char *THREADS = getenv("THREADS");
+    nthreads = atoi(THREADS ? THREADS : "1");
+    if (nthreads < 1)
+        nthreads = 1;
+    // Every thread sends for its own share of the clients. A thread
+    // without clients would only spin and dilute the RATE.
+    if (nclients < 1)
+    {
+        fprintf(stderr, "usage: %s CLIENTS (at least 1)\n", argv[0]);
+        return -1;
+    }
+    if (nthreads > nclients)
+        nthreads = nclients;
+    char *DURATION = getenv("DURATION");
+    double duration = atof(DURATION ? DURATION : "5");
+    char *BURST = getenv("BURST");
+    burst = atoi(BURST ? BURST : "1");
+    if (burst < 1)
+        burst = 1;
+    char *TRANSPORT = getenv("TRANSPORT");
+    if (!TRANSPORT || !strcmp(TRANSPORT, "socket"))
+        transport = SOCKET;
+    else if (!strcmp(TRANSPORT, "dgram"))
+        transport = DGRAM;
+    else if (!strcmp(TRANSPORT, "mqueue"))
+        transport = MQUEUE;
+    else if (!strcmp(TRANSPORT, "shm"))
+        transport = SHM;
+    else if (!strcmp(TRANSPORT, "fifo"))
+        transport = FIFO;
+    else if (!strcmp(TRANSPORT, "signal"))
+        transport = SIGNAL;
+    else
+    {
+        fprintf(stderr, "unknown TRANSPORT: %s\n", TRANSPORT);
+        return -1;
+    }
+    char *PID = getenv("PID");
+    pid = PID ? atoi(PID) : 0;
+    if (transport == SIGNAL && pid <= 0)
+    {
+        fprintf(stderr, "TRANSPORT=signal requires the PID of the postbox\n");
+        return -1;
+    }
+    char *SIZE = getenv("SIZE");
+    padded = SIZE ? atoi(SIZE) : 0;
+    if (padded > PIPE_BUF)
+        padded = PIPE_BUF;
+    if (padded > size)
+        size = padded;
+    char *RATE = getenv("RATE");
+    rate = RATE ? atof(RATE) : 0;
+
+    // Each client costs us a file descriptor
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    fds = malloc(nclients * sizeof(int));
+    sent = calloc(nthreads, sizeof(unsigned long));
+    rings = calloc(nclients, sizeof(struct shm_ring *));
+    if (!fds || !sent || !rings)
+        die("malloc");
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strcpy(addr.sun_path, transport == DGRAM ? "dgram" : "socket");
+    for (int i = 0; i < nclients; i++)
+    {
+        if (transport == MQUEUE)
+        {
+            fds[i] = mq_open("/postbox", O_WRONLY);
+            if (fds[i] < 0)
+                die("mq_open");
+            continue;
+        }
+        if (transport == SHM)
+        {
+            fds[i] = shm_ring_connect("ring", &rings[i]);
+            if (fds[i] < 0)
+                die("shm_ring_connect");
+            continue;
+        }
+        if (transport == FIFO)
+        {
+            // Writes of up to PIPE_BUF bytes are atomic. Thereby, the
+            // messages of several clients do not interleave.
+            fds[i] = open("fifo", O_WRONLY | O_CLOEXEC);
+            if (fds[i] < 0)
+                die("open");
+            continue;
+        }
+        if (transport == SIGNAL)
+        {
+            fds[i] = -1;
+            continue;
+        }
+        fds[i] = socket(AF_UNIX,
+                        (transport == DGRAM ? SOCK_DGRAM : SOCK_STREAM) |
+                            SOCK_CLOEXEC,
+                        0);
+        if (fds[i] < 0)
+            die("socket");
+        // The listen backlog is limited. If it is full, we wait a
+        // moment for the postbox to accept the pending connections.
+        while (connect(fds[i], (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            if (errno != EAGAIN)
+                die("connect");
+            usleep(1000);
+        }
+    }
+    fprintf(stderr, "%d clients connected\n", nclients);
+
+    double start = now();
+    end = start + duration;
+    pthread_t threads[nthreads];
+    for (long i = 0; i < nthreads; i++)
+    {
+        if (pthread_create(&threads[i], NULL, sender, (void *)i) != 0)
+            die("pthread_create");
+    }
+    unsigned long total = 0;
+    for (int i = 0; i < nthreads; i++)
+    {
+        pthread_join(threads[i], NULL);
+        total += sent[i];
+    }
+    double delta = now() - start;
+    printf("%lu messages in %.2f s: %.0f messages/s", total, delta,
+           total / delta);
+    // We sustained the rate if we did not fall behind the schedule
+    if (rate > 0)
+        printf(" (RATE=%.0f %s)", rate,
+               total / delta >= 0.99 * rate ? "sustained" : "NOT sustained");
+    printf("\n");
+}
@@ -0,0 +1,298 @@
+////////////////////////////////////////////////////////////////
+// Persistent Message Log (LOG=dir)
+//
+// With LOG=dir, we append every delivered message to a log in dir.
+// Each shard writes its own sequence of segments (SSS-NNNNNNNN.seg),
+// so appending needs no lock. A segment is a file of LOG_SEGMENT MiB
+// (default 64) that we map with MAP_SHARED and fill with records:
+//
+//   | crc | len | timestamp | transport | pad | data ... | pad to 8 |
+//
+// The message is copied exactly once: from the receive buffer (or the
+// shared-memory ring) into the mapped page cache. There is no write(2)
+// per message; the kernel writes dirty pages back in the background.
+// We reserve the blocks of a segment with fallocate(2) when we create
+// it. Thereby, a full disk cannot kill us with SIGBUS on a page fault.
+//
+// The log survives crashes of the postbox, as the data is already in
+// the page cache. After a power failure, however, the records since the
+// last write back are lost; the CRC detects a torn record.
+//
+// On startup, we replay all segments. Replay stops at the first
+// invalid record of a segment. The last segment of each shard is then
+// continued after its last valid record.
+
+struct log_record
+{
+    uint32_t crc;       // CRC-32C of the rest of the header and the data
+    uint32_t len;       // Length of the data
+    uint64_t timestamp; // Delivery time (CLOCK_REALTIME ns), 0 marks the end
+    uint8_t transport;  // Index into transports[]
+    uint8_t pad[7];
+};
+
+#define LOG_ALIGN(len) (((len) + sizeof(struct log_record) + 7) & ~(size_t)7)
+
+struct log
+{
+    unsigned seq; // Number of the current segment
+    char *map;    // The mapped segment (or NULL)
+    size_t off;   // Where the next record goes
+};
+
+static const char *log_dir;     // LOG
+static size_t log_segment_size; // LOG_SEGMENT
+
+// The CRC-32C (Castagnoli) polynomial, which x86 computes in hardware
+static uint32_t crc32c_table[256];
+
+static void crc32c_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+        crc32c_table[i] = crc;
+    }
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const char *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        crc = crc32c_table[(crc ^ (uint8_t)data[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_hw(uint32_t crc, const char *data, size_t len)
+{
+    uint64_t crc64 = crc;
+    for (; len >= 8; data += 8, len -= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+    }
+    crc = crc64;
+    for (; len > 0; data++, len--)
+        crc = __builtin_ia32_crc32qi(crc, *data);
+    return crc;
+}
+#endif
+
+static uint32_t crc32c(const char *data, size_t len)
+{
+#if defined(__x86_64__)
+    static int hw = -1;
+    if (hw < 0)
+        hw = __builtin_cpu_supports("sse4.2");
+    if (hw)
+        return ~crc32c_hw(~0u, data, len);
+#endif
+    return ~crc32c_sw(~0u, data, len);
+}
+
+// The checksum covers everything after the crc field
+static uint32_t log_crc(const struct log_record *rec)
+{
+    return crc32c((const char *)rec + sizeof(rec->crc),
+                  sizeof(*rec) - sizeof(rec->crc) + rec->len);
+}
+
+static void log_path(char *path, size_t size, int shard_id, unsigned seq)
+{
+    snprintf(path, size, "%s/%03d-%08u.seg", log_dir, shard_id, seq);
+}
+
+// Map segment seq of a shard for appending at offset off. If we
+// continue an existing segment, we zero everything after off, as
+// remains of torn records must not appear valid after our records.
+static void log_open(struct log *l, int shard_id, unsigned seq, size_t off)
+{
+    char path[PATH_MAX];
+    log_path(path, sizeof(path), shard_id, seq);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        die("open: log segment");
+    int rc = posix_fallocate(fd, 0, log_segment_size);
+    if (rc == EOPNOTSUPP || rc == EINVAL)
+        rc = ftruncate(fd, log_segment_size) < 0 ? errno : 0;
+    if (rc != 0)
+    {
+        errno = rc;
+        die("posix_fallocate: log segment");
+    }
+    bool zeroed = off == 0 || fallocate(fd, FALLOC_FL_ZERO_RANGE, off,
+                                        log_segment_size - off) == 0;
+
+    l->map = mmap(NULL, log_segment_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  fd, 0);
+    if (l->map == MAP_FAILED)
+        die("mmap: log segment");
+    close(fd);
+    if (!zeroed)
+        memset(l->map + off, 0, log_segment_size - off);
+    l->seq = seq;
+    l->off = off;
+}
+
+// Append a batch of messages of one transport to the shard's log.
+// Returns the number of bytes that the records take.
+static size_t log_append(struct log *l, int shard_id, int transport,
+                         const struct message *msgs, size_t n)
+{
+    size_t appended = 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        size_t need = LOG_ALIGN(msgs[i].len);
+        if (need > log_segment_size)
+            continue; // Cannot happen with LOG_SEGMENT >= 1 MiB
+        if (l->off + need > log_segment_size)
+        {
+            // The rest of the segment stays zero, which marks its end
+            munmap(l->map, log_segment_size);
+            log_open(l, shard_id, l->seq + 1, 0);
+        }
+        struct log_record *rec = (struct log_record *)(l->map + l->off);
+        rec->len = msgs[i].len;
+        rec->timestamp = now;
+        rec->transport = transport;
+        memcpy(rec + 1, msgs[i].data, msgs[i].len);
+        rec->crc = log_crc(rec);
+        l->off += need;
+        appended += need;
+    }
+    return appended;
+}
+
+// Returns the length of the valid records at the start of a segment
+static size_t log_scan(const char *map, size_t size, uint64_t *records)
+{
+    size_t off = 0;
+    while (off + sizeof(struct log_record) <= size)
+    {
+        const struct log_record *rec = (const void *)(map + off);
+        if (rec->timestamp == 0 || rec->len > size ||
+            off + LOG_ALIGN(rec->len) > size || rec->crc != log_crc(rec) ||
+            rec->transport >= NTRANSPORTS)
+            break;
+        if (!quiet)
+            printf("replay %s: %.*s\n", transports[rec->transport],
+                   (int)(rec->len && ((char *)(rec + 1))[rec->len - 1] == '\n'
+                             ? rec->len - 1
+                             : rec->len),
+                   (const char *)(rec + 1));
+        (*records)++;
+        off += LOG_ALIGN(rec->len);
+    }
+    return off;
+}
+
+struct log_segment
+{
+    int shard;
+    unsigned seq;
+};
+
+static int log_segment_cmp(const void *a, const void *b)
+{
+    const struct log_segment *x = a, *y = b;
+    if (x->shard != y->shard)
+        return x->shard < y->shard ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+// Replay the log in LOG and open a segment for every shard
+static void log_start(void)
+{
+    crc32c_init();
+    if (mkdir(log_dir, 0755) < 0 && errno != EEXIST)
+        die("mkdir: LOG");
+
+    // Find all segments and sort them by shard and sequence number
+    DIR *dir = opendir(log_dir);
+    if (!dir)
+        die("opendir: LOG");
+    struct log_segment *segs = NULL;
+    size_t nsegs = 0, cap = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)))
+    {
+        struct log_segment seg;
+        char suffix[8];
+        if (sscanf(de->d_name, "%3d-%8u.%3s", &seg.shard, &seg.seq, suffix) !=
+                3 ||
+            strcmp(suffix, "seg"))
+            continue;
+        if (nsegs == cap)
+        {
+            cap = cap ? 2 * cap : 64;
+            segs = realloc(segs, cap * sizeof(*segs));
+            if (!segs)
+                die("realloc");
+        }
+        segs[nsegs++] = seg;
+    }
+    closedir(dir);
+    qsort(segs, nsegs, sizeof(*segs), log_segment_cmp);
+
+    struct log *resume = calloc(nshards, sizeof(struct log));
+    if (!resume)
+        die("calloc");
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t records = 0, mapped = 0;
+    for (size_t i = 0; i < nsegs; i++)
+    {
+        char path[PATH_MAX];
+        log_path(path, sizeof(path), segs[i].shard, segs[i].seq);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0)
+            die("open: log segment");
+        size_t size = st.st_size, valid = 0;
+        if (size > 0)
+        {
+            char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED)
+                die("mmap: log segment");
+            madvise(map, size, MADV_SEQUENTIAL);
+            valid = log_scan(map, size, &records);
+            munmap(map, size);
+            mapped += valid;
+        }
+        close(fd);
+
+        // We continue the last segment of each shard that still exists.
+        // If it was written with a larger LOG_SEGMENT, we leave it as it
+        // is and start the next one.
+        bool last = i + 1 == nsegs || segs[i + 1].shard != segs[i].shard;
+        if (last && segs[i].shard < nshards)
+        {
+            bool fits = size <= log_segment_size && valid < log_segment_size;
+            resume[segs[i].shard].seq = fits ? segs[i].seq : segs[i].seq + 1;
+            resume[segs[i].shard].off = fits ? valid : 0;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds =
+        end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr,
+            "log: replayed %lu messages (%.1f MiB of records) from %zu "
+            "segments in %.3f s: %.0f MiB/s\n",
+            records, mapped / 1048576.0, nsegs, seconds,
+            seconds > 0 ? mapped / 1048576.0 / seconds : 0.0);
+    free(segs);
+
+    for (int i = 0; i < nshards; i++)
+    {
+        shards[i].log = &resume[i];
+        log_open(shards[i].log, i, resume[i].seq, resume[i].off);
+    }
+}
@@ -1,10 +1,59 @@
-int mqueue_prepare(int epoll_fd)
+// The maximal message size of our message queue
+static long mqueue_msgsize;
+static char *mqueue_bufs; // Room for BATCH_MAX messages
+
+// How many messages the queue holds before mq_send(3) blocks. The
+// default (fs.mqueue.msg_max) is only 10. Unprivileged users cannot
+// exceed that limit, so we fall back to the default then.
+#define MQUEUE_MAXMSG 256
+
+int mqueue_prepare(void)
 {
     printf(
         "... by mq_send: ./mq_send 4 (see also `cat /dev/mqueue/postbox`)\n");
-    return -1;
+
+    // On Linux, a message-queue descriptor is a file descriptor, which
+    // we can add to our epoll set.
+    struct mq_attr want = {.mq_maxmsg = MQUEUE_MAXMSG, .mq_msgsize = 8192};
+    mqd_t msg_fd = mq_open("/postbox", O_RDONLY | O_CREAT | O_NONBLOCK, 0666,
+                           &want);
+    if (msg_fd < 0 && errno == EINVAL)
+        msg_fd = mq_open("/postbox", O_RDONLY | O_CREAT | O_NONBLOCK, 0666,
+                         NULL);
+    if (msg_fd < 0)
+        die("mq_open");
+
+    struct mq_attr attr;
+    if (mq_getattr(msg_fd, &attr) < 0)
+        die("mq_getattr");
+    mqueue_msgsize = attr.mq_msgsize;
+    mqueue_bufs = malloc(BATCH_MAX * mqueue_msgsize);
+    if (!mqueue_bufs)
+        die("malloc");
+    return msg_fd;
 }
 
-void mqueue_handle(int epoll_fd, int msg_fd, int events)
+void mqueue_handle(int epoll_fd, struct handler *self, int events)
 {
+    // With BATCH=1, we receive one message per event. Otherwise, we
+    // drain the queue until mq_receive(3) fails with EAGAIN and hand
+    // the messages over in batches. Each buffer has to be able to hold
+    // the largest message.
+    struct message batch[BATCH_MAX];
+    size_t n = 0;
+    while (true)
+    {
+        char *buf = mqueue_bufs + n * mqueue_msgsize;
+        ssize_t len = mq_receive(self->fd, buf, mqueue_msgsize, NULL);
+        count_syscalls(1);
+        if (len >= 0)
+            batch[n++] = (struct message){buf, len};
+        if (n > 0 && (len < 0 || n == batch_size))
+        {
+            deliver_batch("mqueue", batch, n);
+            n = 0;
+        }
+        if (len < 0 || batch_size == 1)
+            break;
+    }
 }
@@ -1,25 +1,37 @@
 #define _GNU_SOURCE
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <linux/io_uring.h>
 #include <mqueue.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stddef.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof(*(arr)))
+
 #define die(msg)                                                               \
     do                                                                         \
     {                                                                          \
@@ -27,88 +39,599 @@
         exit(EXIT_FAILURE);                                                    \
     } while (0)
 
-// Adds a file descriptor to an open epoll instance's list of
+// Every file descriptor in our epoll set is represented by a handler
+// object. We register the address of the handler as epoll_event.data.ptr.
+// Thereby, the kernel hands us the handler with each event, and we can
+// dispatch it with a single indirect call, regardless of how many
+// descriptors we watch. Objects with more state (e.g., a client
+// connection) embed the handler as their first member.
+struct handler
+{
+    int fd;
+    void (*handle)(int epoll_fd, struct handler *self, int events);
+};
+
+// Adds a handler's file descriptor to an open epoll instance's list of
 // interesting file descriptors.
-//// events -  For which events are we waiting (usually EPOLLIN)
-//// data   -  The kernel returns this data when an event occurs
-void epoll_add(int epoll_fd, int fd, int events)
+//// events  -  For which events are we waiting (usually EPOLLIN)
+//// handler -  The kernel returns this pointer when an event occurs
+void epoll_add(int epoll_fd, struct handler *h, int events)
 {
     struct epoll_event ev;
     ev.events = events;
-    ev.data.fd = fd;
+    ev.data.ptr = h;
 
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, h->fd, &ev) == -1)
     {
         die("epoll_ctl: activate");
     }
 }
 
-// Remove a file descriptor from the interest list.
-void epoll_del(int epoll_fd, int fd)
+// Remove a handler's file descriptor from the interest list.
+void epoll_del(int epoll_fd, struct handler *h)
 {
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1)
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, h->fd, NULL) == -1)
     {
         die("epoll_ctl: reset");
     }
 }
 
+////////////////////////////////////////////////////////////////
+// Slab Allocator
+//
+// Per-connection objects all have the same size and come and go
+// frequently. A slab carves them in batches from one large allocation
+// and keeps freed objects on a single-linked free list, which uses the
+// memory of the free objects themselves.
+struct slab
+{
+    size_t size; // Size of one object (at least a pointer)
+    void *free;  // Stack of freed objects
+    char *chunk; // Unused rest of the last batch
+    size_t left; // Number of objects left in chunk
+};
+
+#define SLAB_BATCH 1024
+
+void *slab_alloc(struct slab *s)
+{
+    void *obj = s->free;
+    if (obj)
+    {
+        s->free = *(void **)obj; // Pop
+        return obj;
+    }
+    if (s->left == 0)
+    {
+        s->chunk = malloc(s->size * SLAB_BATCH);
+        if (!s->chunk)
+            die("malloc");
+        s->left = SLAB_BATCH;
+    }
+    obj = s->chunk;
+    s->chunk += s->size;
+    s->left--;
+    return obj;
+}
+
+void slab_free(struct slab *s, void *obj)
+{
+    *(void **)obj = s->free; // Push
+    s->free = obj;
+}
+
+#include "latency.c"
+
+////////////////////////////////////////////////////////////////
+// Shards
+//
+// With SHARDS=N, we run N reactor threads, each pinned to its own CPU
+// and with its own epoll instance. A shard owns everything that is
+// registered with its epoll instance, including the client objects in
+// its own slab. Therefore, a shard never has to take a lock while it
+// handles events. The fifo, the signalfd, the message queue, and the
+// datagram socket live on shard 0. Only the listening domain socket is
+// shared: every shard registers it with EPOLLEXCLUSIVE, so the kernel
+// wakes only one shard per incoming connection, and that shard keeps
+// the connection.
+struct shard
+{
+    int id;
+    pthread_t thread;
+    int epoll_fd;
+    struct handler listener; // This shard's handler for the domain socket
+
+    // Statistics. They are only written by the shard itself and read
+    // by the main thread.
+    uint64_t events;
+    uint64_t delivered;
+    uint64_t syscalls; // Those that are caused by events and messages
+    uint64_t received[NTRANSPORTS];
+    uint64_t hist[NTRANSPORTS][HIST_BUCKETS]; // Latencies (see latency.c)
+    uint64_t logged; // Bytes appended to the log
+
+    struct log *log; // This shard's segments of the log (see log.c)
+};
+
+static int nshards;
+static struct shard *shards;
+static __thread struct shard *shard; // The shard of the calling thread
+
+// Increment a counter that has a single writer. As no other thread
+// modifies it, we do not need an atomic read-modify-write, but only
+// a tear-free store for the reading main thread.
+#define counter_add(p, v)                                                      \
+    atomic_store_explicit((_Atomic uint64_t *)(p),                             \
+                          atomic_load_explicit((_Atomic uint64_t *)(p),        \
+                                               memory_order_relaxed) +         \
+                              (v),                                             \
+                          memory_order_relaxed)
+#define counter_read(p)                                                        \
+    atomic_load_explicit((_Atomic uint64_t *)(p), memory_order_relaxed)
+
+#define count_syscalls(n) counter_add(&shard->syscalls, n)
+
+////////////////////////////////////////////////////////////////
+// Message Delivery
+//
+// All transports hand their received messages to deliver(), or, if
+// they receive several messages at once, to deliver_batch(). With
+// QUIET set, we do not print the messages but only count them.
+static bool quiet;
+
+// With BATCH=N, the transports that can receive several messages per
+// system call (dgram, mqueue) take up to N messages at once and drain
+// their descriptor. BATCH=1 takes one message per readiness event.
+// The batches live on the stack, so we cap N at BATCH_MAX.
+#define BATCH_MAX 256
+static size_t batch_size;
+
+struct message
+{
+    const char *data;
+    size_t len;
+};
+
+#include "log.c"
+
+void deliver_batch(const char *box, const struct message *msgs, size_t n)
+{
+    int t = transport_index(box);
+    counter_add(&shard->delivered, n);
+    counter_add(&shard->received[t], n);
+    if (log_dir)
+        counter_add(&shard->logged,
+                    log_append(shard->log, shard->id, t, msgs, n));
+
+    // We take the time once per batch, as all its messages arrive now
+    uint64_t now = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        uint64_t sent = send_time(msgs[i].data, msgs[i].len);
+        if (!sent)
+            continue;
+        if (!now)
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            now = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        }
+        counter_add(&shard->hist[t][hist_bucket(now > sent ? now - sent : 0)],
+                    1);
+    }
+
+    if (quiet)
+        return;
+    for (size_t i = 0; i < n; i++)
+    {
+        size_t len = msgs[i].len;
+        while (len > 0 && msgs[i].data[len - 1] == '\n')
+            len--;
+        printf("%s: %.*s\n", box, (int)len, msgs[i].data);
+    }
+}
+
+void deliver(const char *box, const char *msg, size_t len)
+{
+    struct message m = {msg, len};
+    deliver_batch(box, &m, 1);
+}
+
+// On the stream transports (fifo, socket), every line is a message. A
+// read can end in the middle of a line. Then, we keep the first part
+// in the connection's line buffer until the rest arrives. Its memory
+// is only allocated when it is needed. A line that exceeds PIPE_BUF
+// bytes (the maximal message of loadgen) is delivered in pieces.
+struct line_buf
+{
+    char *data; // PIPE_BUF bytes, or NULL
+    size_t len;
+};
+
+static void line_hold(const char *box, struct line_buf *lb, const char *data,
+                      size_t len)
+{
+    while (len > 0)
+    {
+        if (!lb->data && !(lb->data = malloc(PIPE_BUF)))
+            die("malloc");
+        size_t part = len < PIPE_BUF - lb->len ? len : PIPE_BUF - lb->len;
+        memcpy(lb->data + lb->len, data, part);
+        lb->len += part;
+        data += part;
+        len -= part;
+        if (lb->len == PIPE_BUF)
+        {
+            deliver(box, lb->data, lb->len);
+            lb->len = 0;
+        }
+    }
+}
+
+// Release the line buffer of a closed connection
+void line_free(struct line_buf *lb)
+{
+    free(lb->data);
+    *lb = (struct line_buf){NULL, 0};
+}
+
+void deliver_lines(const char *box, struct line_buf *lb, const char *data,
+                   size_t len)
+{
+    // First, we complete the line that the last read ended in
+    if (lb->len > 0)
+    {
+        const char *nl = memchr(data, '\n', len);
+        size_t part = nl ? nl - data + 1 : len;
+        line_hold(box, lb, data, part);
+        data += part;
+        len -= part;
+        if (!nl)
+            return;
+        if (lb->len > 0)
+            deliver(box, lb->data, lb->len);
+        lb->len = 0;
+    }
+
+    struct message batch[64];
+    size_t n = 0;
+    while (len > 0)
+    {
+        const char *nl = memchr(data, '\n', len);
+        if (!nl)
+            break;
+        size_t line = nl - data + 1;
+        batch[n++] = (struct message){data, line};
+        if (n == ARRAY_SIZE(batch))
+        {
+            deliver_batch(box, batch, n);
+            n = 0;
+        }
+        data += line;
+        len -= line;
+    }
+    if (n > 0)
+        deliver_batch(box, batch, n);
+    line_hold(box, lb, data, len);
+}
+
+#include "dgram.c"
 #include "domain.c"
 #include "fifo.c"
 #include "mqueue.c"
+#include "shm.c"
 #include "signalfd.c"
+#include "uring.c"
 
 struct postbox
 {
-    int fd;
-    int (*prepare)(int epoll_fd);
-    void (*handle)(int epoll_fd, int fd, int events);
+    struct handler handler; // Registered with epoll
+    int (*prepare)(void);   // Returns the file descriptor of the postbox
+    bool sharded;           // Registered with every shard (EPOLLEXCLUSIVE)
+
+    // How the io_uring backend drives this postbox, and who consumes
+    // the data that the kernel has read into a provided buffer.
+    enum uring_op uring_op;
+    void (*consume)(struct line_buf *lb, const char *data, size_t len);
 };
 
 struct postbox boxes[] = {
-    {-1, fifo_prepare, fifo_handle},
-    {-1, domain_prepare, domain_accept},
-    {-1, signalfd_prepare, signalfd_handle},
-    {-1, mqueue_prepare, mqueue_handle},
-    // This must be the last entry
-    {-1, NULL, domain_recv}, // Fallback
+    {{-1, fifo_handle}, fifo_prepare, false, URING_READ, fifo_consume},
+    {{-1, domain_accept}, domain_prepare, true, URING_ACCEPT, domain_consume},
+    {{-1, signalfd_handle}, signalfd_prepare, false, URING_READ,
+     signalfd_consume},
+    {{-1, mqueue_handle}, mqueue_prepare, false, URING_POLL, NULL},
+    {{-1, dgram_handle}, dgram_prepare, false, URING_READ, dgram_consume},
+    {{-1, shm_accept}, shm_prepare, false, URING_NONE, NULL},
 };
 
-#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof(*(arr)))
+// For comparison (DISPATCH=scan), we emulate the dispatcher that we
+// had before handler objects: For every event, it searched boxes[]
+// for the event's file descriptor and used the fallback handler
+// (domain_recv) for everything else, that is, all client connections.
+// The clients of the ring box came after that dispatcher, so we call
+// their handlers directly.
+static void dispatch_scan(int epoll_fd, struct handler *h, int events)
+{
+    if (h->handle == shm_doorbell || h->handle == shm_conn ||
+        h->handle == shm_ignore)
+    {
+        h->handle(epoll_fd, h, events);
+        return;
+    }
+    for (int i = 0; i < ARRAY_SIZE(boxes); i++)
+    {
+        if (boxes[i].handler.fd == h->fd)
+        {
+            boxes[i].handler.handle(epoll_fd, h, events);
+            return;
+        }
+    }
+    domain_recv(epoll_fd, h, events);
+}
 
-int main()
+static bool scan;        // DISPATCH=scan
+static cpu_set_t allowed; // The CPUs that we may run on
+
+// The event loop of one shard
+static void *reactor(void *arg)
 {
-    int epoll_fd = epoll_create1(0);
-    if (epoll_fd == -1)
-        die("epoll_create");
+    shard = arg;
 
-    printf("Santas Postbox is open! Send your requests ...\n");
-    // Initialize all backends by calling the prepare method
-    for (int i = 0; i < ARRAY_SIZE(boxes); i++)
+    // We pin shard i to the i-th CPU that we are allowed to run on. If
+    // there are more shards than CPUs, we wrap around.
+    int nth = shard->id % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE && nshards > 1; cpu++)
     {
-        if (boxes[i].prepare)
+        if (CPU_ISSET(cpu, &allowed) && nth-- == 0)
         {
-            boxes[i].fd = boxes[i].prepare(epoll_fd);
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(cpu, &cpus);
+            if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+                perror("sched_setaffinity");
+            break;
         }
     }
+
     while (true)
     {
         // We use epoll_wait(2) to wait for at least one event, but we
         // can receive up to ten events. We do not set a timeout but
-        // wait forever if necessary.
+        // wait forever if necessary, unless the domain-socket listener
+        // is paused (see domain_accept()).
         struct epoll_event event[10];
-        int nfds = epoll_wait(epoll_fd, event, 10, -1);
+        int nfds = epoll_wait(shard->epoll_fd, event, 10, domain_timeout());
+        count_syscalls(1);
+        domain_resume(shard->epoll_fd);
+        if (nfds < 0 && errno == EINTR)
+            continue;
+        if (nfds < 0)
+            die("epoll_wait");
 
         for (int n = 0; n < nfds; n++)
         {
-            int fd = event[n].data.fd;
-            for (int i = 0; i < ARRAY_SIZE(boxes); i++)
-            {
-                if (boxes[i].fd == fd || boxes[i].fd == -1)
-                {
-                    boxes[i].handle(epoll_fd, fd, event[n].events);
-                    break;
-                }
-            }
+            struct handler *h = event[n].data.ptr;
+            if (scan)
+                dispatch_scan(shard->epoll_fd, h, event[n].events);
+            else
+                h->handle(shard->epoll_fd, h, event[n].events);
+        }
+        shm_reap();
+        counter_add(&shard->events, nfds);
+    }
+    return NULL;
+}
+
+// The statistics of all shards, summed up
+struct stats
+{
+    uint64_t events, delivered, syscalls, logged;
+    uint64_t received[NTRANSPORTS];
+    uint64_t hist[NTRANSPORTS][HIST_BUCKETS];
+};
+
+static void stats_collect(struct stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    for (int i = 0; i < nshards; i++)
+    {
+        st->events += counter_read(&shards[i].events);
+        st->delivered += counter_read(&shards[i].delivered);
+        st->syscalls += counter_read(&shards[i].syscalls);
+        st->logged += counter_read(&shards[i].logged);
+        for (int t = 0; t < NTRANSPORTS; t++)
+        {
+            st->received[t] += counter_read(&shards[i].received[t]);
+            for (int b = 0; b < HIST_BUCKETS; b++)
+                st->hist[t][b] += counter_read(&shards[i].hist[t][b]);
+        }
+    }
+}
+
+// Print the statistics of the delta seconds between two snapshots. For
+// every transport that received messages, we print its rate and, if
+// the messages carried a send time, the latency percentiles. For the
+// summary (delta = 0), we print message counts instead of rates, as the
+// run includes idle time before and after the load.
+static void stats_print(const char *backend, const struct stats *now,
+                        const struct stats *last, double delta)
+{
+    uint64_t delivered = now->delivered - last->delivered;
+    const char *unit = delta ? "/s" : "";
+    if (!delta)
+        delta = 1;
+    fprintf(stderr,
+            "%s, %d shards: %.0f events%s, %.0f messages%s, "
+            "%.2f syscalls/message",
+            backend, nshards, (now->events - last->events) / delta, unit,
+            delivered / delta, unit,
+            (double)(now->syscalls - last->syscalls) /
+                (delivered ? delivered : 1));
+    if (log_dir)
+        fprintf(stderr, ", %.1f MiB%s logged",
+                (now->logged - last->logged) / 1048576.0 / delta, unit);
+    fprintf(stderr, "\n");
+
+    for (int t = 0; t < NTRANSPORTS; t++)
+    {
+        uint64_t received = now->received[t] - last->received[t];
+        if (!received)
+            continue;
+        uint64_t hist[HIST_BUCKETS], stamped = 0;
+        for (int b = 0; b < HIST_BUCKETS; b++)
+        {
+            hist[b] = now->hist[t][b] - last->hist[t][b];
+            stamped += hist[b];
+        }
+        fprintf(stderr, "    %-6s %9.0f messages%s", transports[t],
+                received / delta, unit);
+        if (stamped)
+            fprintf(stderr, ", latency p50 %.1f us, p99 %.1f us, "
+                            "p99.9 %.1f us",
+                    hist_percentile(hist, stamped, 50) / 1e3,
+                    hist_percentile(hist, stamped, 99) / 1e3,
+                    hist_percentile(hist, stamped, 99.9) / 1e3);
+        fprintf(stderr, "\n");
+    }
+}
+
+static double seconds_between(struct timespec *from, struct timespec *to)
+{
+    return to->tv_sec - from->tv_sec + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+int main()
+{
+    quiet = getenv("QUIET") != NULL;
+    char *DISPATCH = getenv("DISPATCH");
+    scan = DISPATCH && !strcmp(DISPATCH, "scan");
+    char *BATCH = getenv("BATCH");
+    int batch = atoi(BATCH ? BATCH : "64");
+    batch_size = batch < 1 ? 1 : batch > BATCH_MAX ? BATCH_MAX : batch;
+    char *SHARDS = getenv("SHARDS");
+    nshards = atoi(SHARDS ? SHARDS : "1");
+    if (nshards < 1)
+        nshards = 1;
+    // The io_uring backend (BACKEND=uring) runs a single ring
+    char *BACKEND = getenv("BACKEND");
+    bool use_uring = BACKEND && !strcmp(BACKEND, "uring");
+    if (use_uring)
+        nshards = 1;
+    void *(*loop)(void *) = use_uring ? uring_reactor : reactor;
+    log_dir = getenv("LOG");
+    char *LOG_SEGMENT = getenv("LOG_SEGMENT");
+    log_segment_size = (size_t)atoi(LOG_SEGMENT ? LOG_SEGMENT : "64") << 20;
+    if (log_segment_size < (1 << 20))
+        log_segment_size = 1 << 20;
+
+    // Every client connection costs us a file descriptor. We raise our
+    // soft limit to the hard limit.
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        die("sched_getaffinity");
+    shards = calloc(nshards, sizeof(struct shard));
+    if (!shards)
+        die("calloc");
+    for (int i = 0; i < nshards; i++)
+    {
+        shards[i].id = i;
+        shards[i].epoll_fd = epoll_create1(0);
+        if (shards[i].epoll_fd == -1)
+            die("epoll_create");
+    }
+    if (use_uring)
+        uring_setup();
+    if (log_dir)
+        log_start();
+
+    printf("Santas Postbox is open! Send your requests ...\n");
+    // Initialize all backends by calling the prepare method and add
+    // them to the epoll set of the first shard, or of every shard. As
+    // we prepare the backends before we start the shard threads, those
+    // inherit our signal mask (see signalfd_prepare).
+    for (int i = 0; i < ARRAY_SIZE(boxes); i++)
+    {
+        // We do not even prepare a box that the uring backend cannot
+        // drive: Its clients would connect and then wait forever.
+        if (use_uring && boxes[i].uring_op == URING_NONE)
+        {
+            printf("... (postbox %d is not supported with BACKEND=uring)\n",
+                   i);
+            continue;
+        }
+        boxes[i].handler.fd = boxes[i].prepare();
+        if (use_uring)
+        {
+            // The ring is not sharded; the shards' epoll sets are unused
+            uring_add(&boxes[i].handler, boxes[i].uring_op, boxes[i].consume);
+            continue;
+        }
+        if (!boxes[i].sharded)
+        {
+            epoll_add(shards[0].epoll_fd, &boxes[i].handler, EPOLLIN);
+            continue;
+        }
+        for (int s = 0; s < nshards; s++)
+        {
+            shards[s].listener = boxes[i].handler;
+            epoll_add(shards[s].epoll_fd, &shards[s].listener,
+                      EPOLLIN | EPOLLEXCLUSIVE);
+        }
+    }
+    fflush(stdout);
+
+    // With QUIET, the main thread waits for SIGINT and SIGTERM. We block
+    // them before we start the shards, which inherit our signal mask.
+    sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    if (quiet && sigprocmask(SIG_BLOCK, &stop, NULL) < 0)
+        die("sigprocmask");
+    const char *backend = use_uring ? "uring" : "epoll";
+
+    for (int i = 1; i < nshards; i++)
+    {
+        if (pthread_create(&shards[i].thread, NULL, loop, &shards[i]) != 0)
+            die("pthread_create");
+    }
+
+    // Without QUIET, the main thread becomes shard 0. Otherwise, it
+    // prints the aggregated statistics of all shards once per second,
+    // and a summary of the whole run when we are stopped.
+    if (!quiet)
+        loop(&shards[0]);
+    if (pthread_create(&shards[0].thread, NULL, loop, &shards[0]) != 0)
+        die("pthread_create");
+
+    // Once per second, and at the end of the run (SIGINT or SIGTERM),
+    // we compare a snapshot of the statistics with an earlier one
+    struct stats *first = calloc(3, sizeof(struct stats));
+    if (!first)
+        die("calloc");
+    struct stats *last = first + 1, *now = first + 2;
+    struct timespec prev, ts;
+    clock_gettime(CLOCK_MONOTONIC, &prev);
+    while (true)
+    {
+        int sig = sigtimedwait(&stop, NULL, &(struct timespec){1, 0});
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        stats_collect(now);
+        if (sig > 0)
+        {
+            fprintf(stderr, "summary:\n");
+            stats_print(backend, now, first, 0);
+            return 0;
         }
+        stats_print(backend, now, last, seconds_between(&prev, &ts));
+        *last = *now;
+        prev = ts;
     }
 }
@@ -0,0 +1,123 @@
+// A single-producer single-consumer message ring in shared memory. The
+// postbox creates one ring per client in a memfd and passes it to the
+// client, together with an eventfd (the doorbell), over the "ring"
+// domain socket. The client (producer) appends length-prefixed records
+// and advances tail. The postbox (consumer) delivers them directly
+// from the shared memory and advances head. No message is ever copied
+// through the kernel.
+//
+// The producer only rings the doorbell when the ring was empty before
+// its record became visible. As long as the postbox is busy with
+// draining the ring, the producer gets by without any system call.
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define RING_SIZE (1 << 20)     // Bytes of record data, a power of two
+#define RING_SKIP UINT32_MAX    // Record length that skips to the start
+#define RING_ALIGN(len) (((len) + 4 + 7) & ~7u) // Header plus data
+
+struct shm_ring
+{
+    // head and tail are free-running byte positions. They live on
+    // different cache lines, as each has its own writer.
+    _Atomic uint32_t head; // Written by the consumer
+    char pad0[60];
+    _Atomic uint32_t tail; // Written by the producer
+    char pad1[60];
+    char data[RING_SIZE];
+};
+
+// Append a message to the ring. Returns false if there is no room for
+// it. The caller has to ring the doorbell if *wake is set.
+static inline bool shm_ring_push(struct shm_ring *r, const void *msg,
+                                 uint32_t len, bool *wake)
+{
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint32_t old_tail = tail;
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    uint32_t need = RING_ALIGN(len);
+    uint32_t contig = RING_SIZE - (tail & (RING_SIZE - 1));
+
+    // A record never wraps. If it does not fit into the rest of the
+    // ring, we fill the rest with a skip record.
+    uint32_t total = need > contig ? contig + need : need;
+    if (need > RING_SIZE / 2 || total > RING_SIZE - (tail - head))
+        return false;
+    if (need > contig)
+    {
+        memcpy(r->data + (tail & (RING_SIZE - 1)), &(uint32_t){RING_SKIP}, 4);
+        tail += contig;
+    }
+    memcpy(r->data + (tail & (RING_SIZE - 1)), &len, 4);
+    memcpy(r->data + (tail & (RING_SIZE - 1)) + 4, msg, len);
+
+    // Publish the record. The sequentially-consistent store and load
+    // pair with those of the consumer (shm_handle): Either the consumer
+    // sees our new tail after it has published its head, or we see
+    // that head has caught up with our old tail and wake it.
+    atomic_store(&r->tail, tail + need);
+    *wake = atomic_load(&r->head) == old_tail;
+    return true;
+}
+
+// Connect to the postbox and map our ring. Returns the doorbell.
+static inline int shm_ring_connect(const char *path, struct shm_ring **ring)
+{
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return -1;
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        return -1;
+
+    // The postbox sends the memfd and the eventfd as SCM_RIGHTS
+    char byte;
+    struct iovec iov = {&byte, 1};
+    union
+    {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } cmsg;
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = cmsg.buf,
+                         .msg_controllen = sizeof(cmsg.buf)};
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+        return -1;
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    if (!c || c->cmsg_type != SCM_RIGHTS ||
+        c->cmsg_len != CMSG_LEN(2 * sizeof(int)))
+        return -1;
+    int fds[2];
+    memcpy(fds, CMSG_DATA(c), sizeof(fds));
+
+    *ring = mmap(NULL, sizeof(struct shm_ring), PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if (*ring == MAP_FAILED)
+        return -1;
+    // We keep the connection open (and leak it on purpose): When we
+    // exit, the postbox sees the connection close and frees the ring.
+    return fds[1];
+}
+
+// Ring the doorbell of the postbox
+static inline void shm_ring_wake(int doorbell)
+{
+    uint64_t one = 1;
+    if (write(doorbell, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+        perror("write: doorbell");
+}
@@ -0,0 +1,209 @@
+#include "ring.h"
+
+// Per-client state of the shared-memory ring box. Two descriptors
+// belong to a client: its doorbell (eventfd) and the connection over
+// which it obtained its ring. Each has its own handler. When the
+// client closes the connection, we free its ring.
+struct shm_client
+{
+    struct handler doorbell;
+    struct handler conn;
+    struct shm_ring *ring;
+    struct shm_client *next_dead;
+};
+
+static __thread struct slab shm_clients = {.size = sizeof(struct shm_client)};
+
+// As a client has two handlers, the current batch of epoll events can
+// still hold an event for a client that we have just closed. We
+// therefore neutralize the handlers of a closed client and free it only
+// after the batch (shm_reap).
+static __thread struct shm_client *shm_dead;
+
+static void shm_ignore(int epoll_fd, struct handler *self, int events) {}
+
+void shm_reap(void)
+{
+    while (shm_dead)
+    {
+        struct shm_client *client = shm_dead;
+        shm_dead = client->next_dead;
+        slab_free(&shm_clients, client);
+    }
+}
+
+int shm_prepare(void)
+{
+    printf("... by ring:   ./shm_send 6\n");
+
+    int sock_fd =
+        socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock_fd < 0)
+        die("socket");
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX, .sun_path = "ring"};
+    unlink(addr.sun_path);
+    if (bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        die("bind");
+    if (listen(sock_fd, SOMAXCONN) < 0)
+        die("listen");
+    return sock_fd;
+}
+
+// Deliver all records of a client's ring, in batches that point
+// directly into the shared memory. Only after a batch is delivered, we
+// advance head and thereby give the memory back to the producer.
+static bool shm_drain(struct shm_ring *r)
+{
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    struct message batch[BATCH_MAX];
+    size_t n = 0;
+    while (true)
+    {
+        uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        if (head == tail)
+        {
+            if (n > 0)
+                deliver_batch("ring", batch, n);
+            n = 0;
+            // The ring looks empty. We publish our head and look once
+            // more (see shm_ring_push): If the producer has appended a
+            // record in the meantime, it has not rung the doorbell.
+            atomic_store(&r->head, head);
+            if (atomic_load(&r->tail) == head)
+                return true;
+            continue;
+        }
+
+        uint32_t off = head & (RING_SIZE - 1), len;
+        memcpy(&len, r->data + off, 4);
+        if (len == RING_SKIP)
+        {
+            head += RING_SIZE - off;
+            continue;
+        }
+        // We do not trust the client: a record must lie within the ring
+        if (len > RING_SIZE / 2 || off + RING_ALIGN(len) > RING_SIZE ||
+            tail - head < RING_ALIGN(len))
+            return false;
+        batch[n++] = (struct message){r->data + off + 4, len};
+        head += RING_ALIGN(len);
+        if (n == batch_size)
+        {
+            deliver_batch("ring", batch, n);
+            n = 0;
+            atomic_store_explicit(&r->head, head, memory_order_release);
+        }
+    }
+}
+
+static void shm_close(int epoll_fd, struct shm_client *client)
+{
+    epoll_del(epoll_fd, &client->doorbell);
+    epoll_del(epoll_fd, &client->conn);
+    close(client->doorbell.fd);
+    close(client->conn.fd);
+    munmap(client->ring, sizeof(struct shm_ring));
+    count_syscalls(5);
+    client->doorbell.handle = shm_ignore;
+    client->conn.handle = shm_ignore;
+    client->next_dead = shm_dead;
+    shm_dead = client;
+}
+
+void shm_doorbell(int epoll_fd, struct handler *self, int events)
+{
+    struct shm_client *client = (struct shm_client *)self;
+
+    // We reset the doorbell before we drain the ring. Thereby, a
+    // doorbell that rings while we drain wakes us again.
+    uint64_t count;
+    if (read(self->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        die("read: eventfd");
+    count_syscalls(1);
+    if (!shm_drain(client->ring))
+    {
+        fprintf(stderr, "ring: dropping client with a corrupt ring\n");
+        shm_close(epoll_fd, client);
+    }
+}
+
+void shm_conn(int epoll_fd, struct handler *self, int events)
+{
+    struct shm_client *client =
+        (struct shm_client *)((char *)self - offsetof(struct shm_client, conn));
+    char buf[64];
+    ssize_t len = recv(self->fd, buf, sizeof(buf), 0);
+    count_syscalls(1);
+    if (len > 0 || (len < 0 && errno == EAGAIN))
+        return; // Clients do not talk on the connection
+
+    // The client is gone. It may have left records behind.
+    shm_drain(client->ring);
+    shm_close(epoll_fd, client);
+}
+
+// Pass the memfd of a fresh ring and its doorbell to the client
+static bool shm_send_fds(int sock, int memfd, int doorbell)
+{
+    int fds[2] = {memfd, doorbell};
+    union
+    {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } cmsg = {0};
+    struct iovec iov = {"r", 1};
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = cmsg.buf,
+                         .msg_controllen = sizeof(cmsg.buf)};
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1;
+}
+
+void shm_accept(int epoll_fd, struct handler *self, int events)
+{
+    int fd;
+    while ((fd = accept4(self->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >=
+           0)
+    {
+        int memfd = memfd_create("postbox-ring", MFD_CLOEXEC);
+        if (memfd < 0 || ftruncate(memfd, sizeof(struct shm_ring)) < 0)
+            die("memfd_create");
+        struct shm_ring *ring =
+            mmap(NULL, sizeof(struct shm_ring), PROT_READ | PROT_WRITE,
+                 MAP_SHARED, memfd, 0);
+        if (ring == MAP_FAILED)
+            die("mmap");
+        int doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (doorbell < 0)
+            die("eventfd");
+
+        bool sent = shm_send_fds(fd, memfd, doorbell);
+        close(memfd); // Our mapping keeps the memory alive
+        if (!sent)
+        {
+            perror("sendmsg");
+            munmap(ring, sizeof(struct shm_ring));
+            close(doorbell);
+            close(fd);
+            continue;
+        }
+
+        struct shm_client *client = slab_alloc(&shm_clients);
+        client->doorbell = (struct handler){doorbell, shm_doorbell};
+        client->conn = (struct handler){fd, shm_conn};
+        client->ring = ring;
+        epoll_add(epoll_fd, &client->doorbell, EPOLLIN);
+        epoll_add(epoll_fd, &client->conn, EPOLLIN);
+        // accept4, memfd_create, ftruncate, mmap, eventfd, sendmsg,
+        // close, and two epoll_ctl
+        count_syscalls(9);
+    }
+    if (errno != EAGAIN)
+        perror("accept4");
+}
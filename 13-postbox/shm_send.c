@@ -0,0 +1,38 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+#define die(msg)                                                               \
+    do                                                                         \
+    {                                                                          \
+        perror(msg);                                                           \
+        exit(EXIT_FAILURE);                                                    \
+    } while (0)
+
+// Send every argument as one message through a shared-memory ring
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s DATA...\n", argv[0]);
+        return -1;
+    }
+    struct shm_ring *ring;
+    int doorbell = shm_ring_connect("ring", &ring);
+    if (doorbell < 0)
+        die("shm_ring_connect");
+
+    for (int i = 1; i < argc; i++)
+    {
+        bool wake;
+        if (!shm_ring_push(ring, argv[i], strlen(argv[i]), &wake))
+        {
+            fprintf(stderr, "message too large: %s\n", argv[i]);
+            return -1;
+        }
+        if (wake)
+            shm_ring_wake(doorbell);
+    }
+}
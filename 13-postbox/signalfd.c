@@ -1,9 +1,49 @@
-int signalfd_prepare(int epoll_fd)
+int signalfd_prepare(void)
 {
     printf("... by signal: /bin/kill -USR1 -q 3 %d \n", getpid());
-    return -1;
+
+    // We block SIGUSR1. Thereby, it stays pending until we read it
+    // from the signalfd instead of interrupting us asynchronously.
+    // As a pending SIGUSR1 swallows further ones, loadgen uses the
+    // real-time signal SIGRTMIN, of which the kernel queues every one.
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGRTMIN);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0)
+        die("sigprocmask");
+
+    int signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0)
+        die("signalfd");
+    return signal_fd;
+}
+
+// A read from a signalfd returns an array of signalfd_siginfo records.
+// The value that was given to sigqueue(3) (kill -q) is our message.
+// With SIGRTMIN, loadgen passes its send time as the pointer value.
+void signalfd_consume(struct line_buf *lb, const char *data, size_t len)
+{
+    for (; len >= sizeof(struct signalfd_siginfo);
+         data += sizeof(struct signalfd_siginfo),
+         len -= sizeof(struct signalfd_siginfo))
+    {
+        struct signalfd_siginfo info;
+        memcpy(&info, data, sizeof(info));
+        char msg[32];
+        int n = info.ssi_signo == SIGRTMIN
+                    ? snprintf(msg, sizeof(msg), "@%llu\n",
+                               (unsigned long long)info.ssi_ptr)
+                    : snprintf(msg, sizeof(msg), "%d", info.ssi_int);
+        deliver("signal", msg, n);
+    }
 }
 
-void signalfd_handle(int epoll_fd, int signal_fd, int events)
+void signalfd_handle(int epoll_fd, struct handler *self, int events)
 {
+    struct signalfd_siginfo info[32];
+    ssize_t len = read(self->fd, info, sizeof(info));
+    count_syscalls(1);
+    if (len > 0)
+        signalfd_consume(NULL, (char *)info, len);
 }
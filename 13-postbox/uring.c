@@ -0,0 +1,317 @@
+////////////////////////////////////////////////////////////////
+// io_uring Backend (BACKEND=uring)
+//
+// With epoll, every message costs at least two system calls: an
+// epoll_wait(2) that reports a readable descriptor, and the read(2)
+// that fetches the message. With io_uring, we hand the reads
+// themselves to the kernel and only collect their results. Multishot
+// operations stay armed after they complete: one accept SQE yields a
+// CQE for every new connection, and one recv SQE yields a CQE for
+// every message on that connection. As we cannot know which operation
+// completes next, we do not pass a buffer with each operation.
+// Instead, the kernel picks a buffer from a ring of provided buffers
+// when the data arrives. Thereby, a single io_uring_enter(2) harvests
+// the messages of many descriptors.
+//
+// For the raw ring setup and its memory barriers, see 16-iouring.
+
+// READ_MULTISHOT appeared with Linux 6.7 and is missing in older uapi
+// headers. On older kernels, we fall back to re-armed single reads.
+#define URING_OP_READ_MULTISHOT 49
+
+enum uring_op
+{
+    URING_READ,   // (Multishot) read into a provided buffer
+    URING_RECV,   // Multishot recv into a provided buffer
+    URING_ACCEPT, // Multishot accept, every connection becomes a URING_RECV
+    URING_POLL,   // Poll for POLLIN, then call the epoll handler
+    URING_NONE,   // Not supported by the io_uring backend
+};
+
+// One armed operation. Its address is the user_data of its SQE.
+struct uring_req
+{
+    int fd;
+    enum uring_op op;
+    // READ, RECV, ACCEPT: who consumes the data that the kernel read
+    void (*consume)(struct line_buf *lb, const char *data, size_t len);
+    struct handler *handler; // POLL
+    struct line_buf lines;   // READ, RECV: a partially received line
+};
+
+static struct slab uring_clients = {.size = sizeof(struct uring_req)};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int ring_fd, unsigned int to_submit,
+                              unsigned int min_complete, unsigned int flags)
+{
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                        min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int ring_fd, unsigned opcode, void *arg,
+                                 unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+#define store_release(p, v)                                                    \
+    atomic_store_explicit((_Atomic typeof(*(p)) *)(p), (v),                    \
+                          memory_order_release)
+#define load_aquire(p)                                                         \
+    atomic_load_explicit((_Atomic typeof(*(p)) *)(p), memory_order_acquire)
+
+#define URING_ENTRIES 256
+
+// Provided buffers: URING_BUFS buffers of URING_BUF_SIZE bytes in buffer
+// group 0. A buffer belongs to the kernel until a CQE hands it to us,
+// and we give it back as soon as we have delivered its content.
+#define URING_BUFS 1024
+#define URING_BUF_SIZE 4096
+
+static struct
+{
+    int fd;
+    unsigned *sq_tail, sq_mask, *sq_array, sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned pending; // SQEs that are queued but not yet submitted
+
+    struct io_uring_buf_ring *br; // The ring of provided buffers
+    unsigned short br_tail;
+    char *bufs;
+
+    bool read_multishot; // Cleared if the kernel lacks READ_MULTISHOT
+} uring = {.fd = -1, .read_multishot = true};
+
+// Return buffer bid to the kernel
+static void uring_recycle(unsigned bid)
+{
+    struct io_uring_buf *buf =
+        &uring.br->bufs[uring.br_tail & (URING_BUFS - 1)];
+    buf->addr = (uintptr_t)(uring.bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    uring.br_tail++;
+    store_release(&uring.br->tail, uring.br_tail);
+}
+
+static void uring_setup(void)
+{
+    struct io_uring_params p = {0};
+    uring.fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (uring.fd < 0)
+        die("io_uring_setup");
+    // Multishot operations can produce CQEs faster than we reap them.
+    // Without NODROP, the kernel would silently drop the overflow.
+    if (!(p.features & IORING_FEAT_NODROP))
+        fprintf(stderr, "io_uring: kernel may drop CQEs on overflow\n");
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    char *sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+    char *cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+    uring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      uring.fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || uring.sqes == MAP_FAILED)
+        die("mmap");
+
+    uring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    uring.sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    uring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    uring.sq_entries = p.sq_entries;
+    uring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    uring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    uring.cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // The buffer ring has to be page aligned. Its first entry overlays
+    // the tail, which we advance whenever we recycle a buffer.
+    uring.br = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf),
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    uring.bufs = mmap(NULL, (size_t)URING_BUFS * URING_BUF_SIZE,
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                      0);
+    if (uring.br == MAP_FAILED || uring.bufs == MAP_FAILED)
+        die("mmap");
+    struct io_uring_buf_reg reg = {.ring_addr = (uintptr_t)uring.br,
+                                   .ring_entries = URING_BUFS,
+                                   .bgid = 0};
+    if (sys_io_uring_register(uring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        die("io_uring_register: PBUF_RING");
+    for (unsigned bid = 0; bid < URING_BUFS; bid++)
+        uring_recycle(bid);
+}
+
+// Submit all queued SQEs and wait for at least min_complete CQEs
+static void uring_enter(unsigned min_complete)
+{
+    int rc = sys_io_uring_enter(uring.fd, uring.pending, min_complete,
+                                min_complete ? IORING_ENTER_GETEVENTS : 0);
+    count_syscalls(1);
+    if (rc < 0 && errno != EINTR && errno != EBUSY)
+        die("io_uring_enter");
+    if (rc > 0)
+        uring.pending -= rc;
+}
+
+// Queue the SQE that (re-)arms req
+static void uring_arm(struct uring_req *req)
+{
+    // If the submission queue is full, we have to submit first
+    if (uring.pending == uring.sq_entries)
+        uring_enter(0);
+
+    unsigned tail = *uring.sq_tail;
+    unsigned idx = tail & uring.sq_mask;
+    struct io_uring_sqe *sqe = &uring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = req->fd;
+    sqe->user_data = (uintptr_t)req;
+    switch (req->op)
+    {
+    case URING_READ:
+        sqe->opcode =
+            uring.read_multishot ? URING_OP_READ_MULTISHOT : IORING_OP_READ;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        break;
+    case URING_RECV:
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        break;
+    case URING_ACCEPT:
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        break;
+    case URING_POLL:
+        // mq_receive(3) has no io_uring counterpart. Therefore, we poll
+        // the queue descriptor and receive with the epoll handler. As
+        // a multishot poll only fires on new messages, it requires a
+        // handler that drains the queue. With BATCH=1, the handler takes
+        // only one message, so we use a single-shot poll, which completes
+        // immediately when re-armed on a non-empty queue.
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = POLLIN;
+        if (batch_size > 1)
+            sqe->len = IORING_POLL_ADD_MULTI;
+        break;
+    case URING_NONE:
+        break;
+    }
+    uring.sq_array[idx] = idx;
+    store_release(uring.sq_tail, tail + 1);
+    uring.pending++;
+}
+
+// Register a postbox with the ring
+void uring_add(struct handler *h, enum uring_op op,
+               void (*consume)(struct line_buf *lb, const char *data,
+                               size_t len))
+{
+    struct uring_req *req = malloc(sizeof(struct uring_req));
+    if (!req)
+        die("malloc");
+    *req = (struct uring_req){h->fd, op, consume, h, {NULL, 0}};
+    uring_arm(req);
+}
+
+static void uring_complete(struct io_uring_cqe *cqe)
+{
+    struct uring_req *req = (struct uring_req *)(uintptr_t)cqe->user_data;
+    int res = cqe->res;
+
+    // Deliver the content of the provided buffer and give it back
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0)
+            req->consume(&req->lines,
+                         uring.bufs + (size_t)bid * URING_BUF_SIZE, res);
+        uring_recycle(bid);
+    }
+
+    // A multishot operation stays armed as long as the kernel sets
+    // F_MORE. It terminates on errors, and also when the kernel ran out
+    // of provided buffers (ENOBUFS). Then, we simply re-arm it.
+    switch (req->op)
+    {
+    case URING_READ:
+        if (res == -EINVAL && uring.read_multishot)
+            uring.read_multishot = false;
+        else if (res < 0 && res != -ENOBUFS && res != -EAGAIN)
+        {
+            errno = -res;
+            die("io_uring: read");
+        }
+        break;
+    case URING_RECV:
+        if (res == 0 || (res < 0 && res != -ENOBUFS))
+        {
+            // The client has closed the connection (or it broke down).
+            // Without F_MORE, the kernel has already dropped the recv.
+            close(req->fd);
+            count_syscalls(1);
+            line_free(&req->lines);
+            slab_free(&uring_clients, req);
+            return;
+        }
+        break;
+    case URING_ACCEPT:
+        if (res >= 0)
+        {
+            struct uring_req *client = slab_alloc(&uring_clients);
+            *client = (struct uring_req){res, URING_RECV, req->consume, NULL,
+                                         {NULL, 0}};
+            uring_arm(client);
+        }
+        else if (res != -ENOBUFS)
+        {
+            errno = -res;
+            perror("io_uring: accept");
+        }
+        break;
+    case URING_POLL:
+        if (res > 0)
+            req->handler->handle(-1, req->handler, res);
+        break;
+    case URING_NONE:
+        break;
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        uring_arm(req);
+}
+
+// The event loop of the io_uring backend. With one io_uring_enter(2),
+// we submit all (re-)armed operations and wait for the next completion.
+static void *uring_reactor(void *arg)
+{
+    shard = arg;
+    while (true)
+    {
+        uring_enter(1);
+
+        unsigned head = *uring.cq_head, first = head;
+        unsigned tail = load_aquire(uring.cq_tail);
+        for (; head != tail; head++)
+        {
+            // uring_complete() only queues SQEs. Hence, it cannot
+            // overwrite this CQE before we have released it.
+            uring_complete(&uring.cqes[head & uring.cq_mask]);
+            store_release(uring.cq_head, head + 1);
+        }
+        counter_add(&shard->events, tail - first);
+    }
+    return NULL;
+}
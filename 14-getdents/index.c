@@ -0,0 +1,454 @@
+////////////////////////////////////////////////////////////////
+// Persistent Index (INDEX=file)
+//
+// Walking a mailbox with millions of letters costs at least one
+// statx(2) per letter, on every run. With INDEX=file, we store the
+// result of the walk in an index file, which later runs map with
+// mmap(2):
+//
+//   | header | letters[] | dirs[] | strings |
+//
+// letters[] holds (timestamp, inode, name offset) of every regular
+// file, sorted by timestamp. dirs[] holds the path and the mtime of
+// every directory. The strings are NUL-terminated paths.
+//
+// Creating, removing, or renaming an entry updates the mtime of its
+// directory, while the birth time of a file never changes. Therefore,
+// the next run only has to statx(2) the directories of the index. If
+// none has changed, we answer from the mapped index without reading a
+// single directory. Otherwise, we reread only the changed directories
+// (and walk the new subdirectories), take the timestamps of known
+// inodes from the index, and replace the index. With REFRESH=0, we
+// trust the index and even skip the directory checks: a query is then
+// one mmap(2).
+//
+// This only works with birth times. Without them, a letter's timestamp
+// is its mtime, and editing the letter in place changes that without
+// touching the mtime of its directory. Hence, we ignore INDEX on file
+// systems that do not record the birth time (see index_usable()).
+//
+// A directory that changes in the same second in which we read it may
+// keep its mtime on file systems with coarse timestamps. Like git, we
+// record the mtime of such a "racy" directory as zero, so the next run
+// checks it again.
+
+#define INDEX_MAGIC "LETTERS1"
+
+struct index_header
+{
+    char magic[8];
+    uint64_t nletters, ndirs;
+    uint64_t strings; // Size of the string table
+};
+
+struct index_letter
+{
+    int64_t timestamp;
+    uint64_t ino;
+    uint64_t name; // Offset into the string table
+};
+
+struct index_dir
+{
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t pad;
+    uint64_t path; // Offset into the string table
+};
+
+// The mapped index of the previous run
+static struct
+{
+    char *map;
+    size_t size;
+    const struct index_header *header;
+    const struct index_letter *letters;
+    const struct index_dir *dirs;
+    const char *strings;
+} index_old;
+
+static bool index_refresh = true; // REFRESH
+static time_t index_scan_start;   // For the racy-directory check
+
+enum dir_state
+{
+    DIR_UNCHANGED,
+    DIR_CHANGED,
+    DIR_GONE,
+};
+
+// Hash tables over the directories of the index (by path) and over the
+// letters in changed directories (by inode). While the workers walk,
+// they only read the tables.
+struct dir_slot
+{
+    const char *path; // NULL: empty slot
+    enum dir_state state;
+};
+
+struct file_slot
+{
+    uint64_t ino; // 0: empty slot
+    const struct index_letter *letter;
+};
+
+static struct dir_slot *dir_table;
+static size_t dir_mask;
+static struct file_slot *file_table;
+static size_t file_mask;
+
+static uint64_t hash_string(const char *s)
+{
+    uint64_t h = 0xcbf29ce484222325; // FNV-1a
+    for (; *s; s++)
+        h = (h ^ (uint8_t)*s) * 0x100000001b3;
+    return h;
+}
+
+static size_t table_size(size_t n)
+{
+    size_t size = 16;
+    while (size < 2 * n)
+        size *= 2;
+    return size;
+}
+
+static struct dir_slot *dir_find(const char *path)
+{
+    for (size_t i = hash_string(path) & dir_mask;; i = (i + 1) & dir_mask)
+    {
+        if (!dir_table[i].path || !strcmp(dir_table[i].path, path))
+            return &dir_table[i];
+    }
+}
+
+static struct file_slot *file_find(uint64_t ino)
+{
+    for (size_t i = (ino * 0x9e3779b97f4a7c15) & file_mask;;
+         i = (i + 1) & file_mask)
+    {
+        if (!file_table[i].ino || file_table[i].ino == ino)
+            return &file_table[i];
+    }
+}
+
+// Strings of the mapped index. A broken offset yields "".
+static const char *index_string(uint64_t off)
+{
+    return off < index_old.header->strings ? index_old.strings + off : "";
+}
+
+static void path_join(char *buf, size_t size, const char *dir, const char *name)
+{
+    if (strcmp(dir, ".") == 0)
+        snprintf(buf, size, "%s", name);
+    else
+        snprintf(buf, size, "%s/%s", dir, name);
+}
+
+// Walker hook: Is dir/name a directory of the index that still exists?
+// Then, it is either unchanged or already queued, and the walker must
+// not descend into it.
+static bool index_known_dir(const char *dir, const char *name)
+{
+    if (!dir_table)
+        return false;
+    char path[PATH_MAX];
+    path_join(path, sizeof(path), dir, name);
+    struct dir_slot *slot = dir_find(path);
+    return slot->path && slot->state != DIR_GONE;
+}
+
+// Walker hook: Does the index know the timestamp of this file already?
+// An inode number can be reused for a new file, so the path has to
+// match as well.
+static bool index_known_file(uint64_t ino, const char *dir, const char *name,
+                             time_t *timestamp)
+{
+    if (!file_table)
+        return false;
+    struct file_slot *slot = file_find(ino);
+    if (!slot->ino)
+        return false;
+    char path[PATH_MAX];
+    path_join(path, sizeof(path), dir, name);
+    if (strcmp(index_string(slot->letter->name), path) != 0)
+        return false;
+    *timestamp = slot->letter->timestamp;
+    return true;
+}
+
+static void add_visited(struct worker *w, const char *path,
+                        struct statx_timestamp mtime)
+{
+    if (w->nvisited == w->cap_visited)
+    {
+        w->cap_visited = w->cap_visited ? 2 * w->cap_visited : 64;
+        w->visited =
+            realloc(w->visited, w->cap_visited * sizeof(struct dir_record));
+        if (!w->visited)
+            die("realloc");
+    }
+    w->visited[w->nvisited++] = (struct dir_record){path, mtime};
+}
+
+// Does the file system of the mailbox record birth times?
+static bool index_usable(void)
+{
+    struct statx stx;
+    if (statx(root_fd, "", AT_EMPTY_PATH, STATX_BTIME, &stx) < 0)
+        die("statx");
+    return stx.stx_mask & STATX_BTIME;
+}
+
+// Walker hook: Record the mtime of a directory before we read it.
+// Thereby, a change while we read it shows up in the next run.
+static void index_visit(struct worker *w, int fd, const char *path)
+{
+    struct statx stx;
+    w->statx_calls++;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_MTIME, &stx) < 0)
+        die("statx");
+    if (stx.stx_mtime.tv_sec >= index_scan_start)
+        stx.stx_mtime = (struct statx_timestamp){0};
+    add_visited(w, path, stx.stx_mtime);
+}
+
+// Map the index of the previous run. Returns false if there is none,
+// or if it is broken.
+static bool index_load(const char *file)
+{
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        die("fstat");
+    size_t size = st.st_size;
+    if (size < sizeof(struct index_header))
+    {
+        close(fd);
+        return false;
+    }
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        die("mmap");
+
+    const struct index_header *h = (const void *)map;
+    size_t need = sizeof(*h);
+    bool ok = memcmp(h->magic, INDEX_MAGIC, sizeof(h->magic)) == 0 &&
+              h->nletters <= size / sizeof(struct index_letter) &&
+              h->ndirs <= size / sizeof(struct index_dir) && h->strings > 0 &&
+              h->strings <= size;
+    if (ok)
+    {
+        need += h->nletters * sizeof(struct index_letter) +
+                h->ndirs * sizeof(struct index_dir) + h->strings;
+        ok = need == size && map[size - 1] == 0;
+    }
+    if (!ok)
+    {
+        fprintf(stderr, "%s: broken index, rebuilding it\n", file);
+        munmap(map, size);
+        return false;
+    }
+    index_old.map = map;
+    index_old.size = size;
+    index_old.header = h;
+    index_old.letters = (const void *)(map + sizeof(*h));
+    index_old.dirs = (const void *)(index_old.letters + h->nletters);
+    index_old.strings = (const char *)(index_old.dirs + h->ndirs);
+    return true;
+}
+
+// Compare the mtime of every directory of the index with the file
+// system. Returns the number of directories that have changed or are
+// gone.
+static uint64_t index_check(uint64_t *statx_calls)
+{
+    uint64_t ndirs = index_old.header->ndirs, changed = 0;
+    dir_mask = table_size(ndirs) - 1;
+    dir_table = calloc(dir_mask + 1, sizeof(struct dir_slot));
+    if (!dir_table)
+        die("calloc");
+    for (uint64_t i = 0; i < ndirs; i++)
+    {
+        const struct index_dir *d = &index_old.dirs[i];
+        const char *path = index_string(d->path);
+        struct statx stx;
+        enum dir_state state = DIR_UNCHANGED;
+        (*statx_calls)++;
+        if (statx(root_fd, path, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                  STATX_TYPE | STATX_MTIME, &stx) < 0 ||
+            !S_ISDIR(stx.stx_mode))
+            state = DIR_GONE;
+        else if (stx.stx_mtime.tv_sec != d->mtime_sec ||
+                 stx.stx_mtime.tv_nsec != d->mtime_nsec)
+            state = DIR_CHANGED;
+        if (state != DIR_UNCHANGED)
+            changed++;
+        struct dir_slot *slot = dir_find(path);
+        *slot = (struct dir_slot){path, state};
+    }
+    return changed;
+}
+
+// Prepare the walk that brings the index up to date: Unchanged
+// directories and their letters are taken over as they are. Changed
+// directories are queued for the workers. Gone directories are
+// dropped with their letters.
+static void index_reconcile(void)
+{
+    struct worker *w = &workers[0];
+    const struct index_header *h = index_old.header;
+
+    // Which directory does a letter belong to?
+    enum dir_state *letter_state = malloc(h->nletters * sizeof(*letter_state));
+    if (!letter_state)
+        die("malloc");
+    uint64_t in_changed = 0;
+    for (uint64_t i = 0; i < h->nletters; i++)
+    {
+        const char *name = index_string(index_old.letters[i].name);
+        const char *slash = strrchr(name, '/');
+        char dir[PATH_MAX];
+        if (slash)
+            snprintf(dir, sizeof(dir), "%.*s", (int)(slash - name), name);
+        else
+            strcpy(dir, ".");
+        struct dir_slot *slot = dir_find(dir);
+        letter_state[i] = slot->path ? slot->state : DIR_GONE;
+        if (letter_state[i] == DIR_CHANGED)
+            in_changed++;
+    }
+
+    // The letters of changed directories lend their timestamps to the
+    // walk. All others stay or go.
+    file_mask = table_size(in_changed) - 1;
+    file_table = calloc(file_mask + 1, sizeof(struct file_slot));
+    if (!file_table)
+        die("calloc");
+    for (uint64_t i = 0; i < h->nletters; i++)
+    {
+        const struct index_letter *l = &index_old.letters[i];
+        if (letter_state[i] == DIR_UNCHANGED)
+        {
+            append_letter(w, (struct letter){l->timestamp,
+                                             (char *)index_string(l->name),
+                                             l->ino});
+        }
+        else if (letter_state[i] == DIR_CHANGED && l->ino)
+            *file_find(l->ino) = (struct file_slot){l->ino, l};
+    }
+    free(letter_state);
+
+    int next = 0;
+    for (uint64_t i = 0; i < h->ndirs; i++)
+    {
+        const struct index_dir *d = &index_old.dirs[i];
+        const char *path = index_string(d->path);
+        enum dir_state state = dir_find(path)->state;
+        if (state == DIR_UNCHANGED)
+            add_visited(w, path,
+                        (struct statx_timestamp){.tv_sec = d->mtime_sec,
+                                                 .tv_nsec = d->mtime_nsec});
+        else if (state == DIR_CHANGED)
+        {
+            push_job(&workers[next], (char *)path);
+            next = (next + 1) % nworkers;
+        }
+    }
+}
+
+// Write the index for the sorted letters and the visited directories.
+// We write to a temporary file and rename(2) it, so that a crash
+// leaves either the old or the new index behind.
+static void index_write(const char *file, const struct letter *letters,
+                        size_t nletters)
+{
+    size_t ndirs = 0;
+    for (int i = 0; i < nworkers; i++)
+        ndirs += workers[i].nvisited;
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+    FILE *f = fopen(tmp, "we");
+    if (!f)
+        die("fopen: index");
+    static char buf[1 << 20];
+    setvbuf(f, buf, _IOFBF, sizeof(buf));
+
+    struct index_header h = {.nletters = nletters, .ndirs = ndirs};
+    memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+    for (size_t i = 0; i < nletters; i++)
+        h.strings += strlen(letters[i].filename) + 1;
+    for (int i = 0; i < nworkers; i++)
+    {
+        for (size_t j = 0; j < workers[i].nvisited; j++)
+            h.strings += strlen(workers[i].visited[j].path) + 1;
+    }
+    fwrite(&h, sizeof(h), 1, f);
+
+    uint64_t off = 0;
+    for (size_t i = 0; i < nletters; i++)
+    {
+        struct index_letter l = {letters[i].timestamp, letters[i].ino, off};
+        fwrite(&l, sizeof(l), 1, f);
+        off += strlen(letters[i].filename) + 1;
+    }
+    for (int i = 0; i < nworkers; i++)
+    {
+        for (size_t j = 0; j < workers[i].nvisited; j++)
+        {
+            const struct dir_record *r = &workers[i].visited[j];
+            struct index_dir d = {.mtime_sec = r->mtime.tv_sec,
+                                  .mtime_nsec = r->mtime.tv_nsec,
+                                  .path = off};
+            fwrite(&d, sizeof(d), 1, f);
+            off += strlen(r->path) + 1;
+        }
+    }
+    for (size_t i = 0; i < nletters; i++)
+        fwrite(letters[i].filename, strlen(letters[i].filename) + 1, 1, f);
+    for (int i = 0; i < nworkers; i++)
+    {
+        for (size_t j = 0; j < workers[i].nvisited; j++)
+            fwrite(workers[i].visited[j].path,
+                   strlen(workers[i].visited[j].path) + 1, 1, f);
+    }
+    if (fclose(f) != 0)
+        die("fclose: index");
+    if (rename(tmp, file) < 0)
+        die("rename: index");
+}
+
+// Answer from the mapped index. The letters are sorted, so we find the
+// letters since the last Christmas with a binary search.
+static size_t index_lower_bound(time_t timestamp)
+{
+    size_t lo = 0, hi = index_old.header->nletters;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (index_old.letters[mid].timestamp < timestamp)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static size_t index_output(bool quiet)
+{
+    size_t first = index_lower_bound(last_christmas);
+    size_t end = index_lower_bound(next_christmas);
+    if (top_k && end - first > top_k)
+        first = end - top_k;
+    for (size_t i = first; i < end && !quiet; i++)
+        printf("%ld days: %s\n",
+               (long)((next_christmas - index_old.letters[i].timestamp) /
+                      (24 * 60 * 60)),
+               index_string(index_old.letters[i].name));
+    return end - first;
+}
@@ -1,11 +1,18 @@
 #define _GNU_SOURCE
 #include <dirent.h>
+#include <limits.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -21,10 +28,23 @@
 // that timestamp from the current time.
 time_t christmas_day(int delta_year)
 {
-    // FIXME: calculate timestamp for Christmas.
     // delta_years = 0  => this Christmas
     // delta_years = -1 => last Christmas
-    return time(NULL);
+    //
+    // "This Christmas" is the next one that has not yet begun. The
+    // presents are handed out on Christmas Eve, so we count from
+    // December 24th, 00:00 local time.
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    int year = tm.tm_year;
+    struct tm eve = {.tm_year = year, .tm_mon = 11, .tm_mday = 24,
+                     .tm_isdst = -1};
+    if (mktime(&eve) <= now)
+        year++;
+    eve = (struct tm){.tm_year = year + delta_year, .tm_mon = 11,
+                      .tm_mday = 24, .tm_isdst = -1};
+    return mktime(&eve);
 }
 
 // For us, a letter consists of a timestamp and a pointer to a
@@ -33,19 +53,739 @@ struct letter
 {
     time_t timestamp;
     char *filename;
+    uint64_t ino; // For the index
 };
 
+////////////////////////////////////////////////////////////////
+// String Arena
+//
+// With millions of letters, one malloc(3) per filename costs time and
+// memory (at least 32 bytes per allocation). Instead, every worker
+// packs its filenames densely into large chunks, which it never moves
+// or frees before the end. The first word of a chunk links to the
+// previous chunk.
+#define ARENA_CHUNK (1 << 20)
+
+struct arena
+{
+    char *chunk; // The current chunk
+    size_t used; // Bytes used in the current chunk
+};
+
+static char *arena_alloc(struct arena *a, size_t len)
+{
+    if (!a->chunk || a->used + len > ARENA_CHUNK)
+    {
+        size_t size = sizeof(char *) + len;
+        char *chunk = malloc(size > ARENA_CHUNK ? size : ARENA_CHUNK);
+        if (!chunk)
+            die("malloc");
+        memcpy(chunk, &a->chunk, sizeof(char *));
+        a->chunk = chunk;
+        a->used = sizeof(char *);
+    }
+    char *p = a->chunk + a->used;
+    a->used += len;
+    return p;
+}
+
+static void arena_free(struct arena *a)
+{
+    while (a->chunk)
+    {
+        char *prev;
+        memcpy(&prev, a->chunk, sizeof(char *));
+        free(a->chunk);
+        a->chunk = prev;
+    }
+}
+
+////////////////////////////////////////////////////////////////
+// Sorting
+//
+// We sort letters with an LSD radix sort on their timestamp: one
+// stable counting-sort pass per byte, starting with the least
+// significant one. That is O(n) instead of O(n log n) comparisons,
+// and we count the bytes of all passes in a single sweep. Passes in
+// which all letters have the same byte (e.g., the upper bytes of
+// timestamps from the same year) are skipped. Letters with the same
+// timestamp keep the order in which we found them.
+
+// Flipping the sign bit orders negative timestamps before positive ones
+static uint64_t radix_key(const struct letter *l)
+{
+    return (uint64_t)l->timestamp ^ (UINT64_C(1) << 63);
+}
+
+static void radix_sort(struct letter *letters, size_t n)
+{
+    if (n < 2)
+        return;
+    static size_t count[8][256];
+    memset(count, 0, sizeof(count));
+    for (size_t i = 0; i < n; i++)
+    {
+        uint64_t key = radix_key(&letters[i]);
+        for (int pass = 0; pass < 8; pass++)
+            count[pass][(key >> (8 * pass)) & 0xff]++;
+    }
+
+    struct letter *tmp = malloc(n * sizeof(struct letter));
+    if (!tmp)
+        die("malloc");
+    struct letter *src = letters, *dst = tmp;
+    for (int pass = 0; pass < 8; pass++)
+    {
+        int shift = 8 * pass;
+        if (count[pass][(radix_key(&src[0]) >> shift) & 0xff] == n)
+            continue;
+        size_t pos = 0;
+        for (int b = 0; b < 256; b++)
+        {
+            size_t c = count[pass][b];
+            count[pass][b] = pos;
+            pos += c;
+        }
+        for (size_t i = 0; i < n; i++)
+            dst[count[pass][(radix_key(&src[i]) >> shift) & 0xff]++] = src[i];
+        struct letter *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != letters)
+        memcpy(letters, src, n * sizeof(struct letter));
+    free(tmp);
+}
+
+// The first of the sorted letters that is not older than timestamp
+static size_t letters_lower_bound(const struct letter *letters, size_t n,
+                                  time_t timestamp)
+{
+    size_t lo = 0, hi = n;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (letters[mid].timestamp < timestamp)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int compare_letters(const void *a, const void *b)
+{
+    const struct letter *x = a, *y = b;
+    if (x->timestamp != y->timestamp)
+        return x->timestamp < y->timestamp ? -1 : 1;
+    return strcmp(x->filename, y->filename);
+}
+
+// With TOP=k, a worker only keeps the k letters that are closest to
+// Christmas, that is, the latest ones. They live in a min-heap on the
+// timestamp, so the root is the letter that the next closer one
+// replaces. Memory stays O(k) per worker, no matter how large the
+// mailbox is. As filenames come and go here, each one has its own
+// malloc(3).
+static void heap_sift_down(struct letter *heap, size_t n, size_t i)
+{
+    while (true)
+    {
+        size_t min = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < n && heap[l].timestamp < heap[min].timestamp)
+            min = l;
+        if (r < n && heap[r].timestamp < heap[min].timestamp)
+            min = r;
+        if (min == i)
+            return;
+        struct letter swap = heap[i];
+        heap[i] = heap[min];
+        heap[min] = swap;
+        i = min;
+    }
+}
+
+static void heap_sift_up(struct letter *heap, size_t i)
+{
+    while (i > 0 && heap[(i - 1) / 2].timestamp > heap[i].timestamp)
+    {
+        struct letter swap = heap[i];
+        heap[i] = heap[(i - 1) / 2];
+        heap[(i - 1) / 2] = swap;
+        i = (i - 1) / 2;
+    }
+}
+
+////////////////////////////////////////////////////////////////
+// Directory Walker
+//
+// We walk the mailbox recursively. Instead of readdir(3), we call
+// getdents64(2) directly with a large buffer (1 MiB), which fetches
+// thousands of entries per system call. The entry type (d_type) tells
+// us whether an entry is a directory or a regular file without any
+// stat. Thereby, we call statx(2) only for regular files, and only ask
+// for the timestamps (STATX_BTIME). Only if the file system does not
+// fill in d_type (DT_UNKNOWN), statx has to tell us the type as well.
+//
+// With THREADS=n (default: number of CPUs), n workers walk the tree in
+// parallel. Every worker has its own deque of directories that still
+// have to be read. A worker pushes the subdirectories that it finds
+// to the bottom of its own deque and pops from there (depth-first,
+// which keeps its deque short). An idle worker steals from the top of
+// another worker's deque, which holds the oldest, and therefore
+// probably largest, subtrees.
+//
+// With WALK=readdir, a single thread walks the tree with readdir(3)
+// and statx(2) for every entry, which is what ls -lR or nftw(3) do.
+// With COUNT=1, we only count entries and do not fetch timestamps.
+// With TOP=k, we only output the k letters closest to Christmas.
+// With INDEX=file, see index.c.
+
+#define DENTS_BUF (1 << 20)
+
+// The record that getdents64(2) fills in. glibc does not export it.
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct dir_record
+{
+    const char *path;
+    struct statx_timestamp mtime;
+};
+
+struct worker
+{
+    pthread_t thread;
+    int id;
+
+    // The deque of directories (paths relative to root_fd). The owner
+    // works at tail, thieves steal at head.
+    pthread_mutex_t lock;
+    char **jobs;
+    size_t head, tail, cap;
+
+    // The letters that this worker found (with TOP: a heap), and the
+    // arena for their filenames and for the paths of directories
+    struct letter *letters;
+    size_t nletters, cap_letters;
+    struct arena arena;
+
+    // With INDEX: the directories that this worker has read
+    struct dir_record *visited;
+    size_t nvisited, cap_visited;
+
+    char *dents; // getdents64(2) buffer
+
+    // Statistics
+    uint64_t entries, dirs, statx_calls, steals;
+};
+
+static int root_fd;          // The mailbox
+static bool count_only;      // COUNT=1
+static size_t top_k;         // TOP
+static int nworkers;         // THREADS
+static struct worker *workers;
+
+// Only letters between the last and the next Christmas are of interest
+static time_t last_christmas, next_christmas;
+
+// Hooks of the persistent index (index.c). The index has to hold all
+// letters, not only those of this year.
+static bool indexing; // INDEX
+static void index_visit(struct worker *w, int fd, const char *path);
+static bool index_known_dir(const char *dir, const char *name);
+static bool index_known_file(uint64_t ino, const char *dir, const char *name,
+                             time_t *timestamp);
+
+// Directories that are queued or currently being read. When it drops
+// to zero, the walk is done.
+static atomic_long pending;
+
+// A worker that finds no job sleeps on idle_cond until wakeups changes:
+// with every pushed job, and when the walk is done. The pusher only
+// takes idle_lock if someone sleeps. As both sides first write their
+// own counter and then read the other one, one of them sees the other.
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static atomic_ulong wakeups;
+static atomic_int sleepers;
+
+static void wake_idle(bool all)
+{
+    atomic_fetch_add(&wakeups, 1);
+    if (atomic_load(&sleepers) == 0)
+        return;
+    pthread_mutex_lock(&idle_lock);
+    if (all)
+        pthread_cond_broadcast(&idle_cond);
+    else
+        pthread_cond_signal(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+}
+
+// Sleep until wakeups differs from seen, the value from before we
+// looked for a job in vain
+static void wait_idle(unsigned long seen)
+{
+    pthread_mutex_lock(&idle_lock);
+    atomic_fetch_add(&sleepers, 1);
+    while (atomic_load(&wakeups) == seen)
+        pthread_cond_wait(&idle_cond, &idle_lock);
+    atomic_fetch_sub(&sleepers, 1);
+    pthread_mutex_unlock(&idle_lock);
+}
+
+static void push_job(struct worker *w, char *path)
+{
+    atomic_fetch_add(&pending, 1);
+    pthread_mutex_lock(&w->lock);
+    if (w->tail == w->cap)
+    {
+        if (w->head > 0)
+        {
+            memmove(w->jobs, w->jobs + w->head,
+                    (w->tail - w->head) * sizeof(char *));
+            w->tail -= w->head;
+            w->head = 0;
+        }
+        else
+        {
+            w->cap = w->cap ? 2 * w->cap : 64;
+            w->jobs = realloc(w->jobs, w->cap * sizeof(char *));
+            if (!w->jobs)
+                die("realloc");
+        }
+    }
+    w->jobs[w->tail++] = path;
+    pthread_mutex_unlock(&w->lock);
+    wake_idle(false);
+}
+
+static char *pop_job(struct worker *w)
+{
+    char *path = NULL;
+    pthread_mutex_lock(&w->lock);
+    if (w->head < w->tail)
+        path = w->jobs[--w->tail];
+    pthread_mutex_unlock(&w->lock);
+    return path;
+}
+
+static char *steal_job(struct worker *w)
+{
+    for (int i = 1; i < nworkers; i++)
+    {
+        struct worker *victim = &workers[(w->id + i) % nworkers];
+        char *path = NULL;
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail)
+            path = victim->jobs[victim->head++];
+        pthread_mutex_unlock(&victim->lock);
+        if (path)
+        {
+            w->steals++;
+            return path;
+        }
+    }
+    return NULL;
+}
+
+// Paths are relative to the mailbox and do not start with "./"
+static char *join(struct arena *a, const char *dir, const char *name)
+{
+    if (strcmp(dir, ".") == 0)
+        dir = NULL;
+    size_t dlen = dir ? strlen(dir) + 1 : 0, nlen = strlen(name) + 1;
+    char *path = a ? arena_alloc(a, dlen + nlen) : malloc(dlen + nlen);
+    if (!path)
+        die("malloc");
+    if (dir)
+    {
+        memcpy(path, dir, dlen - 1);
+        path[dlen - 1] = '/';
+    }
+    memcpy(path + dlen, name, nlen);
+    return path;
+}
+
+static void append_letter(struct worker *w, struct letter letter)
+{
+    if (w->nletters == w->cap_letters)
+    {
+        w->cap_letters = w->cap_letters ? 2 * w->cap_letters : 1024;
+        w->letters =
+            realloc(w->letters, w->cap_letters * sizeof(struct letter));
+        if (!w->letters)
+            die("realloc");
+    }
+    w->letters[w->nletters++] = letter;
+}
+
+static void add_letter(struct worker *w, time_t timestamp, uint64_t ino,
+                       const char *dir, const char *name)
+{
+    if (indexing)
+    {
+        append_letter(w, (struct letter){timestamp,
+                                         join(&w->arena, dir, name), ino});
+        return;
+    }
+    if (timestamp < last_christmas || timestamp >= next_christmas)
+        return;
+    if (top_k)
+    {
+        if (w->nletters < top_k)
+        {
+            w->letters[w->nletters] =
+                (struct letter){timestamp, join(NULL, dir, name), ino};
+            heap_sift_up(w->letters, w->nletters++);
+        }
+        else if (timestamp > w->letters[0].timestamp)
+        {
+            free(w->letters[0].filename);
+            w->letters[0] =
+                (struct letter){timestamp, join(NULL, dir, name), ino};
+            heap_sift_down(w->letters, w->nletters, 0);
+        }
+        return;
+    }
+    append_letter(w, (struct letter){timestamp, join(&w->arena, dir, name),
+                                     ino});
+}
+
+// The birth time, if the file system records it, and the modification
+// time otherwise
+static time_t statx_time(const struct statx *stx)
+{
+    if (stx->stx_mask & STATX_BTIME)
+        return stx->stx_btime.tv_sec;
+    return stx->stx_mtime.tv_sec;
+}
+
+static void walk_getdents(struct worker *w, char *path)
+{
+    int fd = openat(root_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        perror(path);
+        return;
+    }
+    w->dirs++;
+    if (indexing)
+        index_visit(w, fd, path);
+
+    long nread;
+    while ((nread = syscall(SYS_getdents64, fd, w->dents, DENTS_BUF)) > 0)
+    {
+        for (long off = 0; off < nread;)
+        {
+            struct linux_dirent64 *d = (void *)(w->dents + off);
+            off += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.' &&
+                (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+                continue;
+            w->entries++;
+
+            unsigned type = d->d_type;
+            if (type == DT_DIR)
+            {
+                if (!index_known_dir(path, name))
+                    push_job(w, join(&w->arena, path, name));
+                continue;
+            }
+            if (type != DT_REG && type != DT_UNKNOWN)
+                continue;
+            if (count_only && type == DT_REG)
+                continue;
+            time_t timestamp;
+            if (index_known_file(d->d_ino, path, name, &timestamp))
+            {
+                add_letter(w, timestamp, d->d_ino, path, name);
+                continue;
+            }
+
+            // Only here, we need an inode: for the timestamp, and for
+            // the type if d_type does not tell it.
+            struct statx stx;
+            unsigned mask = STATX_BTIME | STATX_MTIME;
+            if (type == DT_UNKNOWN)
+                mask |= STATX_TYPE;
+            w->statx_calls++;
+            if (statx(fd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, mask,
+                      &stx) < 0)
+                continue; // The file vanished
+            if (S_ISDIR(stx.stx_mode))
+            {
+                if (!index_known_dir(path, name))
+                    push_job(w, join(&w->arena, path, name));
+            }
+            else if (S_ISREG(stx.stx_mode) && !count_only)
+                add_letter(w, statx_time(&stx), d->d_ino, path, name);
+        }
+    }
+    if (nread < 0)
+        perror(path);
+    close(fd);
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    w->dents = malloc(DENTS_BUF);
+    if (!w->dents)
+        die("malloc");
+    while (true)
+    {
+        unsigned long seen = atomic_load(&wakeups);
+        char *path = pop_job(w);
+        if (!path)
+            path = steal_job(w);
+        if (path)
+        {
+            walk_getdents(w, path);
+            if (atomic_fetch_sub(&pending, 1) == 1)
+                wake_idle(true); // The walk is done
+        }
+        else if (atomic_load(&pending) == 0)
+            break;
+        else
+            wait_idle(seen); // Others are still reading directories
+    }
+    free(w->dents);
+    return NULL;
+}
+
+// The baseline: recursive readdir(3) and statx(2) for every entry
+static void walk_readdir(struct worker *w, int dir_fd, const char *path)
+{
+    DIR *dir = fdopendir(dir_fd);
+    if (!dir)
+        die("fdopendir");
+    w->dirs++;
+    struct dirent *d;
+    while ((d = readdir(dir)))
+    {
+        const char *name = d->d_name;
+        if (!strcmp(name, ".") || !strcmp(name, ".."))
+            continue;
+        w->entries++;
+        struct statx stx;
+        w->statx_calls++;
+        if (statx(dirfd(dir), name, AT_SYMLINK_NOFOLLOW,
+                  STATX_BASIC_STATS | STATX_BTIME, &stx) < 0)
+            continue;
+        if (S_ISDIR(stx.stx_mode))
+        {
+            int fd =
+                openat(dirfd(dir), name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0)
+            {
+                perror(name);
+                continue;
+            }
+            walk_readdir(w, fd, join(&w->arena, path, name));
+        }
+        else if (S_ISREG(stx.stx_mode) && !count_only)
+            add_letter(w, statx_time(&stx), d->d_ino, path, name);
+    }
+    closedir(dir);
+}
+
+#include "index.c"
+
 int main(int argc, char *argv[])
 {
-    // FIXME: Open the directory with open(2) and O_DIRECTORY
-    // FIXME: Read directory entries with getdents64(2)
-    // FIXME: For each entry, use statx(2) to extract the birthtime
-    // FIXME: Sort by birthtime with qsort(3)
-    // FIXME: Output letters that were created after the last christmas
-    //        and before the next christmas in the following format
-    //        (151 until the next Christmas).
-
-    // $ ./letters
-    // 151 days: Makefile
-    // 151 days: letters
+    const char *mailbox = argc > 1 ? argv[1] : ".";
+    bool quiet = getenv("QUIET") && atoi(getenv("QUIET"));
+    count_only = getenv("COUNT") && atoi(getenv("COUNT"));
+    char *WALK = getenv("WALK");
+    bool use_readdir = WALK && !strcmp(WALK, "readdir");
+    char *THREADS = getenv("THREADS");
+    nworkers = THREADS ? atoi(THREADS) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers < 1 || use_readdir)
+        nworkers = 1;
+    char *TOP = getenv("TOP");
+    top_k = TOP ? atol(TOP) : 0;
+    char *SORT = getenv("SORT");
+    bool use_qsort = SORT && !strcmp(SORT, "qsort");
+    char *INDEX = getenv("INDEX");
+    indexing = INDEX && *INDEX;
+    if (indexing)
+        use_readdir = count_only = false;
+    char *REFRESH = getenv("REFRESH");
+    index_refresh = !REFRESH || atoi(REFRESH);
+    last_christmas = christmas_day(-1);
+    next_christmas = christmas_day(0);
+    index_scan_start = time(NULL);
+
+    root_fd = open(mailbox, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0)
+        die("open");
+    if (indexing && !index_usable())
+    {
+        fprintf(stderr, "%s: no birth times, ignoring INDEX\n", mailbox);
+        indexing = false;
+    }
+
+    workers = calloc(nworkers, sizeof(struct worker));
+    if (!workers)
+        die("calloc");
+    for (int i = 0; i < nworkers; i++)
+    {
+        workers[i].id = i;
+        pthread_mutex_init(&workers[i].lock, NULL);
+        if (top_k && !indexing)
+        {
+            workers[i].letters = malloc(top_k * sizeof(struct letter));
+            if (!workers[i].letters)
+                die("malloc");
+        }
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // If the index is up to date, it answers our query on its own.
+    // Otherwise, we only walk what has changed.
+    bool have_index = indexing && index_load(INDEX);
+    uint64_t index_changed = 0, index_statx = 0;
+    if (have_index)
+    {
+        if (index_refresh)
+            index_changed = index_check(&index_statx);
+        if (index_changed == 0)
+        {
+            size_t n = index_output(quiet);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            if (quiet)
+                fprintf(stderr,
+                        "index %s: %lu letters, %lu directories, %lu statx; "
+                        "%zu letters answered in %.6f s\n",
+                        index_refresh ? "unchanged" : "not checked",
+                        index_old.header->nletters, index_old.header->ndirs,
+                        index_statx, n,
+                        end.tv_sec - start.tv_sec +
+                            (end.tv_nsec - start.tv_nsec) / 1e9);
+            return 0;
+        }
+        index_reconcile();
+    }
+
+    if (use_readdir)
+    {
+        int fd = dup(root_fd);
+        if (fd < 0)
+            die("dup");
+        walk_readdir(&workers[0], fd, ".");
+    }
+    else
+    {
+        if (!have_index)
+            push_job(&workers[0],
+                     strcpy(arena_alloc(&workers[0].arena, 2), "."));
+        for (int i = 0; i < nworkers; i++)
+        {
+            if (pthread_create(&workers[i].thread, NULL, worker_main,
+                               &workers[i]) != 0)
+                die("pthread_create");
+        }
+        for (int i = 0; i < nworkers; i++)
+            pthread_join(workers[i].thread, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // Gather the letters of all workers and sort them by timestamp
+    size_t nletters = 0;
+    uint64_t entries = 0, dirs = 0, statx_calls = 0, steals = 0;
+    for (int i = 0; i < nworkers; i++)
+    {
+        nletters += workers[i].nletters;
+        entries += workers[i].entries;
+        dirs += workers[i].dirs;
+        statx_calls += workers[i].statx_calls;
+        steals += workers[i].steals;
+    }
+    struct letter *letters = malloc((nletters + 1) * sizeof(struct letter));
+    if (!letters)
+        die("malloc");
+    size_t n = 0;
+    for (int i = 0; i < nworkers; i++)
+    {
+        memcpy(letters + n, workers[i].letters,
+               workers[i].nletters * sizeof(struct letter));
+        n += workers[i].nletters;
+        free(workers[i].letters);
+    }
+    struct timespec sorted;
+    if (use_qsort)
+        qsort(letters, nletters, sizeof(struct letter), compare_letters);
+    else
+        radix_sort(letters, nletters);
+    clock_gettime(CLOCK_MONOTONIC, &sorted);
+    if (indexing)
+        index_write(INDEX, letters, nletters);
+
+    // Output letters that were created after the last Christmas and
+    // before the next Christmas, with the days until the next one. With
+    // TOP=k, every worker has brought its k closest letters, of which we
+    // output the k closest. With INDEX, we have all letters and look
+    // for this year's ones.
+    size_t first = 0, last = nletters;
+    if (indexing)
+    {
+        first = letters_lower_bound(letters, nletters, last_christmas);
+        last = letters_lower_bound(letters, nletters, next_christmas);
+    }
+    if (top_k && last - first > top_k)
+        first = last - top_k;
+    for (size_t i = first; i < last && !quiet; i++)
+        printf("%ld days: %s\n",
+               (long)((next_christmas - letters[i].timestamp) / (24 * 60 * 60)),
+               letters[i].filename);
+    struct timespec done;
+    clock_gettime(CLOCK_MONOTONIC, &done);
+    if (top_k && !indexing)
+    {
+        for (size_t i = 0; i < nletters; i++)
+            free(letters[i].filename);
+    }
+    free(letters);
+
+    double seconds =
+        end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+    double sort_seconds =
+        sorted.tv_sec - end.tv_sec + (sorted.tv_nsec - end.tv_nsec) / 1e9;
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    if (quiet)
+        fprintf(stderr,
+                "%s, %d threads: %lu entries in %lu directories in %.3f s: "
+                "%.0f entries/s, %.2f statx/entry, %lu steals; "
+                "%zu letters sorted (%s) in %.3f s, max RSS %.1f MiB\n",
+                use_readdir ? "readdir" : "getdents", nworkers, entries, dirs,
+                seconds, entries / seconds,
+                entries ? (double)statx_calls / entries : 0.0, steals, nletters,
+                use_qsort ? "qsort" : "radix", sort_seconds,
+                ru.ru_maxrss / 1024.0);
+    size_t visited = 0;
+    for (int i = 0; i < nworkers; i++)
+        visited += workers[i].nvisited;
+    if (quiet && indexing)
+        fprintf(stderr,
+                "index %s: %zu letters, %zu directories (%lu changed), "
+                "%lu statx; %zu letters answered in %.6f s\n",
+                have_index ? "refreshed" : "built", nletters, visited,
+                index_changed, statx_calls + index_statx, last - first,
+                done.tv_sec - start.tv_sec +
+                    (done.tv_nsec - start.tv_nsec) / 1e9);
+    for (int i = 0; i < nworkers; i++)
+        arena_free(&workers[i].arena);
+    return 0;
 }
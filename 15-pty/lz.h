@@ -0,0 +1,185 @@
+// A small block compressor in the format of LZ4. A compressed block is
+// a sequence of (literals, match) pairs:
+//
+//   token | [literal length bytes] | literals | offset | [match length bytes]
+//
+// The upper four bits of the token hold the number of literals, the
+// lower four bits the match length minus four. A value of 15 continues
+// in the following bytes, which are added up until one is below 255.
+// The offset (16 bit, little endian) points back into the data that
+// has already been decompressed. The last sequence has only literals.
+//
+// We find matches with a hash table over the next four bytes, which
+// holds the last position where those bytes occurred. Blocks are
+// compressed independently, so a block is at most 64 KiB.
+//
+// An LZ file ("SCRIBLZ4") is a sequence of blocks:
+//
+//   uint32 raw length | uint32 stored length | data
+//
+// If the top bit of the stored length is set, the data is stored
+// uncompressed.
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_MAGIC "SCRIBLZ4"
+#define LZ_BLOCK (64 * 1024)
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+#define LZ_STORED 0x80000000u
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5 // The last bytes are always literals...
+#define LZ_MF_LIMIT 12     // ... and no match starts in the last 12 bytes
+
+struct lz_block
+{
+    uint32_t raw_len;
+    uint32_t stored_len;
+};
+
+static inline uint32_t lz_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t seq)
+{
+    return (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static inline uint8_t *lz_length(uint8_t *op, size_t len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+static inline uint8_t *lz_sequence(uint8_t *op, const uint8_t *literals,
+                                   size_t nliterals, size_t offset,
+                                   size_t match_len)
+{
+    uint8_t *token = op++;
+    *token = (nliterals < 15 ? nliterals : 15) << 4;
+    if (nliterals >= 15)
+        op = lz_length(op, nliterals - 15);
+    memcpy(op, literals, nliterals);
+    op += nliterals;
+    if (offset == 0)
+        return op; // The last sequence
+    *op++ = offset;
+    *op++ = offset >> 8;
+    match_len -= LZ_MIN_MATCH;
+    *token |= match_len < 15 ? match_len : 15;
+    if (match_len >= 15)
+        op = lz_length(op, match_len - 15);
+    return op;
+}
+
+// Compress n (<= LZ_BLOCK) bytes from src into dst, which has room for
+// LZ_BOUND(n) bytes. Returns the compressed length.
+static inline size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst)
+{
+    uint16_t table[1 << LZ_HASH_BITS] = {0};
+    const uint8_t *ip = src, *anchor = src, *end = src + n;
+    uint8_t *op = dst;
+    if (n >= LZ_MF_LIMIT + 1)
+    {
+        const uint8_t *mf_limit = end - LZ_MF_LIMIT;
+        const uint8_t *match_limit = end - LZ_LAST_LITERALS;
+        unsigned misses = 0;
+        while (ip < mf_limit)
+        {
+            uint32_t seq = lz_read32(ip);
+            uint32_t h = lz_hash(seq);
+            const uint8_t *ref = src + table[h];
+            table[h] = ip - src;
+            if (ref >= ip || lz_read32(ref) != seq)
+            {
+                // In incompressible data, we take larger and larger
+                // steps, like LZ4 does.
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+            const uint8_t *m = ip + LZ_MIN_MATCH, *r = ref + LZ_MIN_MATCH;
+            while (m < match_limit && *m == *r)
+            {
+                m++;
+                r++;
+            }
+            op = lz_sequence(op, anchor, ip - anchor, ip - ref, m - ip);
+            ip = anchor = m;
+        }
+    }
+    return lz_sequence(op, anchor, end - anchor, 0, 0) - dst;
+}
+
+// Decompress a block into dst, which has room for dst_len bytes.
+// Returns the decompressed length, or -1 for a broken block.
+static inline long lz_decompress(const uint8_t *src, size_t src_len,
+                                 uint8_t *dst, size_t dst_len)
+{
+    const uint8_t *ip = src, *end = src + src_len;
+    uint8_t *op = dst, *op_end = dst + dst_len;
+    while (ip < end)
+    {
+        uint8_t token = *ip++;
+        size_t len = token >> 4;
+        if (len == 15)
+        {
+            uint8_t byte;
+            do
+            {
+                if (ip >= end)
+                    return -1;
+                len += byte = *ip++;
+            } while (byte == 255);
+        }
+        if (len > (size_t)(end - ip) || len > (size_t)(op_end - op))
+            return -1;
+        memcpy(op, ip, len);
+        ip += len;
+        op += len;
+        if (ip == end)
+            break; // The last sequence has no match
+
+        if (end - ip < 2)
+            return -1;
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        len = (token & 15);
+        if (len == 15)
+        {
+            uint8_t byte;
+            do
+            {
+                if (ip >= end)
+                    return -1;
+                len += byte = *ip++;
+            } while (byte == 255);
+        }
+        len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - dst) ||
+            len > (size_t)(op_end - op))
+            return -1;
+        // The match may overlap with what it produces (e.g., a run of
+        // one repeated byte). Then, we have to copy byte by byte.
+        const uint8_t *ref = op - offset;
+        if (offset >= len)
+            memcpy(op, ref, len);
+        else
+        {
+            for (size_t i = 0; i < len; i++)
+                op[i] = ref[i];
+        }
+        op += len;
+    }
+    return op - dst;
+}
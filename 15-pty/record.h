@@ -0,0 +1,352 @@
+// A compact recording format for terminal sessions. A recording is a
+// sequence of chunks, each the data of one read from the pty, together
+// with the time at which it arrived:
+//
+//   | header | chunk ... | index | trailer |
+//
+//   chunk:   varint(microseconds since the previous chunk)
+//            varint(length) data[length]
+//
+// Varints take 7 bits per byte, so a chunk costs only 2-4 bytes on top
+// of its data. Every REC_INDEX_US of session time, or every
+// REC_INDEX_BYTES of data, the recorder notes the file offset of the
+// next chunk and the time before it. When the recording is closed,
+// these entries are appended as a seek index, which the trailer points
+// to. A player maps the recording, binary searches the index for a
+// point in time, and decodes at most one interval from there. If the
+// recorder did not get to write the trailer (e.g., it crashed), the
+// player rebuilds the index with one pass over the chunks.
+#pragma once
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REC_MAGIC "SCRIBREC"
+#define REC_INDEX_MAGIC "SCRIBIDX"
+#define REC_INDEX_US 1000000     // At least one index entry per second...
+#define REC_INDEX_BYTES (1 << 16) // ... and per 64 KiB of data
+#define REC_VARINT_MAX 10
+
+struct rec_header
+{
+    char magic[8];
+    uint64_t start_ns; // CLOCK_REALTIME when the recording started
+};
+
+struct rec_index
+{
+    uint64_t time_us; // Session time before the chunk at offset
+    uint64_t offset;  // File offset of a chunk
+};
+
+struct rec_trailer
+{
+    uint64_t index_offset;
+    uint64_t nindex;
+    uint64_t duration_us;
+    char magic[8];
+};
+
+static inline uint64_t rec_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline size_t varint_put(uint8_t *p, uint64_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80)
+    {
+        p[n++] = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+// Returns NULL if the varint does not end before end
+static inline const uint8_t *varint_get(const uint8_t *p, const uint8_t *end,
+                                        uint64_t *v)
+{
+    *v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7)
+    {
+        uint8_t byte = *p++;
+        *v |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return p;
+    }
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////
+// Recording
+
+struct recorder
+{
+    int fd;
+    uint64_t start_us; // rec_now_us() when the recording started
+    uint64_t last_us;  // Session time of the last chunk
+    uint64_t offset;   // File offset of the next chunk
+
+    struct rec_index *index;
+    size_t nindex, cap;
+    uint64_t index_us, index_offset; // The last index entry
+};
+
+static inline bool rec_write_all(int fd, const void *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0)
+            return false;
+        buf = (const char *)buf + n;
+        len -= n;
+    }
+    return true;
+}
+
+static inline bool rec_open(struct recorder *r, int fd)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    struct rec_header h = {.start_ns =
+                               (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec};
+    memcpy(h.magic, REC_MAGIC, sizeof(h.magic));
+    *r = (struct recorder){.fd = fd, .start_us = rec_now_us(),
+                           .offset = sizeof(h)};
+    return rec_write_all(fd, &h, sizeof(h));
+}
+
+// Encode the header of a chunk of len bytes that arrived at now_us
+// (rec_now_us()) into buf. The caller writes the header and then the
+// data. Returns the length of the header.
+static inline size_t rec_chunk(struct recorder *r, uint64_t now_us, size_t len,
+                               uint8_t buf[2 * REC_VARINT_MAX])
+{
+    uint64_t t = now_us > r->start_us ? now_us - r->start_us : 0;
+    if (t < r->last_us)
+        t = r->last_us;
+    if (r->nindex == 0 || t - r->index_us >= REC_INDEX_US ||
+        r->offset - r->index_offset >= REC_INDEX_BYTES)
+    {
+        if (r->nindex == r->cap)
+        {
+            r->cap = r->cap ? 2 * r->cap : 1024;
+            struct rec_index *index =
+                realloc(r->index, r->cap * sizeof(*index));
+            if (!index)
+                abort();
+            r->index = index;
+        }
+        r->index[r->nindex++] = (struct rec_index){r->last_us, r->offset};
+        r->index_us = t;
+        r->index_offset = r->offset;
+    }
+    size_t n = varint_put(buf, t - r->last_us);
+    n += varint_put(buf + n, len);
+    r->last_us = t;
+    r->offset += n + len;
+    return n;
+}
+
+// Record a chunk with one writev(2)
+static inline bool rec_write(struct recorder *r, const void *data, size_t len)
+{
+    uint8_t hdr[2 * REC_VARINT_MAX];
+    size_t n = rec_chunk(r, rec_now_us(), len, hdr);
+    struct iovec iov[2] = {{hdr, n}, {(void *)data, len}};
+    ssize_t written = writev(r->fd, iov, 2);
+    if (written < 0)
+        return false;
+    if ((size_t)written < n + len)
+    {
+        // Rare: finish what writev left over
+        size_t done = written;
+        if (done < n &&
+            !rec_write_all(r->fd, hdr + done, n - done))
+            return false;
+        size_t data_done = done > n ? done - n : 0;
+        return rec_write_all(r->fd, (const char *)data + data_done,
+                             len - data_done);
+    }
+    return true;
+}
+
+// Append the index and the trailer
+static inline bool rec_close(struct recorder *r)
+{
+    struct rec_trailer t = {.index_offset = r->offset,
+                            .nindex = r->nindex,
+                            .duration_us = r->last_us};
+    memcpy(t.magic, REC_INDEX_MAGIC, sizeof(t.magic));
+    bool ok = rec_write_all(r->fd, r->index, r->nindex * sizeof(*r->index)) &&
+              rec_write_all(r->fd, &t, sizeof(t));
+    free(r->index);
+    r->index = NULL;
+    return ok;
+}
+
+////////////////////////////////////////////////////////////////
+// Playing
+
+struct recording
+{
+    const uint8_t *map;
+    size_t size;
+    uint64_t start_ns;
+    const uint8_t *chunks, *end; // The chunk area
+    const struct rec_index *index;
+    size_t nindex;
+    uint64_t duration_us;
+    bool rebuilt; // The index was missing
+};
+
+// Decode the chunk at p, with the session time t before it. Returns
+// the next chunk, or NULL at the end (or at a torn chunk).
+static inline const uint8_t *rec_next(const struct recording *rec,
+                                      const uint8_t *p, uint64_t *t,
+                                      const uint8_t **data, uint64_t *len)
+{
+    uint64_t delta;
+    if (p >= rec->end || !(p = varint_get(p, rec->end, &delta)) ||
+        !(p = varint_get(p, rec->end, len)) || *len > (uint64_t)(rec->end - p))
+        return NULL;
+    *t += delta;
+    *data = p;
+    return p + *len;
+}
+
+// Rebuild the index of a recording without trailer
+static inline void rec_rebuild(struct recording *rec)
+{
+    struct rec_index *index = NULL;
+    size_t n = 0, cap = 0;
+    uint64_t t = 0, last_t = 0, len;
+    const uint8_t *p = rec->chunks, *last_p = NULL, *data, *next;
+    while (p)
+    {
+        uint64_t before = t;
+        if (!(next = rec_next(rec, p, &t, &data, &len)))
+            break;
+        if (n == 0 || t - last_t >= REC_INDEX_US ||
+            p - last_p >= REC_INDEX_BYTES)
+        {
+            if (n == cap)
+            {
+                cap = cap ? 2 * cap : 1024;
+                index = realloc(index, cap * sizeof(*index));
+                if (!index)
+                    abort();
+            }
+            index[n++] = (struct rec_index){before, p - rec->map};
+            last_t = t;
+            last_p = p;
+        }
+        p = next;
+    }
+    rec->index = index;
+    rec->nindex = n;
+    rec->duration_us = t;
+    rec->rebuilt = true;
+}
+
+// Map a recording. Returns false if it is none.
+static inline bool rec_map(struct recording *rec, const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct rec_header))
+    {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    const uint8_t *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    const struct rec_header *h = (const void *)map;
+    if (memcmp(h->magic, REC_MAGIC, sizeof(h->magic)) != 0)
+    {
+        munmap((void *)map, size);
+        return false;
+    }
+    *rec = (struct recording){.map = map, .size = size,
+                              .start_ns = h->start_ns,
+                              .chunks = map + sizeof(*h), .end = map + size};
+
+    // Use the index if the trailer is intact
+    struct rec_trailer t;
+    if (size >= sizeof(*h) + sizeof(t))
+    {
+        memcpy(&t, map + size - sizeof(t), sizeof(t));
+        if (memcmp(t.magic, REC_INDEX_MAGIC, sizeof(t.magic)) == 0 &&
+            t.index_offset >= sizeof(*h) &&
+            t.nindex <= (size - sizeof(t)) / sizeof(struct rec_index) &&
+            t.index_offset + t.nindex * sizeof(struct rec_index) ==
+                size - sizeof(t))
+        {
+            rec->end = map + t.index_offset;
+            rec->index = (const void *)(map + t.index_offset);
+            rec->nindex = t.nindex;
+            rec->duration_us = t.duration_us;
+            return true;
+        }
+    }
+    rec_rebuild(rec);
+    return true;
+}
+
+// Find the first chunk that arrived at or after session time t_us.
+// Sets *t to the session time before that chunk. Returns NULL if there
+// is none.
+static inline const uint8_t *rec_seek(const struct recording *rec,
+                                      uint64_t t_us, uint64_t *t)
+{
+    if (rec->nindex == 0)
+        return NULL;
+    // The last index entry that starts strictly before t_us. An entry
+    // holds the time of the chunk before its offset, so with <=, we
+    // would skip a chunk at exactly t_us.
+    size_t lo = 0, hi = rec->nindex;
+    while (hi - lo > 1)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (rec->index[mid].time_us < t_us)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    const uint8_t *p = rec->map + rec->index[lo].offset;
+    if (p < rec->chunks || p >= rec->end)
+        return NULL;
+    *t = rec->index[lo].time_us;
+    while (p)
+    {
+        uint64_t before = *t, len;
+        const uint8_t *data, *next = rec_next(rec, p, t, &data, &len);
+        if (!next)
+            return NULL;
+        if (*t >= t_us)
+        {
+            *t = before;
+            return p;
+        }
+        p = next;
+    }
+    return NULL;
+}
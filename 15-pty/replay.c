@@ -0,0 +1,237 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "record.h"
+
+#define die(msg)                                                               \
+    do                                                                         \
+    {                                                                          \
+        perror(msg);                                                           \
+        exit(EXIT_FAILURE);                                                    \
+    } while (0)
+
+// Plays, converts, and benchmarks recordings of scribble (FORMAT=rec):
+//
+//   ./replay REC              Play REC in real time. With SPEED=n, play
+//                             n times faster (SPEED=0: no delays). With
+//                             SEEK=s, start at second s of the session.
+//   ./replay convert RAW REC  Turn the plain output RAW into a recording,
+//                             with chunks of CHUNK bytes (default 64)
+//                             every INTERVAL us (default 100000).
+//                             NOINDEX=1 leaves out the index, like a
+//                             recorder that crashed.
+//   ./replay bench REC        Measure the time to open REC, to seek to
+//                             SEEKS random points in time, and to decode
+//                             the whole recording.
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double env_double(const char *name, double def)
+{
+    char *value = getenv(name);
+    return value ? atof(value) : def;
+}
+
+static void write_all(int fd, const uint8_t *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            die("write");
+        buf += n;
+        len -= n;
+    }
+}
+
+static int play(const char *path)
+{
+    struct recording rec;
+    if (!rec_map(&rec, path))
+        die("rec_map");
+    double speed = env_double("SPEED", 1);
+    uint64_t seek_us = env_double("SEEK", 0) * 1e6;
+
+    uint64_t t;
+    const uint8_t *p = rec_seek(&rec, seek_us, &t);
+    uint64_t start = rec_now_us();
+    while (p)
+    {
+        const uint8_t *data;
+        uint64_t len;
+        const uint8_t *next = rec_next(&rec, p, &t, &data, &len);
+        if (!next)
+            break;
+        if (speed > 0)
+        {
+            // Sleep until the chunk is due. As we sleep until an
+            // absolute time, our own delays do not add up.
+            uint64_t due = start + (t - seek_us) / speed;
+            struct timespec ts = {due / 1000000, due % 1000000 * 1000};
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+                   EINTR)
+                ;
+        }
+        write_all(STDOUT_FILENO, data, len);
+        p = next;
+    }
+    return 0;
+}
+
+static int convert(const char *raw, const char *path)
+{
+    int in = open(raw, O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+        die("open: RAW");
+    int out = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0)
+        die("open: REC");
+    size_t chunk = env_double("CHUNK", 64);
+    uint64_t interval = env_double("INTERVAL", 100000);
+    if (chunk < 1)
+        chunk = 1;
+
+    double start = now_seconds();
+    struct recorder r;
+    if (!rec_open(&r, out))
+        die("write");
+    // Chunks are small, so we buffer them
+    FILE *f = fdopen(out, "w");
+    static char obuf[1 << 20];
+    if (!f || setvbuf(f, obuf, _IOFBF, sizeof(obuf)) != 0)
+        die("fdopen");
+    static uint8_t buf[1 << 20];
+    uint64_t raw_bytes = 0, chunks = 0, t = r.start_us;
+    ssize_t n;
+    while ((n = read(in, buf, sizeof(buf))) > 0)
+    {
+        for (size_t off = 0; off < (size_t)n; off += chunk)
+        {
+            size_t len = n - off < chunk ? n - off : chunk;
+            uint8_t hdr[2 * REC_VARINT_MAX];
+            size_t h = rec_chunk(&r, t, len, hdr);
+            if (fwrite(hdr, h, 1, f) != 1 || fwrite(buf + off, len, 1, f) != 1)
+                die("fwrite");
+            t += interval;
+            chunks++;
+        }
+        raw_bytes += n;
+    }
+    if (n < 0)
+        die("read");
+    size_t nindex = r.nindex;
+    uint64_t duration = r.last_us;
+    if (fflush(f) != 0)
+        die("fflush");
+    char *NOINDEX = getenv("NOINDEX");
+    if (NOINDEX && atoi(NOINDEX))
+    {
+        free(r.index);
+        nindex = 0;
+    }
+    else if (!rec_close(&r))
+        die("write");
+    double seconds = now_seconds() - start;
+    off_t size = lseek(out, 0, SEEK_CUR);
+    fclose(f);
+    close(in);
+
+    printf("convert: %.1f MiB raw -> %.1f MiB recording (+%.1f%%), %" PRIu64
+           " chunks, %zu index entries, %.1f h, in %.3f s: %.0f MiB/s\n",
+           raw_bytes / 1048576.0, size / 1048576.0,
+           raw_bytes ? 100.0 * (size - (double)raw_bytes) / raw_bytes : 0.0,
+           chunks, nindex, duration / 3600e6, seconds,
+           raw_bytes / 1048576.0 / seconds);
+    return 0;
+}
+
+static int bench(const char *path)
+{
+    double start = now_seconds();
+    struct recording rec;
+    if (!rec_map(&rec, path))
+        die("rec_map");
+    double opened = now_seconds() - start;
+
+    // Random points in time. A seek has to find the first chunk at or
+    // after the point; we check that its time is right, and that the
+    // chunk before it (whose time rec_seek() returns) is earlier.
+    size_t seeks = env_double("SEEKS", 100000);
+    srand(42);
+    uint64_t found = 0;
+    start = now_seconds();
+    for (size_t i = 0; i < seeks; i++)
+    {
+        uint64_t target = (uint64_t)((double)rand() / RAND_MAX *
+                                     rec.duration_us);
+        uint64_t t;
+        const uint8_t *p = rec_seek(&rec, target, &t);
+        if (p)
+        {
+            const uint8_t *data;
+            uint64_t len, before = t;
+            if (!rec_next(&rec, p, &t, &data, &len) || t < target ||
+                (p != rec.chunks && before >= target))
+            {
+                fprintf(stderr, "seek to %" PRIu64 " us failed\n", target);
+                return EXIT_FAILURE;
+            }
+            found++;
+        }
+    }
+    double seek_seconds = now_seconds() - start;
+
+    // Decode everything
+    start = now_seconds();
+    uint64_t t = 0, bytes = 0, chunks = 0, len;
+    const uint8_t *data;
+    for (const uint8_t *p = rec.chunks; p;)
+    {
+        const uint8_t *next = rec_next(&rec, p, &t, &data, &len);
+        if (!next)
+            break;
+        bytes += len;
+        chunks++;
+        p = next;
+    }
+    double decode_seconds = now_seconds() - start;
+
+    printf("bench: %.1f MiB, %" PRIu64 " chunks, %.1f h, %zu index entries%s\n"
+           "  open:   %.3f ms\n"
+           "  seek:   %.2f us per seek (%zu seeks, %" PRIu64 " hits)\n"
+           "  decode: %.3f s: %.0f MiB/s\n",
+           rec.size / 1048576.0, chunks, rec.duration_us / 3600e6, rec.nindex,
+           rec.rebuilt ? " (rebuilt)" : "", opened * 1e3,
+           seek_seconds / seeks * 1e6, seeks, found, decode_seconds,
+           bytes / 1048576.0 / decode_seconds);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 2)
+        return play(argv[1]);
+    if (argc == 4 && !strcmp(argv[1], "convert"))
+        return convert(argv[2], argv[3]);
+    if (argc == 3 && !strcmp(argv[1], "bench"))
+        return bench(argv[2]);
+    fprintf(stderr,
+            "usage: %s REC\n"
+            "       %s convert RAW REC\n"
+            "       %s bench REC\n",
+            argv[0], argv[0], argv[0]);
+    return EXIT_FAILURE;
+}
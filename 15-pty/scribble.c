@@ -1,18 +1,25 @@
 #define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <spawn.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include "lz.h"
+#include "record.h"
+
 #define die(msg)                                                               \
     do                                                                         \
     {                                                                          \
@@ -100,8 +107,316 @@ void configure_terminal()
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
 }
 
-// FIXME: Create a thread handler body that copies data from src_fd to two
-//        destination file descriptors.
+////////////////////////////////////////////////////////////////
+// Copying
+//
+// Two threads copy data around: one from our stdin to the pty (and to
+// IN), and one from the pty to our stdout (and to OUT). A plain
+// read(2)/write(2) loop copies every byte from the kernel into our
+// buffer and back into the kernel, twice.
+//
+// With COPY=splice, we splice(2) the source into a pipe, which only
+// moves page references around. tee(2) duplicates the pipe's content into a
+// second pipe, again without copying. Then, one pipe is spliced to
+// the terminal and the other to the recording. The data never passes
+// through user space.
+//
+// Not every file supports splicing. If splicing from the source fails
+// right away, we fall back to read/write. If a destination does not
+// take spliced data, we drain that pipe into it with read/write.
+//
+// However, a pty hands out at most 4 KiB per read, and the line
+// discipline, not the copying, limits the throughput. Copying 4 KiB is
+// cheap, and splice/tee needs four system calls per batch instead of
+// three. Thus, splicing does not pay off here, and read/write remains
+// the default (see make bench).
+//
+// With FORMAT=rec, OUT and IN are timed recordings (see record.h),
+// which ./replay plays back. Every chunk that we read becomes a chunk
+// of the recording, stamped with the time at which it arrived.
+
+#define PIPE_SIZE (1 << 20)
+#define COPY_BUF (64 * 1024)
+
+struct copy
+{
+    pthread_t thread;
+    const char *name;
+    int src, dst1, dst2;
+
+    struct recorder *rec; // FORMAT=rec: dst2 is a recording
+
+    bool spliced;       // Data went through pipes
+    bool dst_rw[2];     // A destination did not take spliced data
+    uint64_t bytes;     // Bytes copied from src
+    char buf[COPY_BUF]; // For read/write
+};
+
+static bool use_splice; // COPY=splice
+
+// The input thread may still record when the main thread closes the
+// recordings. Thus, both take this lock for every chunk.
+static pthread_mutex_t rec_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Move len bytes out of the pipe rd into dst
+static bool drain_pipe(struct copy *c, int rd, int dst, size_t len,
+                       bool *dst_rw)
+{
+    while (len > 0)
+    {
+        ssize_t n = -1;
+        if (!*dst_rw)
+        {
+            n = splice(rd, NULL, dst, NULL, len, SPLICE_F_MOVE);
+            if (n < 0 && errno == EINVAL)
+                *dst_rw = true;
+        }
+        if (*dst_rw)
+        {
+            n = read(rd, c->buf, len < COPY_BUF ? len : COPY_BUF);
+            if (n > 0 && !write_all(dst, c->buf, n))
+                return false;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        len -= n;
+    }
+    return true;
+}
+
+// Write a chunk to dst2, or record it
+static bool record(struct copy *c, const char *buf, size_t len)
+{
+    if (!c->rec)
+        return write_all(c->dst2, buf, len);
+    pthread_mutex_lock(&rec_lock);
+    bool ok = c->rec->fd < 0 || rec_write(c->rec, buf, len);
+    pthread_mutex_unlock(&rec_lock);
+    return ok;
+}
+
+// Splice a chunk of len bytes from the pipe rd to dst2, or record it
+static bool record_pipe(struct copy *c, int rd, size_t len, uint64_t now_us)
+{
+    if (!c->rec)
+        return drain_pipe(c, rd, c->dst2, len, &c->dst_rw[1]);
+    pthread_mutex_lock(&rec_lock);
+    bool ok = true;
+    if (c->rec->fd >= 0)
+    {
+        uint8_t hdr[2 * REC_VARINT_MAX];
+        size_t n = rec_chunk(c->rec, now_us, len, hdr);
+        ok = write_all(c->dst2, (char *)hdr, n) &&
+             drain_pipe(c, rd, c->dst2, len, &c->dst_rw[1]);
+    }
+    pthread_mutex_unlock(&rec_lock);
+    return ok;
+}
+
+static bool copy_splice(struct copy *c)
+{
+    int p[2], q[2];
+    if (pipe2(p, O_CLOEXEC) < 0 || pipe2(q, O_CLOEXEC) < 0)
+        die("pipe2");
+    // Larger pipes move more per system call. Without privileges, the
+    // size is capped by /proc/sys/fs/pipe-max-size.
+    fcntl(p[1], F_SETPIPE_SZ, PIPE_SIZE);
+    fcntl(q[1], F_SETPIPE_SZ, PIPE_SIZE);
+    long size = fcntl(p[1], F_GETPIPE_SZ);
+    long qsize = fcntl(q[1], F_GETPIPE_SZ);
+    if (qsize < size)
+        size = qsize;
+
+    bool done = false;
+    while (!done)
+    {
+        // A pty hands out at most 4 KiB (the line discipline's buffer)
+        // per read. Thus, we collect chunks in the pipe as long as the
+        // source has more data ready, and only then pay for tee and
+        // the two splices to the destinations.
+        size_t n = 0;
+        uint64_t arrived = 0;
+        while (n + 4096 <= size)
+        {
+            ssize_t len = splice(c->src, NULL, p[1], NULL, size - n,
+                                 SPLICE_F_MOVE);
+            if (len < 0 && errno == EINTR)
+                continue;
+            if (len < 0 && errno == EINVAL && !c->spliced)
+                goto out; // The source cannot splice
+            if (len <= 0)
+            {
+                done = true; // EOF, or EIO when the child closed the pty
+                break;
+            }
+            c->spliced = true;
+            if (n == 0)
+                arrived = rec_now_us();
+            n += len;
+            struct pollfd pfd = {c->src, POLLIN, 0};
+            if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLIN))
+                break;
+        }
+        if (n == 0)
+            break;
+
+        // Both pipes are empty at this point, so tee takes everything
+        ssize_t t = tee(p[0], q[1], n, 0);
+        if (t != n)
+            die("tee");
+        if (!drain_pipe(c, q[0], c->dst1, n, &c->dst_rw[0]) ||
+            !record_pipe(c, p[0], n, arrived))
+            break;
+        c->bytes += n;
+    }
+out:
+    close(p[0]);
+    close(p[1]);
+    close(q[0]);
+    close(q[1]);
+    return c->spliced;
+}
+
+////////////////////////////////////////////////////////////////
+// Compression (COMPRESS=1)
+//
+// With COMPRESS=1, the output thread writes OUT into a pipe instead of
+// the file. The compressor thread reads from the pipe, compresses
+// blocks of 64 KiB (see lz.h), and writes them to OUT. The pipe is the
+// bounded queue between both threads: The output thread, which also
+// echoes to the terminal, only waits if the pipe is full. So that the
+// compressor is never the reason, it stores blocks uncompressed while
+// the pipe is more than half full, which is as fast as write(2). If no
+// output comes for LZ_FLUSH_MS, it writes the block that it has, so an
+// idle session is on disk. ./unlz decompresses OUT.
+
+#define LZ_FLUSH_MS 1000
+
+struct compressor
+{
+    pthread_t thread;
+    int pipe_rd, pipe_wr, out_fd;
+    long pipe_size;
+
+    // Statistics
+    uint64_t raw, written, blocks, stored_blocks;
+    double seconds; // Spent in lz_compress()
+};
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *compress_thread(void *arg)
+{
+    struct compressor *z = arg;
+    static uint8_t block[LZ_BLOCK], out[LZ_BOUND(LZ_BLOCK)];
+    if (!write_all(z->out_fd, LZ_MAGIC, 8))
+        die("write: OUT");
+    z->written = 8;
+
+    bool eof = false;
+    while (!eof)
+    {
+        // Fill a block. Once it holds something, we wait for more only
+        // up to LZ_FLUSH_MS.
+        size_t fill = 0;
+        while (fill < LZ_BLOCK && !eof)
+        {
+            struct pollfd pfd = {z->pipe_rd, POLLIN, 0};
+            if (fill > 0 && poll(&pfd, 1, LZ_FLUSH_MS) == 0)
+                break;
+            ssize_t n = read(z->pipe_rd, block + fill, LZ_BLOCK - fill);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                eof = true;
+            else
+                fill += n;
+        }
+        if (fill == 0)
+            break;
+
+        int queued = 0;
+        ioctl(z->pipe_rd, FIONREAD, &queued);
+        size_t len = fill;
+        if (queued <= z->pipe_size / 2)
+        {
+            double start = now_seconds();
+            len = lz_compress(block, fill, out);
+            z->seconds += now_seconds() - start;
+        }
+        struct lz_block hdr = {fill, len};
+        struct iovec iov[2] = {{&hdr, sizeof(hdr)}, {out, len}};
+        if (len >= fill)
+        {
+            // Lagging behind, or the block did not get smaller
+            hdr.stored_len = fill | LZ_STORED;
+            iov[1] = (struct iovec){block, fill};
+            len = fill;
+            z->stored_blocks++;
+        }
+        if (writev(z->out_fd, iov, 2) != (ssize_t)(sizeof(hdr) + len))
+            die("write: OUT");
+        z->raw += fill;
+        z->written += sizeof(hdr) + len;
+        z->blocks++;
+    }
+    return NULL;
+}
+
+static void copy_rw(struct copy *c)
+{
+    while (true)
+    {
+        ssize_t n = read(c->src, c->buf, COPY_BUF);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        if (!write_all(c->dst1, c->buf, n) || !record(c, c->buf, n))
+            break;
+        c->bytes += n;
+    }
+}
+
+// Thread body: copy from src to dst1 and dst2 until src ends
+static void *copy_thread(void *arg)
+{
+    struct copy *c = arg;
+    if (!use_splice || !copy_splice(c))
+        copy_rw(c);
+    return NULL;
+}
+
+static const char *copy_mode(const struct copy *c)
+{
+    if (!c->spliced)
+        return "read/write";
+    if (c->dst_rw[0] || c->dst_rw[1])
+        return "splice/tee, partly read/write";
+    return "splice/tee";
+}
 
 int main(int argc, char *argv[])
 {
@@ -113,17 +428,125 @@ int main(int argc, char *argv[])
     char *OUT = argv[1];
     char *IN = argv[2];
     char **CMD = &argv[3];
+    char *COPY = getenv("COPY");
+    use_splice = COPY && strcmp(COPY, "splice") == 0;
+    bool stats = getenv("STATS") && atoi(getenv("STATS"));
+    char *FORMAT = getenv("FORMAT");
+    bool timed = FORMAT && strcmp(FORMAT, "rec") == 0;
+    bool compress = getenv("COMPRESS") && atoi(getenv("COMPRESS"));
+
+    // Open OUT and IN file
+    int out_fd = open(OUT, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out_fd < 0)
+        die("open: OUT");
+    int in_fd = open(IN, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (in_fd < 0)
+        die("open: IN");
+
+    // With COMPRESS=1, we put the compressor between us and OUT
+    static struct compressor z;
+    int out_sink = out_fd;
+    if (compress)
+    {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) < 0)
+            die("pipe2");
+        fcntl(fds[1], F_SETPIPE_SZ, PIPE_SIZE);
+        z = (struct compressor){.pipe_rd = fds[0], .pipe_wr = fds[1],
+                                .out_fd = out_fd,
+                                .pipe_size = fcntl(fds[1], F_GETPIPE_SZ)};
+        if (pthread_create(&z.thread, NULL, compress_thread, &z) != 0)
+            die("pthread_create");
+        out_sink = z.pipe_wr;
+    }
+
+    static struct recorder out_rec, in_rec;
+    if (timed && (!rec_open(&out_rec, out_sink) || !rec_open(&in_rec, in_fd)))
+        die("write: recording");
+
+    // Create a new primary PTY device and unlock its secondary
+    int primary_fd = open("/dev/ptmx", O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (primary_fd < 0)
+        die("open: /dev/ptmx");
+    int unlock = 0;
+    if (ioctl(primary_fd, TIOCSPTLCK, &unlock) < 0)
+        die("ioctl: TIOCSPTLCK");
+
+    // Get the PTN and open the child pty end
+    unsigned int pts;
+    if (ioctl(primary_fd, TIOCGPTN, &pts) < 0)
+        die("ioctl: TIOCGPTN");
+    char path[64];
+    snprintf(path, sizeof(path), "/dev/pts/%u", pts);
+    int secondary_fd = open(path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (secondary_fd < 0)
+        die("open: /dev/pts");
+
+    // The pty gets the size of our terminal
+    struct winsize ws;
+    if (ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) == 0)
+        ioctl(secondary_fd, TIOCSWINSZ, &ws);
+    if (isatty(STDIN_FILENO))
+        configure_terminal();
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    (void)IN;
-    (void)OUT;
-    (void)CMD;
-    (void)exec_in_pty;
-    // FIXME: Open OUT and IN file
-    // FIXME: Create a new primary PTY device (see pty(7))
-    // FIXME: Get the PTN with ioctl(fd, TIOCGPTN, &pts)
-    // FIXME: Open the child pty end (/dev/pts/{PTN})
-
-    // FIXME: Spawn CMD into secondary_fd pty
-    // FIXME: Create two threads to copy data around
-    // FIXME: Use the main thread to waitpid(2) for the child to exit.
+    // Spawn CMD into the secondary pty. Afterwards, we close our
+    // descriptor of it: Once the child (and all its children) have
+    // closed theirs, reading the primary fails with EIO.
+    pid_t pid = exec_in_pty(CMD, secondary_fd);
+    close(secondary_fd);
+
+    // Create two threads to copy data around
+    static struct copy input, output;
+    input = (struct copy){.name = "input", .src = STDIN_FILENO,
+                          .dst1 = primary_fd, .dst2 = in_fd,
+                          .rec = timed ? &in_rec : NULL};
+    output = (struct copy){.name = "output", .src = primary_fd,
+                           .dst1 = STDOUT_FILENO, .dst2 = out_sink,
+                           .rec = timed ? &out_rec : NULL};
+    if (pthread_create(&input.thread, NULL, copy_thread, &input) != 0 ||
+        pthread_create(&output.thread, NULL, copy_thread, &output) != 0)
+        die("pthread_create");
+
+    // Use the main thread to wait for the child to exit. The output
+    // thread ends after it has copied the last output of the child.
+    // The input thread may still wait for our stdin; exit() ends it.
+    int status;
+    if (waitpid(pid, &status, 0) < 0)
+        die("waitpid");
+    pthread_join(output.thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (timed)
+    {
+        pthread_mutex_lock(&rec_lock);
+        if (!rec_close(&out_rec) || !rec_close(&in_rec))
+            perror("write: recording");
+        out_rec.fd = in_rec.fd = -1;
+        pthread_mutex_unlock(&rec_lock);
+    }
+    if (compress)
+    {
+        close(z.pipe_wr);
+        pthread_join(z.thread, NULL);
+    }
+
+    if (stats)
+    {
+        double seconds =
+            end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, "scribble: %s: %.1f MiB in %.3f s: %.0f MiB/s (%s)\n",
+                output.name, output.bytes / 1048576.0, seconds,
+                output.bytes / 1048576.0 / seconds, copy_mode(&output));
+        if (compress)
+            fprintf(stderr,
+                    "scribble: compress: %.1f MiB -> %.1f MiB (%.2fx), %lu "
+                    "blocks (%lu stored), %.0f MiB/s\n",
+                    z.raw / 1048576.0, z.written / 1048576.0,
+                    z.written ? (double)z.raw / z.written : 0.0, z.blocks,
+                    z.stored_blocks,
+                    z.seconds > 0 ? z.raw / 1048576.0 / z.seconds : 0.0);
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
 }
@@ -0,0 +1,174 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define die(msg)                                                               \
+    do                                                                         \
+    {                                                                          \
+        perror(msg);                                                           \
+        exit(EXIT_FAILURE);                                                    \
+    } while (0)
+
+// A typist that measures the keystroke-to-echo latency of a terminal
+// program:
+//
+//   ./typist ./scribble OUT IN cat
+//
+// The typist is the terminal of CMD: It sends KEYS (default 200)
+// keystrokes, one every INTERVAL ms (default 10), and waits for each
+// to come back as echo. In between, it reads (and drops) all other
+// output. At the end, it types a newline and ^D, which ends cat, and
+// prints the percentiles of the latency. The key is a 'K', so CMD may
+// write output of its own as long as it does not contain one (e.g.,
+// `sh -c 'yes | head -c 100M & exec cat'`).
+
+#define KEY 'K'
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int env_int(const char *name, int def)
+{
+    char *value = getenv(name);
+    return value ? atoi(value) : def;
+}
+
+// Read output until deadline (now_us()). If key is set, return as soon
+// as it comes. Returns 1 if we saw the key, 0 at the deadline, and -1
+// at the end of the output.
+static int drain(int fd, uint64_t deadline, int key)
+{
+    static char buf[1 << 16];
+    for (;;)
+    {
+        uint64_t now = now_us();
+        if (now >= deadline)
+            return 0;
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int ret = poll(&pfd, 1, (deadline - now + 999) / 1000);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            die("poll");
+        if (ret == 0)
+            continue;
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1; // EIO: CMD and all its children are gone
+        if (key && memchr(buf, key, n))
+            return 1;
+    }
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s CMD...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int keys = env_int("KEYS", 200);
+    int interval_ms = env_int("INTERVAL", 10);
+
+    int primary_fd = open("/dev/ptmx", O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (primary_fd < 0)
+        die("open: /dev/ptmx");
+    int unlock = 0;
+    if (ioctl(primary_fd, TIOCSPTLCK, &unlock) < 0)
+        die("ioctl: TIOCSPTLCK");
+    unsigned int pts;
+    if (ioctl(primary_fd, TIOCGPTN, &pts) < 0)
+        die("ioctl: TIOCGPTN");
+    char path[64];
+    snprintf(path, sizeof(path), "/dev/pts/%u", pts);
+    int secondary_fd = open(path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (secondary_fd < 0)
+        die("open: /dev/pts");
+
+    // Our pty must not echo by itself; only CMD does
+    struct termios tios;
+    if (tcgetattr(secondary_fd, &tios) < 0)
+        die("tcgetattr");
+    cfmakeraw(&tios);
+    if (tcsetattr(secondary_fd, TCSANOW, &tios) < 0)
+        die("tcsetattr");
+
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, secondary_fd, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&fa, secondary_fd, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&fa, secondary_fd, STDERR_FILENO);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID);
+    extern char **environ;
+    pid_t pid;
+    if ((errno = posix_spawnp(&pid, argv[1], &fa, &attr, &argv[1], environ)))
+        die("posix_spawnp");
+    close(secondary_fd);
+
+    // Give CMD time to start up
+    drain(primary_fd, now_us() + 300000, 0);
+
+    uint64_t *latency = calloc(keys, sizeof(*latency));
+    if (!latency)
+        die("calloc");
+    int echoed = 0;
+    for (int i = 0; i < keys; i++)
+    {
+        char key = KEY;
+        uint64_t start = now_us();
+        if (write(primary_fd, &key, 1) != 1)
+            die("write");
+        // A key that takes longer than a second is lost
+        int ret = drain(primary_fd, start + 1000000, KEY);
+        if (ret < 0)
+            break;
+        if (ret > 0)
+            latency[echoed++] = now_us() - start;
+        drain(primary_fd, start + interval_ms * 1000, 0);
+    }
+
+    // End the line and cat, and read the rest of the output
+    if (write(primary_fd, "\n\004", 2) != 2)
+        die("write");
+    while (drain(primary_fd, UINT64_MAX, 0) >= 0)
+        ;
+    int status;
+    waitpid(pid, &status, 0);
+
+    if (echoed == 0)
+    {
+        fprintf(stderr, "typist: no echo\n");
+        return EXIT_FAILURE;
+    }
+    qsort(latency, echoed, sizeof(*latency), compare_u64);
+    printf("typist: %d/%d keys echoed, latency p50 %lu us, p99 %lu us, "
+           "max %lu us\n",
+           echoed, keys, latency[echoed / 2], latency[echoed * 99 / 100],
+           latency[echoed - 1]);
+    return 0;
+}
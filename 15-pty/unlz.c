@@ -0,0 +1,98 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lz.h"
+
+#define die(msg)                                                               \
+    do                                                                         \
+    {                                                                          \
+        perror(msg);                                                           \
+        exit(EXIT_FAILURE);                                                    \
+    } while (0)
+
+// Decompress an OUT file of scribble (COMPRESS=1) to stdout:
+//
+//   ./unlz OUT > OUT.raw
+//
+// A block that the compressor did not get to finish (e.g., because
+// scribble was killed) ends the output.
+
+static void write_all(const uint8_t *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            die("write");
+        buf += n;
+        len -= n;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s OUT\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+        die("open");
+    size_t size = st.st_size;
+    if (size < 8)
+    {
+        fprintf(stderr, "%s: not compressed\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    const uint8_t *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        die("mmap");
+    if (memcmp(map, LZ_MAGIC, 8) != 0)
+    {
+        fprintf(stderr, "%s: not compressed\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    static uint8_t block[LZ_BLOCK];
+    size_t off = 8;
+    while (off + sizeof(struct lz_block) <= size)
+    {
+        struct lz_block hdr;
+        memcpy(&hdr, map + off, sizeof(hdr));
+        off += sizeof(hdr);
+        size_t len = hdr.stored_len & ~LZ_STORED;
+        if (hdr.raw_len > LZ_BLOCK || len > size - off)
+        {
+            fprintf(stderr, "%s: truncated block\n", argv[1]);
+            return EXIT_FAILURE;
+        }
+        if (hdr.stored_len & LZ_STORED)
+        {
+            if (len != hdr.raw_len)
+                break;
+            write_all(map + off, len);
+        }
+        else
+        {
+            long n = lz_decompress(map + off, len, block, hdr.raw_len);
+            if (n != hdr.raw_len)
+            {
+                fprintf(stderr, "%s: broken block\n", argv[1]);
+                return EXIT_FAILURE;
+            }
+            write_all(block, n);
+        }
+        off += len;
+    }
+    return 0;
+}
@@ -0,0 +1,368 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <libgen.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define die(msg)                                                               \
+    do                                                                         \
+    {                                                                          \
+        perror(msg);                                                           \
+        exit(EXIT_FAILURE);                                                    \
+    } while (0)
+
+#include "uring.h"
+
+// A cp-like copy tool on top of uring.h:
+//
+//   ./copy SRC DST
+//   ./copy SRC... DIR
+//
+// We copy up to FILES (default 32) files at once. Each file is a
+// statx(), after which we know its size and mode, and then a chain of
+// linked operations on direct descriptors:
+//
+//   small files (<= BS):  open SRC -> open DST -> read -> write
+//                         -> close SRC -> close DST
+//   larger files:         open SRC -> open DST, then blocks of BS
+//                         bytes (default 128 KiB), each a linked
+//                         read -> write, and at the end the closes.
+//
+// All blocks (QD/2, default QD 64) come from one pool, so at most QD
+// reads and writes are in flight. As the direct descriptors never
+// appear in our fd table, a small file costs us no system call of its
+// own; we only enter the kernel to submit and to wait.
+
+static unsigned block_size, queue_depth, nfiles;
+
+struct block
+{
+    struct ring_op read, write;
+    struct file *f;
+    char *buf;
+    unsigned len;
+    struct block *next; // In the free list
+};
+
+static struct block *free_blocks;
+
+struct file
+{
+    struct ring_op stat, open_src, open_dst, read, write, close_src,
+        close_dst;
+    const char *src;
+    char dst[PATH_MAX];
+    struct statx stx;
+    int src_slot, dst_slot; // Direct descriptors
+    char *buf;              // For small files
+
+    uint64_t next_off;  // The next block to read
+    unsigned in_flight; // Blocks in flight
+    bool pumping;       // Opened, and waiting for blocks
+    int err;            // The first error (-errno)
+};
+
+static struct file *files;
+
+// The work: pairs of source and destination
+static char **sources;
+static unsigned nsources, next_source;
+static const char *dst_dir, *dst_file;
+
+static uint64_t copied_files, copied_bytes;
+static int status = EXIT_SUCCESS;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned env_unsigned(const char *name, unsigned def)
+{
+    char *value = getenv(name);
+    return value ? strtoul(value, NULL, 0) : def;
+}
+
+// Make room for a chain of n SQEs, as ring_queue() will not submit in
+// the middle of a chain
+static void room(struct ring *R, unsigned n)
+{
+    if (ring_space(R) < n && ring_submit(R, 0) < 0)
+        die("io_uring_enter");
+}
+
+static void queue(bool ok)
+{
+    if (!ok)
+        die("ring_queue");
+}
+
+static void start_file(struct ring *R, struct file *f);
+
+static void fail(struct file *f, int res)
+{
+    // Canceled operations follow a failed one; we report only that
+    if (res < 0 && res != -ECANCELED && !f->err)
+        f->err = res;
+}
+
+// The last operation of a file: report it and start the next one
+static void finish_file(struct ring *R, struct file *f)
+{
+    if (f->err)
+    {
+        fprintf(stderr, "copy: %s: %s\n", f->src, strerror(-f->err));
+        status = EXIT_FAILURE;
+    }
+    else
+    {
+        copied_files++;
+        copied_bytes += f->stx.stx_size;
+    }
+    start_file(R, f);
+}
+
+static void close_done(struct ring *R, struct ring_op *op, int res)
+{
+    struct file *f = op->data;
+    fail(f, res);
+    if (op == &f->close_dst)
+        finish_file(R, f);
+}
+
+static void queue_closes(struct ring *R, struct file *f)
+{
+    room(R, 2);
+    queue(ring_close(R, &f->close_src, 0, f->src_slot, IOSQE_IO_LINK));
+    queue(ring_close(R, &f->close_dst, 0, f->dst_slot, 0));
+}
+
+////////////////////////////////////////////////////////////////
+// Larger files: blocks
+
+// Give free blocks to the file f
+static void pump(struct ring *R, struct file *f)
+{
+    while (f->pumping && f->next_off < f->stx.stx_size && free_blocks)
+    {
+        struct block *b = free_blocks;
+        free_blocks = b->next;
+        uint64_t left = f->stx.stx_size - f->next_off;
+        b->f = f;
+        b->len = left < block_size ? left : block_size;
+        room(R, 2);
+        queue(ring_read(R, &b->read, f->src_slot, b->buf, b->len, f->next_off,
+                        IOSQE_IO_LINK | IOSQE_FIXED_FILE));
+        queue(ring_write(R, &b->write, f->dst_slot, b->buf, b->len,
+                         f->next_off, IOSQE_FIXED_FILE));
+        f->next_off += b->len;
+        f->in_flight++;
+    }
+}
+
+static void block_read_done(struct ring *R, struct ring_op *op, int res)
+{
+    struct block *b = op->data;
+    fail(b->f, res);
+    if (res >= 0 && (unsigned)res != b->len)
+        fail(b->f, -EIO); // The file shrank
+}
+
+static void block_write_done(struct ring *R, struct ring_op *op, int res)
+{
+    struct block *b = op->data;
+    struct file *f = b->f;
+    fail(f, res);
+    b->next = free_blocks;
+    free_blocks = b;
+    f->in_flight--;
+    if (f->err)
+        f->next_off = f->stx.stx_size; // No more blocks
+    if (f->next_off == f->stx.stx_size && f->in_flight == 0)
+    {
+        f->pumping = false;
+        queue_closes(R, f);
+    }
+
+    // The file that freed the block comes first, then the others
+    pump(R, f);
+    for (unsigned i = 0; i < nfiles && free_blocks; i++)
+        pump(R, &files[i]);
+}
+
+////////////////////////////////////////////////////////////////
+// Files
+
+static void open_done(struct ring *R, struct ring_op *op, int res)
+{
+    struct file *f = op->data;
+    fail(f, res);
+    if (op != &f->open_dst || f->stx.stx_size <= block_size)
+        return;
+    // The chain of a larger file ends here
+    if (f->err)
+        finish_file(R, f);
+    else
+    {
+        f->pumping = true;
+        pump(R, f);
+    }
+}
+
+static void small_done(struct ring *R, struct ring_op *op, int res)
+{
+    struct file *f = op->data;
+    fail(f, res);
+    if (res >= 0 && res != (int)f->stx.stx_size)
+        fail(f, -EIO);
+}
+
+static void stat_done(struct ring *R, struct ring_op *op, int res)
+{
+    struct file *f = op->data;
+    fail(f, res);
+    if (!f->err && !S_ISREG(f->stx.stx_mode))
+        f->err = S_ISDIR(f->stx.stx_mode) ? -EISDIR : -EINVAL;
+    if (f->err)
+    {
+        finish_file(R, f);
+        return;
+    }
+
+    uint64_t size = f->stx.stx_size;
+    bool small = size <= block_size;
+    room(R, 6);
+    queue(ring_openat(R, &f->open_src, AT_FDCWD, f->src, O_RDONLY, 0,
+                      f->src_slot, IOSQE_IO_LINK));
+    queue(ring_openat(R, &f->open_dst, AT_FDCWD, f->dst,
+                      O_WRONLY | O_CREAT | O_TRUNC, f->stx.stx_mode & 07777,
+                      f->dst_slot, small ? IOSQE_IO_LINK : 0));
+    if (!small)
+        return;
+    if (size > 0)
+    {
+        queue(ring_read(R, &f->read, f->src_slot, f->buf, size, 0,
+                        IOSQE_IO_LINK | IOSQE_FIXED_FILE));
+        queue(ring_write(R, &f->write, f->dst_slot, f->buf, size, 0,
+                         IOSQE_IO_LINK | IOSQE_FIXED_FILE));
+    }
+    queue_closes(R, f);
+}
+
+// Start the next copy with the file slot f
+static void start_file(struct ring *R, struct file *f)
+{
+    if (next_source == nsources)
+        return;
+    f->src = sources[next_source++];
+    if (dst_dir)
+    {
+        char tmp[PATH_MAX];
+        snprintf(tmp, sizeof(tmp), "%s", f->src);
+        snprintf(f->dst, sizeof(f->dst), "%s/%s", dst_dir, basename(tmp));
+    }
+    else
+        snprintf(f->dst, sizeof(f->dst), "%s", dst_file);
+    f->next_off = 0;
+    f->in_flight = 0;
+    f->pumping = false;
+    f->err = 0;
+    queue(ring_statx(R, &f->stat, AT_FDCWD, f->src, 0,
+                     STATX_TYPE | STATX_MODE | STATX_SIZE, &f->stx, 0));
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "usage: %s SRC DST\n       %s SRC... DIR\n", argv[0],
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+    sources = &argv[1];
+    nsources = argc - 2;
+    const char *dst = argv[argc - 1];
+    struct stat st;
+    if (stat(dst, &st) == 0 && S_ISDIR(st.st_mode))
+        dst_dir = dst;
+    else if (nsources == 1)
+        dst_file = dst;
+    else
+    {
+        fprintf(stderr, "copy: %s: not a directory\n", dst);
+        return EXIT_FAILURE;
+    }
+
+    block_size = env_unsigned("BS", 128 * 1024);
+    queue_depth = env_unsigned("QD", 64);
+    nfiles = env_unsigned("FILES", 32);
+    if (block_size == 0 || queue_depth < 8 || nfiles == 0)
+    {
+        fprintf(stderr, "copy: BS > 0, QD >= 8, and FILES > 0\n");
+        return EXIT_FAILURE;
+    }
+
+    // Every file can have a chain of six operations, and every block
+    // two, in flight. We size the completion ring for all of them.
+    struct io_uring_params params = {.flags = IORING_SETUP_CQSIZE,
+                                     .cq_entries =
+                                         queue_depth + 6 * nfiles};
+    struct ring R;
+    if (!ring_init(&R, queue_depth, &params))
+        die("io_uring_setup");
+    if (!ring_register_files(&R, 2 * nfiles))
+        die("io_uring_register");
+
+    for (unsigned i = 0; i < queue_depth / 2; i++)
+    {
+        struct block *b = calloc(1, sizeof(*b));
+        if (!b || !(b->buf = aligned_alloc(4096, block_size)))
+            die("alloc");
+        b->read = (struct ring_op){.callback = block_read_done, .data = b};
+        b->write = (struct ring_op){.callback = block_write_done, .data = b};
+        b->next = free_blocks;
+        free_blocks = b;
+    }
+    files = calloc(nfiles, sizeof(*files));
+    if (!files)
+        die("calloc");
+
+    double start = now_seconds();
+    for (unsigned i = 0; i < nfiles; i++)
+    {
+        struct file *f = &files[i];
+        if (!(f->buf = aligned_alloc(4096, block_size)))
+            die("aligned_alloc");
+        f->src_slot = 2 * i;
+        f->dst_slot = 2 * i + 1;
+        f->stat = (struct ring_op){.callback = stat_done, .data = f};
+        f->open_src = (struct ring_op){.callback = open_done, .data = f};
+        f->open_dst = (struct ring_op){.callback = open_done, .data = f};
+        f->read = (struct ring_op){.callback = small_done, .data = f};
+        f->write = (struct ring_op){.callback = small_done, .data = f};
+        f->close_src = (struct ring_op){.callback = close_done, .data = f};
+        f->close_dst = (struct ring_op){.callback = close_done, .data = f};
+        start_file(&R, f);
+    }
+    if (!ring_run(&R))
+        die("io_uring_enter");
+    double seconds = now_seconds() - start;
+
+    fprintf(stderr,
+            "copy: %lu files, %.1f MiB in %.3f s: %.0f MiB/s, %lu files/s, "
+            "%lu io_uring_enter calls\n",
+            copied_files, copied_bytes / 1048576.0, seconds,
+            copied_bytes / 1048576.0 / seconds,
+            (unsigned long)(copied_files / seconds), R.enters);
+    return status;
+}
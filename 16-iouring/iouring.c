@@ -4,6 +4,11 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/io_uring.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -12,9 +17,11 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -25,6 +32,8 @@
         exit(EXIT_FAILURE);                                                    \
     } while (0)
 
+#include "uring.h"
+
 #define CANARY 0xdeadbeef
 
 ////////////////////////////////////////////////////////////////
@@ -50,9 +59,62 @@ struct buffer
 
 static_assert(sizeof(struct buffer) == 4096);
 
+// A workload (BS=n) reads or writes blocks of block_size bytes. The
+// buffers for it are buffer_size bytes large, which is at least one
+// struct buffer, as we keep the free list in there.
+static size_t block_size = sizeof(struct buffer);
+static size_t buffer_size = sizeof(struct buffer);
+
 // We have a stack of empty buffers. At process start, the
-// free-buffer stack is empty
-static struct buffer *free_buffers = NULL;
+// free-buffer stack is empty. Every worker thread (THREADS=n) has its
+// own stack.
+static __thread struct buffer *free_buffers = NULL;
+
+// The memory of all buffers of this thread, whichever kind they are
+static __thread size_t buffer_memory;
+
+// With BUFFERS=arena, we do not allocate buffers one by one, but carve
+// them from one arena. The arena is a single mapping, backed by huge
+// pages if possible, that we register with the uring
+// (IORING_REGISTER_BUFFERS). The kernel then pins its pages once, and
+// not for every O_DIRECT read, which we issue as IORING_OP_READ_FIXED.
+// We also register the file (IORING_REGISTER_FILES), which saves
+// taking a reference to it for every request.
+#define HUGE_PAGE (2 * 1024 * 1024)
+
+static bool use_arena; // BUFFERS=arena
+static __thread struct buffer *arena = NULL;
+static __thread size_t arena_buffers, arena_used;
+static __thread size_t arena_size;
+static __thread bool arena_hugetlb; // Backed by MAP_HUGETLB (or else by THP)
+
+// Map an arena for count buffers. We first try to get huge pages from
+// the hugetlb pool (vm.nr_hugepages). If the pool is empty, we fall
+// back to normal pages, which we ask to become transparent huge pages.
+void arena_init(size_t count)
+{
+    arena_size = (count * buffer_size + HUGE_PAGE - 1) &
+                 ~(size_t)(HUGE_PAGE - 1);
+    arena = mmap(NULL, arena_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1,
+                 0);
+    arena_hugetlb = arena != MAP_FAILED;
+    if (!arena_hugetlb)
+    {
+        // Huge-page alignment is required for THP, so we map one huge
+        // page more and round up
+        char *map = mmap(NULL, arena_size + HUGE_PAGE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED)
+            die("mmap: arena");
+        arena = (struct buffer *)(((uintptr_t)map + HUGE_PAGE - 1) &
+                                  ~(uintptr_t)(HUGE_PAGE - 1));
+        madvise(arena, arena_size, MADV_HUGEPAGE);
+        memset(arena, 0, arena_size); // Populate
+    }
+    arena_buffers = arena_size / buffer_size;
+    arena_used = 0;
+}
 
 // Allocate a buffer
 struct buffer *alloc_buffer()
@@ -64,8 +126,21 @@ struct buffer *alloc_buffer()
     // descriptor have to be aligned.
     if (free_buffers == NULL)
     {
-        if (posix_memalign((void **)&ret, 512, sizeof(struct buffer)) < 0)
+        // With an arena, we take the next unused buffer from it. As
+        // the arena has a buffer for every SQE, it never runs out.
+        if (arena)
+        {
+            if (arena_used == arena_buffers)
+            {
+                errno = ENOMEM;
+                die("alloc_buffer: arena");
+            }
+            return (struct buffer *)((char *)arena +
+                                     arena_used++ * buffer_size);
+        }
+        if (posix_memalign((void **)&ret, 512, buffer_size) < 0)
             die("posix_memalign");
+        buffer_memory += buffer_size;
         return ret;
     }
 
@@ -90,120 +165,663 @@ void free_buffer(struct buffer *b)
 }
 
 ////////////////////////////////////////////////////////////////
-// Helpers for using I/O urings
+// Provided Buffer Ring
+
+// With BUFFERS=pbuf, a read does not bring its own buffer. Instead, we
+// give PBUF buffers (default: SQ_SIZE) from the arena to the kernel
+// with a provided buffer ring (IORING_REGISTER_PBUF_RING). A read with
+// IOSQE_BUFFER_SELECT takes a buffer from the ring, and its CQE tells
+// us which one (IORING_CQE_F_BUFFER). Once we are done with the data,
+// we put the buffer back into the ring. If the ring is empty, the read
+// fails with -ENOBUFS, and we submit a new one. As this only burns CPU,
+// a worker keeps at most PBUF reads in flight.
+//
+// The kernel picks the buffer when it issues the read. For a socket,
+// it issues the read only once data has arrived. For an O_DIRECT read
+// of a file, however, the device writes into the buffer, so the kernel
+// has to pick it right away and the buffer stays taken until the read
+// completes, just like our own buffers.
+#define PBUF_GROUP 0
+
+static bool use_pbuf;       // BUFFERS=pbuf
+static unsigned pbuf_count; // PBUF, a power of two
+static __thread struct io_uring_buf_ring *pbuf_ring;
+static __thread unsigned pbuf_tail; // Includes unpublished buffers
+
+// Queue a buffer for the ring. It becomes visible to the kernel with
+// the next pbuf_publish().
+void pbuf_recycle(struct buffer *b)
+{
+    struct io_uring_buf *buf =
+        &pbuf_ring->bufs[pbuf_tail++ & (pbuf_count - 1)];
+    buf->addr = (uintptr_t)b->data;
+    buf->len = block_size;
+    buf->bid = ((char *)b - (char *)arena) / buffer_size;
+}
+
+// Like the submission ring, the kernel must see the buffers before the
+// new tail
+void pbuf_publish(void)
+{
+    store_release(&pbuf_ring->tail, (uint16_t)pbuf_tail);
+}
+
+struct buffer *pbuf_buffer(unsigned bid)
+{
+    return (struct buffer *)((char *)arena + bid * buffer_size);
+}
+
+// Map the buffer ring, register it, and fill it with pbuf_count
+// buffers from a new arena. The arena is at least one huge page, but
+// we only count the memory of the buffers that we give to the kernel.
+void pbuf_init(struct ring *R)
+{
+    arena_init(pbuf_count);
+    size_t size = pbuf_count * sizeof(struct io_uring_buf);
+    pbuf_ring = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (pbuf_ring == MAP_FAILED)
+        die("mmap: pbuf ring");
+    struct io_uring_buf_reg reg = {.ring_addr = (uintptr_t)pbuf_ring,
+                                   .ring_entries = pbuf_count,
+                                   .bgid = PBUF_GROUP};
+    if (sys_io_uring_register(R->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) <
+        0)
+        die("IORING_REGISTER_PBUF_RING");
+    for (unsigned bid = 0; bid < pbuf_count; bid++)
+        pbuf_recycle(pbuf_buffer(bid));
+    pbuf_publish();
+    buffer_memory += pbuf_count * buffer_size + size;
+}
+
+////////////////////////////////////////////////////////////////
+// Requests and Latency
 
-// We have our own system call wrappers for io_uring_setup(2) and
-// io_uring_enter(2) as those functions are also provided by the
-// liburing. To minimize confusion, we prefixed the helpers with `sys_'
-int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+// For every read in flight, we note when we submitted it. The
+// user_data of an SQE is the index of its request.
+struct request
 {
-    return (int)syscall(__NR_io_uring_setup, entries, p);
+    struct buffer *buffer;
+    uint64_t submitted; // now_ns()
+    bool write;
+};
+
+static __thread struct request *requests;
+static __thread unsigned *free_requests, nfree_requests;
+
+void requests_init(unsigned count)
+{
+    requests = calloc(count, sizeof(*requests));
+    free_requests = calloc(count, sizeof(*free_requests));
+    if (!requests || !free_requests)
+        die("calloc");
+    for (unsigned i = 0; i < count; i++)
+        free_requests[i] = count - 1 - i;
+    nfree_requests = count;
+}
+
+unsigned alloc_request(void)
+{
+    assert(nfree_requests > 0);
+    return free_requests[--nfree_requests];
 }
 
-int sys_io_uring_enter(int ring_fd, unsigned int to_submit,
-                       unsigned int min_complete, unsigned int flags)
+void free_request(unsigned id)
 {
-    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
-                        flags, NULL, 0);
+    free_requests[nfree_requests++] = id;
 }
 
-// Loads and stores of the head and tail pointers of an io_uring require
-// memory barriers to be fully synchronized with the kernel.
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// A histogram with log-linear buckets: The position of the highest
+// bit selects a power of two, which is split into 2^HIST_SUB_BITS
+// buckets. So a bucket is at most 1/16 of its values wide, and one
+// histogram covers all of uint64_t with 1024 counters.
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+struct histogram
+{
+    uint64_t count[HIST_BUCKETS];
+    uint64_t n;
+};
+
+unsigned hist_bucket(uint64_t v)
+{
+    if (v < (1 << HIST_SUB_BITS))
+        return v;
+    unsigned shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) +
+           ((v >> shift) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+// The smallest value that falls into bucket b
+uint64_t hist_value(unsigned b)
+{
+    if (b < (1 << HIST_SUB_BITS))
+        return b;
+    unsigned shift = (b >> HIST_SUB_BITS) - 1;
+    uint64_t sub = b & ((1 << HIST_SUB_BITS) - 1);
+    return ((1 << HIST_SUB_BITS) + sub) << shift;
+}
+
+// Counters that a worker thread increments and the main thread takes
+// (and resets) once per second
+#define count_add(p, v)                                                        \
+    atomic_fetch_add_explicit((_Atomic typeof(*(p)) *)(p), (v),                \
+                              memory_order_relaxed)
+#define count_take(p)                                                          \
+    atomic_exchange_explicit((_Atomic typeof(*(p)) *)(p), 0,                   \
+                             memory_order_relaxed)
+
+void hist_add(struct histogram *h, uint64_t v)
+{
+    count_add(&h->count[hist_bucket(v)], 1);
+    count_add(&h->n, 1);
+}
+
+// Move all values from src to dst
+void hist_take(struct histogram *dst, struct histogram *src)
+{
+    for (unsigned b = 0; b < HIST_BUCKETS; b++)
+        dst->count[b] += count_take(&src->count[b]);
+    dst->n += count_take(&src->n);
+}
+
+// The value below which the fraction p (e.g., 0.99) of all values lie
+uint64_t hist_percentile(const struct histogram *h, double p)
+{
+    uint64_t rank = p * h->n, seen = 0;
+    for (unsigned b = 0; b < HIST_BUCKETS; b++)
+    {
+        seen += h->count[b];
+        if (seen > rank)
+            return hist_value(b);
+    }
+    return 0;
+}
+
+// Print the histogram (in us) with one line per power of two, and the
+// usual percentiles
+void hist_print(const struct histogram *h)
+{
+    uint64_t max_count = 0, max = 0;
+    for (unsigned b = 0; b < HIST_BUCKETS; b += 1 << HIST_SUB_BITS)
+    {
+        uint64_t sum = 0;
+        for (unsigned i = b; i < b + (1 << HIST_SUB_BITS); i++)
+        {
+            sum += h->count[i];
+            if (h->count[i])
+                max = hist_value(i);
+        }
+        if (sum > max_count)
+            max_count = sum;
+    }
+    printf("latency histogram (%lu I/Os):\n", h->n);
+    for (unsigned b = 0; b < HIST_BUCKETS; b += 1 << HIST_SUB_BITS)
+    {
+        uint64_t sum = 0;
+        for (unsigned i = b; i < b + (1 << HIST_SUB_BITS); i++)
+            sum += h->count[i];
+        if (sum == 0)
+            continue;
+        char bar[41];
+        int len = 40 * sum / max_count;
+        memset(bar, '#', len);
+        bar[len] = 0;
+        printf("  %9.1f - %9.1f us: %9lu %5.1f%% %s\n", hist_value(b) / 1e3,
+               hist_value(b + (1 << HIST_SUB_BITS)) / 1e3, sum,
+               100.0 * sum / h->n, bar);
+    }
+    printf("  p50 %.0f, p90 %.0f, p99 %.0f, p99.9 %.0f, p99.99 %.0f, "
+           "max %.0f us\n",
+           hist_percentile(h, 0.5) / 1e3, hist_percentile(h, 0.9) / 1e3,
+           hist_percentile(h, 0.99) / 1e3, hist_percentile(h, 0.999) / 1e3,
+           hist_percentile(h, 0.9999) / 1e3, max / 1e3);
+}
+
+// The statistics of one worker thread, which the main thread collects
+// and prints every second
+struct stats
+{
+    uint64_t read_blocks; // Number of read blocks
+    uint64_t read_bytes;  // How many bytes where read
+    uint64_t write_blocks, write_bytes;
+    uint64_t enters;      // io_uring_enter(2) calls
+    uint64_t nobufs;      // Reads that found the buffer ring empty
+    uint64_t buffer_bytes; // buffer_memory of the worker
+    unsigned in_flight;
+    struct histogram latency;
+};
+
+static __thread struct stats *stats;
+
+////////////////////////////////////////////////////////////////
+// Random Reads
+
+// Submission strategies (SUBMIT=...). By default, we submit with
+// io_uring_enter(2), and the kernel completes the reads in the
+// interrupt (or in task work, which interrupts our thread).
+//
+//   sqpoll  A kernel thread (pinned to the CPU SQ_CPU, default: the
+//           last one) polls the submission ring, so we do not need a
+//           system call to submit. After SQ_IDLE ms (default 1000)
+//           without work, it sleeps and sets IORING_SQ_NEED_WAKEUP.
+//   coop    IORING_SETUP_COOP_TASKRUN: The kernel does not interrupt
+//           us to run the completion task work, but waits until we
+//           enter the kernel anyway. IORING_SQ_TASKRUN tells us that
+//           there is such work.
+//   defer   IORING_SETUP_DEFER_TASKRUN: The task work only runs when
+//           we wait for completions with IORING_ENTER_GETEVENTS.
+enum submit_mode
+{
+    SUBMIT_ENTER,
+    SUBMIT_SQPOLL,
+    SUBMIT_COOP,
+    SUBMIT_DEFER,
+};
+static enum submit_mode submit_mode = SUBMIT_ENTER;
+
+////////////////////////////////////////////////////////////////
+// Workloads
 //
-// For a very good and detailed discussion of load-acquire and
-// store-release, we strongly recommend the LWN article series on
-// lockless patterns: https://lwn.net/Articles/844224/
+// Like fio, we generate the offsets and the kind of each I/O:
 //
-// If you have not yet understood that memory is a distributed system
-// that has a happens-before relation, than read(!) that series.
-#define store_release(p, v)                                                    \
-    atomic_store_explicit((_Atomic typeof(*(p)) *)(p), (v),                    \
-                          memory_order_release)
-#define load_aquire(p)                                                         \
-    atomic_load_explicit((_Atomic typeof(*(p)) *)(p), memory_order_acquire)
+//   PATTERN=rand  Uniformly random blocks (the default)
+//   PATTERN=seq   One block after another. Every worker starts at its
+//                 own part of the file and wraps around at the end.
+//   PATTERN=zipf  Zipf-distributed blocks (ZIPF=theta, default 0.99):
+//                 few blocks get most of the I/O, like in a database
+//                 with a hot set. The ranks are hashed, so the hot
+//                 blocks lie all over the file.
+//   READ=p        p percent reads, the others are writes (default 100)
+//   BS=n          Block size, from 512 bytes to 1 MiB (default 4096)
 
-struct ring
+enum pattern
 {
-    // The file descriptor to the created uring.
-    int ring_fd;
+    PATTERN_RAND,
+    PATTERN_SEQ,
+    PATTERN_ZIPF,
+};
+static enum pattern pattern = PATTERN_RAND;
+static unsigned read_percent = 100;
 
-    // The params that we have received from the kernel
-    struct io_uring_params params;
+// xorshift64* (Vigna), with one state per thread. It is faster than
+// rand(3) and has 64 bits.
+static __thread uint64_t rng_state;
 
-    // We perform our own book keeping how many requests are currently
-    // in flight.
-    unsigned in_flight;
+uint64_t rng_next(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
 
-    // The Submission Ring (mapping 1)
-    unsigned *sring;      // An array of length params.sq_entries
-    unsigned *sring_tail; // Pointer to the tail index
-    unsigned sring_mask;  // Apply this mask to (*sring_tail) to get the next
-                          // free sring entry
-
-    // The SQE array (mapping 2)
-    //
-    // An SQE is like a system call that you prepare in this array and
-    // then push its index into the submission ring (please search for
-    // the term "indirection array" in io_uring(7)
-    struct io_uring_sqe *sqes;
-
-    // The Completion Queue (mapping 3)
-    unsigned *cring_head; // Pointer to the head index (written by us, read by
-                          // the kernel)
-    unsigned *cring_tail; // Pointer to the tail index (written by the kernel,
-                          // read by us)
-    unsigned cring_mask;  // Apply this mask the head index to get the next
-                          // available CQE
-    struct io_uring_cqe *cqes; // Array of CQEs
+// Uniform in [0, 1)
+double rng_double(void)
+{
+    return (rng_next() >> 11) * 0x1.0p-53;
+}
+
+// A Zipf generator after Gray et al., "Quickly Generating
+// Billion-Record Synthetic Databases" (SIGMOD '94), as in YCSB. It
+// needs zeta(n) once, which takes O(n), but then draws a rank in
+// O(1). It requires 0 < theta < 1.
+struct zipf
+{
+    uint64_t n;
+    double theta, alpha, zetan, eta, half_pow;
 };
+static struct zipf zipf;
 
-// Map io_uring into the user space. This includes:
-// - Create all three mappings (submission ring, SQE array, and completion ring)
-// - Derive all pointers in struct ring
-struct ring ring_map(int ring_fd, struct io_uring_params p)
-{
-    struct ring ring = {.ring_fd = ring_fd, .params = p, .in_flight = 0};
-    // HINT: Use PROT_READ, PROT_WRITE, MAP_SHARED, and MAP_POPULATE
-    // HINT: The three mappings use three magic mmap offsets:
-    // IORING_OFF_SQ_RING, IORING_OFF_SQES, IORING_OFF_CQ_RING HINT: Dereference
-    // the {sring,cring}_mask directly
-    return ring;
+double zeta(uint64_t n, double theta)
+{
+    double sum = 0;
+    for (uint64_t i = 1; i <= n; i++)
+        sum += 1 / pow(i, theta);
+    return sum;
 }
 
-// Submit up to count random-read SQEs into the given file with a
-// _single_ system call. The function returns the number of actually
-// submitted random reads.
-unsigned submit_random_read(struct ring *R, int fd, ssize_t fsize,
-                            unsigned count)
+void zipf_init(struct zipf *z, uint64_t n, double theta)
 {
-    // FIXME: Prepare up to count IORING_OP_READ operations
-    // HINT:  Set the sqe->user_data to the address of the used destination
-    // buffer
-    // FIXME: Issue a single io_ring_enter() command to submit those SQEs
-    return 0;
+    z->n = n;
+    z->theta = theta;
+    z->alpha = 1 / (1 - theta);
+    z->zetan = zeta(n, theta);
+    z->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta(2, theta) / z->zetan);
+    z->half_pow = 1 + pow(0.5, theta);
 }
 
-// Reap one CQE from the completion ring and copy the CQE to *cqe. If
-// no CQEs are available (*cring_head == *cring_tail), this function
-// returns 0.
-int reap_cqe(struct ring *R, struct io_uring_cqe *cqe)
+// A rank in [0, n), where rank 0 is the most frequent one
+uint64_t zipf_next(const struct zipf *z)
 {
-    // FIXME: Check that the cring contains an CQE, if not return 0
-    // FIXME: Extract the CQE into *cqe
-    // FIXME: Forward cring_head by 1 and return 1
-    return 0;
+    double u = rng_double(), uz = u * z->zetan;
+    if (uz < 1)
+        return 0;
+    if (uz < z->half_pow)
+        return 1;
+    uint64_t rank = z->n * pow(z->eta * u - z->eta + 1, z->alpha);
+    return rank < z->n ? rank : z->n - 1;
+}
+
+// The next block of a sequential worker
+static __thread uint64_t seq_block;
+
+// The block for the next I/O
+uint64_t next_block(uint64_t blocks)
+{
+    switch (pattern)
+    {
+    case PATTERN_SEQ:
+        if (seq_block >= blocks)
+            seq_block = 0;
+        return seq_block++;
+    case PATTERN_ZIPF:
+        // Hash the rank (Fibonacci hashing), so that the hot blocks
+        // are not all at the start of the file
+        return (zipf_next(&zipf) * 0x9E3779B97F4A7C15ULL) % blocks;
+    default:
+        return rng_next() % blocks;
+    }
+}
+
+// Submit up to count SQEs of the workload (reads at random offsets,
+// by default) into the given file with a _single_ system call (none
+// with SQPOLL, if the kernel thread is awake). The I/O i arrived at
+// arrival + i * interval (see RATE), and we measure its latency from
+// then on. The function returns the number of actually submitted I/Os.
+unsigned submit_random_read(struct ring *R, int fd, ssize_t fsize,
+                            unsigned count, uint64_t arrival,
+                            uint64_t interval)
+{
+    uint64_t blocks = fsize / block_size;
+    for (unsigned i = 0; i < count; i++)
+    {
+        // With BUFFERS=pbuf, the kernel picks the buffer
+        struct buffer *b = use_pbuf ? NULL : alloc_buffer();
+        unsigned id = alloc_request();
+        bool write = read_percent < 100 && rng_next() % 100 >= read_percent;
+        requests[id] = (struct request){.buffer = b,
+                                        .submitted = arrival + i * interval,
+                                        .write = write};
+        // We never have more than sq_entries reads in flight, so there
+        // is always room
+        struct io_uring_sqe *sqe = ring_get_sqe(R);
+        assert(sqe);
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->len = block_size;
+        sqe->off = next_block(blocks) * block_size;
+        sqe->user_data = id;
+        if (use_pbuf)
+        {
+            sqe->flags |= IOSQE_BUFFER_SELECT;
+            sqe->buf_group = PBUF_GROUP;
+        }
+        else
+            sqe->addr = (uintptr_t)b->data;
+        if (arena && !use_pbuf)
+        {
+            // The buffer lies within the registered arena (index 0),
+            // and the file is the registered file 0.
+            sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+            sqe->buf_index = 0;
+            sqe->fd = 0;
+            sqe->flags |= IOSQE_FIXED_FILE;
+        }
+    }
+    // With SQPOLL, ring_submit() only wakes the poller if necessary
+    if (ring_submit(R, 0) < 0)
+        die("io_uring_enter");
+    return count;
 }
 
 // This function uses reap_cqe() to extract a filled buffer from the
 // uring. If wait is true, we wait for an CQE with
 // io_uring_enter(min_completions=1, IORING_ENTER_GETEVENTS) if
-// necessary.
+// necessary. Reads that found the provided buffer ring empty
+// (BUFFERS=pbuf) did not happen; we drop them and reap on.
 struct buffer *receive_random_read(struct ring *R, bool wait)
 {
-    // FIXME: Step 1: optimistic reap
-    // FIXME: Step 2: io_uring_enter()
-    // FIXME: Step 3: reap again.
-    return NULL;
+    struct io_uring_cqe cqe;
+again:
+    if (!reap_cqe(R, &cqe))
+    {
+        // With COOP_TASKRUN, completions may wait for us in task work.
+        // We run it without waiting for more.
+        bool taskrun = submit_mode == SUBMIT_COOP &&
+                       (load_aquire(R->sring_flags) & IORING_SQ_TASKRUN);
+        if (!wait && !taskrun)
+            return NULL;
+        if (ring_enter(R, 0, wait ? 1 : 0, IORING_ENTER_GETEVENTS) < 0)
+            die("io_uring_enter");
+        if (!reap_cqe(R, &cqe))
+            return NULL;
+    }
+    if (cqe.res == -ENOBUFS && use_pbuf)
+    {
+        count_add(&stats->nobufs, 1);
+        free_request(cqe.user_data);
+        R->in_flight--;
+        wait = false;
+        goto again;
+    }
+    if (cqe.res < 0)
+    {
+        errno = -cqe.res;
+        die("read");
+    }
+    // We only read whole blocks from within the file
+    assert(cqe.res == block_size);
+    struct request *req = &requests[cqe.user_data];
+    if (cqe.flags & IORING_CQE_F_BUFFER)
+        req->buffer = pbuf_buffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+    hist_add(&stats->latency, now_ns() - req->submitted);
+    if (req->write)
+    {
+        count_add(&stats->write_blocks, 1);
+        count_add(&stats->write_bytes, block_size);
+    }
+    else
+    {
+        count_add(&stats->read_blocks, 1);
+        count_add(&stats->read_bytes, block_size);
+    }
+    free_request(cqe.user_data);
+    return req->buffer;
+}
+
+////////////////////////////////////////////////////////////////
+// Worker Threads
+
+// With THREADS=n, we run n workers, one per core, each with its own
+// ring, buffers, and requests. Only the rings share the pool of async
+// workers in the kernel (io-wq): Every ring but the first is created
+// with IORING_SETUP_ATTACH_WQ. With SQPOLL, they also share the
+// poller thread.
+struct worker
+{
+    pthread_t thread;
+    unsigned id;
+    struct ring R;
+    struct stats stats;
+};
+
+static int fd;            // The file
+static ssize_t fsize;     // ... and its size
+static unsigned sq_size;  // SQ_SIZE
+static unsigned batch;    // BATCH
+static unsigned nworkers; // THREADS
+static double rate;       // RATE: I/Os per second and worker (0: closed loop)
+static struct io_uring_params ring_params; // Flags for every ring
+static cpu_set_t allowed; // The CPUs that we may run on
+
+// The ring of worker 0, to which the others attach, and a semaphore
+// that a worker posts once its ring is ready
+static int first_ring_fd = -1;
+static sem_t ready;
+
+// Create and map the ring of the calling worker, with its requests and
+// its arena. We create it in the worker thread, as a ring with
+// SINGLE_ISSUER belongs to the thread that created it.
+struct ring worker_ring(void)
+{
+    struct io_uring_params params = ring_params;
+    if (first_ring_fd >= 0)
+    {
+        params.flags |= IORING_SETUP_ATTACH_WQ;
+        params.wq_fd = first_ring_fd;
+    }
+    struct ring R;
+    if (!ring_init(&R, sq_size, &params))
+        die("io_uring_setup");
+    int ring_fd = R.ring_fd;
+    requests_init(R.params.sq_entries);
+
+    if (use_pbuf)
+        pbuf_init(&R);
+    else if (use_arena)
+    {
+        // At most sq_entries reads are in flight
+        arena_init(R.params.sq_entries);
+        struct iovec iov = {arena, arena_size};
+        if (sys_io_uring_register(ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) <
+            0)
+            die("IORING_REGISTER_BUFFERS");
+        if (sys_io_uring_register(ring_fd, IORING_REGISTER_FILES, &fd, 1) < 0)
+            die("IORING_REGISTER_FILES");
+        buffer_memory += arena_size;
+    }
+    return R;
+}
+
+void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    stats = &w->stats;
+    rng_state = now_ns() * 0x9E3779B97F4A7C15ULL + w->id + 1;
+    seq_block = fsize / block_size * w->id / nworkers;
+
+    // We pin worker i to the i-th CPU that we are allowed to run on.
+    // If there are more workers than CPUs, we wrap around.
+    int nth = w->id % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE && nworkers > 1; cpu++)
+    {
+        if (CPU_ISSET(cpu, &allowed) && nth-- == 0)
+        {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(cpu, &cpus);
+            if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+                perror("sched_setaffinity");
+            break;
+        }
+    }
+
+    w->R = worker_ring();
+    struct ring *R = &w->R;
+    if (w->id == 0)
+    {
+        first_ring_fd = R->ring_fd;
+        if (use_pbuf)
+            printf("buffer ring: %u buffers (%zu KiB) in an ", pbuf_count,
+                   pbuf_count * buffer_size >> 10);
+        if (use_arena || use_pbuf)
+            printf("arena: %zu buffers, %zu MiB, %s\n", arena_buffers,
+                   arena_size >> 20,
+                   arena_hugetlb ? "hugetlb" : "transparent huge pages");
+    }
+    sem_post(&ready);
+
+    // In the open loop (RATE=n), I/Os arrive at a fixed rate, whether
+    // the earlier ones have completed or not. If the ring is full,
+    // they queue up, and their latency includes this wait. This avoids
+    // the coordinated omission of the closed loop, which only issues
+    // a new I/O when an old one has completed.
+    uint64_t interval = rate > 0 ? 1e9 / rate : 0;
+    uint64_t next_arrival = now_ns();
+
+    // With a provided buffer ring, every read in flight holds one of its
+    // buffers. Further reads would only fail with -ENOBUFS, so we keep
+    // no more reads in flight than the ring has buffers.
+    unsigned depth = R->params.sq_entries;
+    if (use_pbuf && pbuf_count < depth)
+        depth = pbuf_count;
+    unsigned limit = batch < depth ? batch : depth;
+    while (1)
+    {
+        unsigned count = depth - R->in_flight;
+        bool wait = true;
+        if (interval)
+        {
+            // Submit what has arrived until now. Then, we wait for a
+            // completion only until the next arrival.
+            uint64_t now = now_ns();
+            uint64_t due =
+                now >= next_arrival ? (now - next_arrival) / interval + 1 : 0;
+            if (count > due)
+                count = due;
+            if (count > 0)
+            {
+                R->in_flight += submit_random_read(R, fd, fsize, count,
+                                                   next_arrival, interval);
+                next_arrival += count * interval;
+            }
+            wait = R->in_flight == depth; // Full
+            uint64_t now2 = now_ns();
+            if (!wait && R->in_flight > 0 && next_arrival > now2)
+            {
+                // Wait for a completion until the next arrival
+                if (!ring_wait(R, next_arrival - now2))
+                    die("io_uring_enter");
+            }
+            else if (!wait && R->in_flight == 0)
+            {
+                struct timespec ts = {next_arrival / 1000000000,
+                                      next_arrival % 1000000000};
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+            }
+        }
+        // Keep the submission ring full, but refill it only once at
+        // least batch slots are free
+        else if (count >= limit)
+            R->in_flight +=
+                submit_random_read(R, fd, fsize, count, now_ns(), 0);
+
+        // Reap as many CQEs as possible, but wait only for the first
+        struct buffer *b;
+        while ((b = receive_random_read(R, wait)))
+        {
+            wait = false;
+            R->in_flight--;
+            if (use_pbuf)
+                pbuf_recycle(b);
+            else
+                free_buffer(b);
+        }
+        if (use_pbuf)
+            pbuf_publish();
+        count_add(&stats->enters, R->enters);
+        R->enters = 0;
+        atomic_store_explicit((_Atomic uint64_t *)&stats->buffer_bytes,
+                              buffer_memory, memory_order_relaxed);
+        atomic_store_explicit((_Atomic unsigned *)&stats->in_flight,
+                              R->in_flight, memory_order_relaxed);
+    }
+}
+
+static volatile sig_atomic_t stop;
+
+void on_sigint(int sig)
+{
+    stop = 1;
 }
 
 int main(int argc, char *argv[])
@@ -212,58 +830,226 @@ int main(int argc, char *argv[])
     if (argc < 3)
     {
         fprintf(stderr, "usage: %s SQ_SIZE FILE\n", argv[0]);
+        fprintf(stderr, "  env: BUFFERS=arena   registered hugepage buffers"
+                        " and file\n"
+                        "       BUFFERS=pbuf    provided buffer ring of PBUF"
+                        " buffers (reads only)\n"
+                        "       SUBMIT=sqpoll|coop|defer\n"
+                        "       BATCH=n         submit at least n reads at"
+                        " once\n"
+                        "       THREADS=n       n workers with a ring each\n"
+                        "       PATTERN=rand|seq|zipf, ZIPF=theta\n"
+                        "       READ=p          p%% reads, the rest writes"
+                        " (overwrites FILE!)\n"
+                        "       BS=n            block size (512..1M)\n"
+                        "       RATE=n          open loop: n I/Os per second\n"
+                        "       DURATION=s      stop after s seconds\n");
         return -1;
     }
 
-    int sq_size = atoi(argv[1]);
+    sq_size = atoi(argv[1]);
     char *fn = argv[2];
 
-    // Initialize the random number generator with the current time
-    // with gettimeofday(2). We use the nanoseconds within this second
-    // to get some randomness as a seed for srand(3).
-    struct timeval now;
-    gettimeofday(&now, NULL);
-    srand(now.tv_usec);
+    char *READ = getenv("READ");
+    read_percent = READ ? atoi(READ) : 100;
+    if (read_percent > 100)
+        read_percent = 100;
+    char *BS = getenv("BS");
+    if (BS)
+    {
+        block_size = atol(BS);
+        if (block_size < 512 || block_size > (1 << 20) || block_size % 512)
+        {
+            fprintf(stderr, "BS: a multiple of 512 up to 1 MiB\n");
+            return -1;
+        }
+        buffer_size = (block_size + sizeof(struct buffer) - 1) &
+                      ~(sizeof(struct buffer) - 1);
+    }
 
-    // Open the source file and get its size
-    int fd = open(fn, O_RDONLY | O_DIRECT);
+    // Open the source file and get its size. For writes, we also need
+    // write access.
+    fd = open(fn, (read_percent < 100 ? O_RDWR : O_RDONLY) | O_DIRECT);
     if (fd < 0)
         die("open");
 
     struct stat s;
     if (fstat(fd, &s) < 0)
         die("stat");
-    ssize_t fsize = s.st_size;
+    fsize = s.st_size;
 
-    struct ring R = {0};
-    (void)sq_size;
-    (void)fsize;
-    // FIXME: Create an io_uring with io_uring_setup(2)
-    // FIXME: Map the ring with:  R = ring_map(ring_fd, params);
+    if (fsize < (ssize_t)block_size)
+    {
+        fprintf(stderr, "%s: smaller than one block\n", fn);
+        return -1;
+    }
 
-    // A per-second statistic about the performed I/O
-    unsigned read_blocks = 0; // Number of read blocks
-    ssize_t read_bytes = 0;   // How many bytes where read
+    char *SUBMIT = getenv("SUBMIT");
+    if (SUBMIT && !strcmp(SUBMIT, "sqpoll"))
+    {
+        submit_mode = SUBMIT_SQPOLL;
+        char *SQ_CPU = getenv("SQ_CPU"), *SQ_IDLE = getenv("SQ_IDLE");
+        ring_params.flags |= IORING_SETUP_SQPOLL | IORING_SETUP_SQ_AFF;
+        ring_params.sq_thread_cpu =
+            SQ_CPU ? atoi(SQ_CPU) : sysconf(_SC_NPROCESSORS_ONLN) - 1;
+        ring_params.sq_thread_idle = SQ_IDLE ? atoi(SQ_IDLE) : 1000;
+    }
+    else if (SUBMIT && !strcmp(SUBMIT, "coop"))
+    {
+        submit_mode = SUBMIT_COOP;
+        ring_params.flags |=
+            IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG;
+    }
+    else if (SUBMIT && !strcmp(SUBMIT, "defer"))
+    {
+        submit_mode = SUBMIT_DEFER;
+        ring_params.flags |=
+            IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    }
+    char *BUFFERS = getenv("BUFFERS");
+    use_arena = BUFFERS && !strcmp(BUFFERS, "arena");
+    use_pbuf = BUFFERS && !strcmp(BUFFERS, "pbuf");
+    if (use_pbuf)
+    {
+        // The kernel wants a power of two (at most 32768)
+        char *PBUF = getenv("PBUF");
+        unsigned n = PBUF && atoi(PBUF) > 0 ? atoi(PBUF) : sq_size;
+        for (pbuf_count = 1; pbuf_count < n && pbuf_count < 32768;)
+            pbuf_count *= 2;
+        if (read_percent < 100)
+        {
+            fprintf(stderr, "BUFFERS=pbuf: only for reads\n");
+            return -1;
+        }
+    }
+    char *BATCH = getenv("BATCH");
+    batch = BATCH && atoi(BATCH) > 0 ? atoi(BATCH) : 1;
+    char *THREADS = getenv("THREADS");
+    nworkers = THREADS && atoi(THREADS) > 0 ? atoi(THREADS) : 1;
+    char *RATE = getenv("RATE");
+    rate = RATE ? atof(RATE) / nworkers : 0;
+    char *PATTERN = getenv("PATTERN"), *ZIPF = getenv("ZIPF");
+    double theta = ZIPF ? atof(ZIPF) : 0.99;
+    if (PATTERN && !strcmp(PATTERN, "seq"))
+        pattern = PATTERN_SEQ;
+    else if (PATTERN && !strcmp(PATTERN, "zipf"))
+    {
+        if (theta <= 0 || theta >= 1)
+        {
+            fprintf(stderr, "ZIPF: 0 < theta < 1\n");
+            return -1;
+        }
+        pattern = PATTERN_ZIPF;
+        zipf_init(&zipf, fsize / block_size, theta);
+    }
+    char *DURATION = getenv("DURATION");
+    int duration = DURATION ? atoi(DURATION) : 0;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        die("sched_getaffinity");
+
+    // Start the workers. Worker 0 comes first, as the others attach
+    // to its ring.
+    struct worker *workers = calloc(nworkers, sizeof(*workers));
+    if (!workers || sem_init(&ready, 0, 0) < 0)
+        die("calloc");
+    for (unsigned i = 0; i < nworkers; i++)
+    {
+        workers[i].id = i;
+        if (pthread_create(&workers[i].thread, NULL, worker_main,
+                           &workers[i]) != 0)
+            die("pthread_create");
+        if (i == 0)
+            sem_wait(&ready);
+    }
+    for (unsigned i = 1; i < nworkers; i++)
+        sem_wait(&ready);
+
+    const char *names[] = {"rand", "seq", "zipf"};
+    printf("workload: %s", names[pattern]);
+    if (pattern == PATTERN_ZIPF)
+        printf(" (theta %.2f)", theta);
+    printf(", %zu bytes, %u%% reads, %s, %u x SQ_SIZE %u\n", block_size,
+           read_percent, RATE ? "open loop" : "closed loop", nworkers,
+           sq_size);
+    if (RATE)
+        printf("rate: %.0f I/Os per second\n", rate * nworkers);
+
+    // With DURATION or on ^C, we print the histogram of the whole run
+    struct sigaction sa = {.sa_handler = on_sigint};
+    sigaction(SIGINT, &sa, NULL);
+    static struct histogram total;
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    time_t start = now.tv_sec;
+
+    // For the CPU time per I/O
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+                 usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+
+    // Every second, we collect the statistics of all workers and
+    // output them
+    static struct histogram latency;
     while (1)
     {
-        // FIXME: Submit SQEs up to a certain threshold (e.g.
-        // R.params.sq_entries)
-        // FIXME: Reap as many CQEs as possible with waiting exactly once
-        // FIXME: Keep track of the total in_flight requests (submitted -
-        // completed)
-
-        // Every second, we output a statistic ouptu
-        struct timeval now2;
-        gettimeofday(&now2, NULL);
-        if (now.tv_sec < now2.tv_sec)
+        struct timespec next = {now.tv_sec + 1, 0};
+        while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &next, NULL) ==
+                   EINTR &&
+               !stop)
+            ;
+        gettimeofday(&now, NULL);
+
+        uint64_t read_blocks = 0, read_bytes = 0, enters = 0;
+        uint64_t write_blocks = 0, write_bytes = 0;
+        uint64_t nobufs = 0, buffer_bytes = 0;
+        unsigned in_flight = 0;
+        memset(&latency, 0, sizeof(latency));
+        for (unsigned i = 0; i < nworkers; i++)
+        {
+            struct stats *st = &workers[i].stats;
+            read_blocks += count_take(&st->read_blocks);
+            read_bytes += count_take(&st->read_bytes);
+            write_blocks += count_take(&st->write_blocks);
+            write_bytes += count_take(&st->write_bytes);
+            enters += count_take(&st->enters);
+            nobufs += count_take(&st->nobufs);
+            buffer_bytes += atomic_load_explicit(
+                (_Atomic uint64_t *)&st->buffer_bytes, memory_order_relaxed);
+            in_flight += atomic_load_explicit(
+                (_Atomic unsigned *)&st->in_flight, memory_order_relaxed);
+            hist_take(&latency, &st->latency);
+        }
+
+        getrusage(RUSAGE_SELF, &usage);
+        double cpu2 = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+                      usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+        uint64_t ios = read_blocks + write_blocks;
+        printf("in_flight: %d, read_blocks/s: %.2fK, read_bytes: %.2f MiB/s, ",
+               in_flight, read_blocks / 1000.0,
+               read_bytes / (1024.0 * 1024.0));
+        if (read_percent < 100)
+            printf("write_blocks/s: %.2fK, write_bytes: %.2f MiB/s, ",
+                   write_blocks / 1000.0, write_bytes / (1024.0 * 1024.0));
+        if (use_pbuf)
+            printf("nobufs/s: %.2fK, ", nobufs / 1000.0);
+        printf("cpu/io: %.2f us, syscalls/s: %.2fK, latency p50/p99/p99.9: "
+               "%.0f/%.0f/%.0f us\n",
+               ios ? (cpu2 - cpu) * 1e6 / ios : 0.0, enters / 1000.0,
+               hist_percentile(&latency, 0.5) / 1e3,
+               hist_percentile(&latency, 0.99) / 1e3,
+               hist_percentile(&latency, 0.999) / 1e3);
+        fflush(stdout);
+        cpu = cpu2;
+        for (unsigned b = 0; b < HIST_BUCKETS; b++)
+            total.count[b] += latency.count[b];
+        total.n += latency.n;
+        if (stop || (duration > 0 && now.tv_sec - start >= duration))
         {
-            printf(
-                "in_flight: %d, read_blocks/s: %.2fK, read_bytes: %.2f MiB/s\n",
-                R.in_flight, read_blocks / 1000.0,
-                read_bytes / (1024.0 * 1024.0));
-            read_blocks = 0;
-            read_bytes = 0;
+            printf("buffers: %.0f KiB\n", buffer_bytes / 1024.0);
+            hist_print(&total);
+            return 0;
         }
-        now = now2;
     }
 }
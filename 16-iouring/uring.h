@@ -0,0 +1,468 @@
+// A small io_uring library without liburing. It has two layers:
+//
+// - The ring (struct ring): setup and mapping, handing out SQEs,
+//   submission, and reaping CQEs, with the memory barriers that the
+//   shared rings need. The benchmark in iouring.c uses this layer.
+//
+// - Operations (struct ring_op): read, write, fsync, openat, statx,
+//   and close. The user_data of an SQE is the address of its
+//   operation, and ring_dispatch() calls the callback of the
+//   operation with the result. Operations that are queued with
+//   IOSQE_IO_LINK form a chain: The next one only starts when the
+//   previous one succeeded. With a direct descriptor (a slot in the
+//   registered file table), even open -> read -> close is one chain,
+//   as the read does not need to know the fd.
+//
+// Short reads and writes are retried with the rest. In a chain, the
+// kernel cancels everything after a short read, so we queue the rest
+// of the chain again after the retry. The canceled attempts still
+// produce CQEs (-ECANCELED), which we recognize by a generation in
+// the lower bits of user_data and drop. Callbacks see the total
+// number of bytes.
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// We have our own system call wrappers for io_uring_setup(2) and
+// io_uring_enter(2) as those functions are also provided by the
+// liburing. To minimize confusion, we prefixed the helpers with `sys_'
+static inline int sys_io_uring_setup(unsigned entries,
+                                     struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int sys_io_uring_enter(int ring_fd, unsigned int to_submit,
+                                     unsigned int min_complete,
+                                     unsigned int flags, void *arg,
+                                     size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                        flags, arg, argsz);
+}
+
+static inline int sys_io_uring_register(int ring_fd, unsigned opcode,
+                                        void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+// Loads and stores of the head and tail pointers of an io_uring require
+// memory barriers to be fully synchronized with the kernel.
+//
+// For a very good and detailed discussion of load-acquire and
+// store-release, we strongly recommend the LWN article series on
+// lockless patterns: https://lwn.net/Articles/844224/
+//
+// If you have not yet understood that memory is a distributed system
+// that has a happens-before relation, than read(!) that series.
+#define store_release(p, v)                                                    \
+    atomic_store_explicit((_Atomic typeof(*(p)) *)(p), (v),                    \
+                          memory_order_release)
+#define load_aquire(p)                                                         \
+    atomic_load_explicit((_Atomic typeof(*(p)) *)(p), memory_order_acquire)
+
+struct ring_op;
+
+struct ring
+{
+    // The file descriptor to the created uring.
+    int ring_fd;
+
+    // The params that we have received from the kernel
+    struct io_uring_params params;
+
+    // We perform our own book keeping how many requests are currently
+    // in flight.
+    unsigned in_flight;
+
+    // The Submission Ring (mapping 1)
+    unsigned *sring;      // An array of length params.sq_entries
+    unsigned *sring_head; // Pointer to the head index (moved by the kernel)
+    unsigned *sring_tail; // Pointer to the tail index
+    unsigned sring_mask;  // Apply this mask to (*sring_tail) to get the next
+                          // free sring entry
+    unsigned *sring_flags; // IORING_SQ_NEED_WAKEUP, IORING_SQ_TASKRUN
+    unsigned sq_tail;      // Our tail, which includes prepared SQEs that
+                           // ring_flush() did not yet publish
+
+    // The SQE array (mapping 2)
+    //
+    // An SQE is like a system call that you prepare in this array and
+    // then push its index into the submission ring (please search for
+    // the term "indirection array" in io_uring(7)
+    struct io_uring_sqe *sqes;
+
+    // The Completion Queue (mapping 3)
+    unsigned *cring_head; // Pointer to the head index (written by us, read by
+                          // the kernel)
+    unsigned *cring_tail; // Pointer to the tail index (written by the kernel,
+                          // read by us)
+    unsigned cring_mask;  // Apply this mask the head index to get the next
+                          // available CQE
+    struct io_uring_cqe *cqes; // Array of CQEs
+
+    unsigned long enters;      // io_uring_enter(2) calls, for statistics
+    struct ring_op *link_prev; // The last operation of an open chain
+};
+
+// Map io_uring into the user space. This includes:
+// - Create all three mappings (submission ring, SQE array, and completion ring)
+// - Derive all pointers in struct ring
+static inline bool ring_map(struct ring *R, int ring_fd,
+                            const struct io_uring_params *p)
+{
+    *R = (struct ring){.ring_fd = ring_fd, .params = *p};
+
+    // The submission ring: The offsets in p->sq_off are relative to
+    // the start of this mapping.
+    size_t sring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    char *sq = mmap(NULL, sring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        return false;
+    R->sring = (unsigned *)(sq + p->sq_off.array);
+    R->sring_head = (unsigned *)(sq + p->sq_off.head);
+    R->sring_tail = (unsigned *)(sq + p->sq_off.tail);
+    R->sring_mask = *(unsigned *)(sq + p->sq_off.ring_mask);
+    R->sring_flags = (unsigned *)(sq + p->sq_off.flags);
+    R->sq_tail = *R->sring_tail;
+
+    // The SQE array
+    R->sqes = mmap(NULL, p->sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                   IORING_OFF_SQES);
+    if (R->sqes == MAP_FAILED)
+        return false;
+
+    // The completion ring
+    size_t cring_size =
+        p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    char *cq = mmap(NULL, cring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED)
+        return false;
+    R->cring_head = (unsigned *)(cq + p->cq_off.head);
+    R->cring_tail = (unsigned *)(cq + p->cq_off.tail);
+    R->cring_mask = *(unsigned *)(cq + p->cq_off.ring_mask);
+    R->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+    return true;
+}
+
+// Create and map a ring with the flags in *p. The kernel fills in the
+// rest of *p. Returns false (with errno) on errors.
+static inline bool ring_init(struct ring *R, unsigned entries,
+                             struct io_uring_params *p)
+{
+    int ring_fd = sys_io_uring_setup(entries, p);
+    if (ring_fd < 0)
+        return false;
+    if (!ring_map(R, ring_fd, p))
+    {
+        int err = errno;
+        close(ring_fd);
+        errno = err;
+        return false;
+    }
+    return true;
+}
+
+// The number of SQEs that ring_get_sqe() can still hand out
+static inline unsigned ring_space(struct ring *R)
+{
+    return R->params.sq_entries - (R->sq_tail - load_aquire(R->sring_head));
+}
+
+// Get a zeroed SQE, or NULL if the submission ring is full. The SQE
+// goes to the kernel with the next ring_flush() or ring_submit().
+static inline struct io_uring_sqe *ring_get_sqe(struct ring *R)
+{
+    if (ring_space(R) == 0)
+        return NULL;
+    unsigned idx = R->sq_tail++ & R->sring_mask;
+    R->sring[idx] = idx;
+    memset(&R->sqes[idx], 0, sizeof(R->sqes[idx]));
+    return &R->sqes[idx];
+}
+
+// Publish the prepared SQEs. The release makes sure that the kernel
+// sees the SQEs before the new tail.
+static inline void ring_flush(struct ring *R)
+{
+    store_release(R->sring_tail, R->sq_tail);
+}
+
+static inline int ring_enter(struct ring *R, unsigned to_submit,
+                             unsigned min_complete, unsigned flags)
+{
+    R->enters++;
+    return sys_io_uring_enter(R->ring_fd, to_submit, min_complete, flags,
+                              NULL, 0);
+}
+
+// Submit all prepared SQEs and wait for wait_nr CQEs. With SQPOLL, we
+// only enter the kernel to wait, or to wake up the poller thread.
+// Returns the result of io_uring_enter(2), or 0 if we did not call it.
+static inline int ring_submit(struct ring *R, unsigned wait_nr)
+{
+    ring_flush(R);
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    if (R->params.flags & IORING_SETUP_SQPOLL)
+    {
+        // The kernel thread sets NEED_WAKEUP and then checks the tail
+        // once more, before it sleeps. We store the tail and then
+        // check the flag. Without the full barrier in between, both
+        // could miss the other's store (see io_uring_enter(2)).
+        atomic_thread_fence(memory_order_seq_cst);
+        if (load_aquire(R->sring_flags) & IORING_SQ_NEED_WAKEUP)
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        else if (!wait_nr)
+            return 0;
+    }
+    unsigned pending = R->sq_tail - load_aquire(R->sring_head);
+    return ring_enter(R, pending, wait_nr, flags);
+}
+
+// Reap one CQE from the completion ring and copy the CQE to *cqe. If
+// no CQEs are available (*cring_head == *cring_tail), this function
+// returns 0.
+static inline int reap_cqe(struct ring *R, struct io_uring_cqe *cqe)
+{
+    // We own the head, the kernel owns the tail. The acquire makes
+    // sure that we see the CQE that the kernel wrote before the tail.
+    unsigned head = *R->cring_head;
+    if (head == load_aquire(R->cring_tail))
+        return 0;
+    *cqe = R->cqes[head & R->cring_mask];
+    // The CQE slot may be reused by the kernel after this store
+    store_release(R->cring_head, head + 1);
+    return 1;
+}
+
+// Wait for a CQE, but at most timeout_ns. We pass the timeout with
+// IORING_ENTER_EXT_ARG. Returns false on errors other than the timeout.
+static inline bool ring_wait(struct ring *R, uint64_t timeout_ns)
+{
+    struct __kernel_timespec ts = {timeout_ns / 1000000000,
+                                   timeout_ns % 1000000000};
+    struct io_uring_getevents_arg arg = {.ts = (uintptr_t)&ts};
+    R->enters++;
+    return sys_io_uring_enter(R->ring_fd, 0, 1,
+                              IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                              &arg, sizeof(arg)) >= 0 ||
+           errno == ETIME || errno == EINTR;
+}
+
+// Register a table of nfiles empty slots for direct descriptors
+static inline bool ring_register_files(struct ring *R, unsigned nfiles)
+{
+    int *fds = malloc(nfiles * sizeof(*fds));
+    if (!fds)
+        return false;
+    for (unsigned i = 0; i < nfiles; i++)
+        fds[i] = -1;
+    int ret = sys_io_uring_register(R->ring_fd, IORING_REGISTER_FILES, fds,
+                                    nfiles);
+    free(fds);
+    return ret >= 0;
+}
+
+////////////////////////////////////////////////////////////////
+// Operations
+
+typedef void (*ring_callback)(struct ring *R, struct ring_op *op, int res);
+
+struct ring_op
+{
+    ring_callback callback; // Called with the result (like cqe->res)
+    void *data;             // For the caller
+
+    // Filled in by the library
+    struct io_uring_sqe sqe; // As submitted, for retries
+    struct ring_op *link;    // The next operation in the chain
+    unsigned gen;            // Generation of the last submission
+    unsigned done;           // Bytes of earlier (short) attempts
+};
+
+// Operations are at least 8-byte aligned, so the three lower bits of
+// user_data are free for the generation
+#define RING_GEN_MASK 7u
+
+// Queue op with a copy of sqe. If the ring is full, we submit what we
+// have, but not in the middle of a chain, which would cut it. Returns
+// false if there is no room.
+static inline bool ring_queue(struct ring *R, struct ring_op *op,
+                              const struct io_uring_sqe *sqe)
+{
+    struct io_uring_sqe *s = ring_get_sqe(R);
+    if (!s && !R->link_prev)
+    {
+        if (ring_submit(R, 0) < 0)
+            return false;
+        s = ring_get_sqe(R);
+    }
+    if (!s)
+    {
+        errno = EBUSY;
+        return false;
+    }
+    *s = *sqe;
+    op->gen++;
+    s->user_data = (uintptr_t)op | (op->gen & RING_GEN_MASK);
+    op->sqe = *s;
+    op->link = NULL;
+    if (R->link_prev)
+        R->link_prev->link = op;
+    R->link_prev = (s->flags & IOSQE_IO_LINK) ? op : NULL;
+    R->in_flight++;
+    return true;
+}
+
+// The flags of the following functions are SQE flags: IOSQE_IO_LINK to
+// chain the next operation, and IOSQE_FIXED_FILE if fd is a slot of
+// the registered file table.
+
+static inline bool ring_read(struct ring *R, struct ring_op *op, int fd,
+                             void *buf, unsigned len, uint64_t off,
+                             unsigned flags)
+{
+    struct io_uring_sqe sqe = {.opcode = IORING_OP_READ, .flags = flags,
+                               .fd = fd, .addr = (uintptr_t)buf, .len = len,
+                               .off = off};
+    op->done = 0;
+    return ring_queue(R, op, &sqe);
+}
+
+static inline bool ring_write(struct ring *R, struct ring_op *op, int fd,
+                              const void *buf, unsigned len, uint64_t off,
+                              unsigned flags)
+{
+    struct io_uring_sqe sqe = {.opcode = IORING_OP_WRITE, .flags = flags,
+                               .fd = fd, .addr = (uintptr_t)buf, .len = len,
+                               .off = off};
+    op->done = 0;
+    return ring_queue(R, op, &sqe);
+}
+
+// fsync_flags: 0 or IORING_FSYNC_DATASYNC
+static inline bool ring_fsync(struct ring *R, struct ring_op *op, int fd,
+                              unsigned fsync_flags, unsigned flags)
+{
+    struct io_uring_sqe sqe = {.opcode = IORING_OP_FSYNC, .flags = flags,
+                               .fd = fd, .fsync_flags = fsync_flags};
+    return ring_queue(R, op, &sqe);
+}
+
+// With slot >= 0, the file becomes the direct descriptor slot (and
+// the result is 0). Otherwise, the result is a normal fd.
+static inline bool ring_openat(struct ring *R, struct ring_op *op, int dfd,
+                               const char *path, int open_flags, mode_t mode,
+                               int slot, unsigned flags)
+{
+    struct io_uring_sqe sqe = {.opcode = IORING_OP_OPENAT, .flags = flags,
+                               .fd = dfd, .addr = (uintptr_t)path,
+                               .len = mode, .open_flags = open_flags,
+                               .file_index = slot >= 0 ? slot + 1 : 0};
+    return ring_queue(R, op, &sqe);
+}
+
+static inline bool ring_statx(struct ring *R, struct ring_op *op, int dfd,
+                              const char *path, int statx_flags,
+                              unsigned mask, struct statx *stx,
+                              unsigned flags)
+{
+    struct io_uring_sqe sqe = {.opcode = IORING_OP_STATX, .flags = flags,
+                               .fd = dfd, .addr = (uintptr_t)path,
+                               .len = mask, .off = (uintptr_t)stx,
+                               .statx_flags = statx_flags};
+    return ring_queue(R, op, &sqe);
+}
+
+// Close the fd, or with slot >= 0, the direct descriptor slot
+static inline bool ring_close(struct ring *R, struct ring_op *op, int fd,
+                              int slot, unsigned flags)
+{
+    struct io_uring_sqe sqe = {.opcode = IORING_OP_CLOSE, .flags = flags,
+                               .fd = slot >= 0 ? 0 : fd,
+                               .file_index = slot >= 0 ? slot + 1 : 0};
+    return ring_queue(R, op, &sqe);
+}
+
+// Reap all CQEs that are there and call the callbacks of their
+// operations. Returns the number of CQEs.
+static inline unsigned ring_dispatch(struct ring *R)
+{
+    struct io_uring_cqe cqe;
+    unsigned n = 0;
+    while (reap_cqe(R, &cqe))
+    {
+        n++;
+        R->in_flight--;
+        uint64_t tag = cqe.user_data & ~(uint64_t)RING_GEN_MASK;
+        struct ring_op *op = (struct ring_op *)(uintptr_t)tag;
+        if ((cqe.user_data & RING_GEN_MASK) != (op->gen & RING_GEN_MASK))
+            continue; // An attempt that we have already replaced
+
+        int res = cqe.res;
+        uint8_t opcode = op->sqe.opcode;
+        bool rw = opcode == IORING_OP_READ || opcode == IORING_OP_WRITE;
+        if (rw && res > 0 && (unsigned)res < op->sqe.len)
+        {
+            // A short read or write: We queue the rest, followed by
+            // the rest of its chain, which the kernel has canceled.
+            // For that, we need room for the whole chain at once.
+            unsigned len = 1;
+            for (struct ring_op *f = op->link; f; f = f->link)
+                len++;
+            if (ring_space(R) < len)
+                ring_submit(R, 0);
+            op->done += res;
+            struct io_uring_sqe sqe = op->sqe;
+            sqe.addr += res;
+            sqe.len -= res;
+            sqe.off += res;
+            struct ring_op *f = op->link;
+            if (!ring_queue(R, op, &sqe))
+            {
+                op->callback(R, op, -errno);
+                continue;
+            }
+            while (f)
+            {
+                struct ring_op *next = f->link;
+                if (!ring_queue(R, f, &f->sqe))
+                    f->callback(R, f, -errno);
+                f = next;
+            }
+            continue;
+        }
+        if (rw && res >= 0)
+            res += op->done;
+        op->callback(R, op, res);
+    }
+    return n;
+}
+
+// Submit and complete operations until none is left in flight.
+// Callbacks may queue new operations. Returns false on errors.
+static inline bool ring_run(struct ring *R)
+{
+    while (R->in_flight > 0)
+    {
+        if (ring_submit(R, 1) < 0 && errno != EINTR)
+            return false;
+        ring_dispatch(R);
+    }
+    return true;
+}
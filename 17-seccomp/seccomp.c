@@ -3,6 +3,7 @@
 #include <linux/audit.h>
 #include <linux/filter.h>
 #include <linux/seccomp.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -13,6 +14,7 @@
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #define die(msg)                                                               \
@@ -39,6 +41,29 @@ static int sys_seccomp(unsigned int operation, unsigned int flags, void *args)
     return syscall(__NR_seccomp, operation, flags, args);
 }
 
+// Close all file descriptors but the n ones in keep (sorted ascending)
+static void close_all_but(const int *keep, int n)
+{
+    unsigned int from = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if ((unsigned int)keep[i] > from)
+            sys_close_range(from, keep[i] - 1, 0);
+        from = keep[i] + 1;
+    }
+    sys_close_range(from, ~0U, 0);
+}
+
+// Enter the strict seccomp mode: From now on, only read(2), write(2),
+// _exit(2), and sigreturn(2) are allowed. Every other system call
+// kills us with SIGKILL. Note that _exit(2) is not exit_group(2),
+// which glibc's _exit() uses, so we leave with syscall(__NR_exit, 0).
+static void enter_sandbox(void)
+{
+    if (sys_seccomp(SECCOMP_SET_MODE_STRICT, 0, NULL) < 0)
+        syscall(__NR_exit, 1);
+}
+
 // For call_secure, a process consists of a pid (as we spawn
 // the function in another process and pipe connection.
 typedef struct
@@ -50,12 +75,28 @@ typedef struct
 // Spawn a function within a seccomp-restricted child process
 secure_func_t spawn_secure(void (*func)(void *, int), void *arg)
 {
-    // FIXME: Create a pipe pair with pipe2(2)
-    // FIXME: fork a child process
-    // FIXME: In child, close all file descriptors besides the write end
-    // FIXME: Invoke the given function and kill the child with
-    // syscall(__NR_exit, 0)
     secure_func_t p = {.pid = -1, .pipe = -1};
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0)
+        return p;
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return p;
+    }
+    if (pid == 0)
+    {
+        // The child only keeps the write end
+        close_all_but(&fds[1], 1);
+        enter_sandbox();
+        func(arg, fds[1]);
+        syscall(__NR_exit, 0);
+    }
+    close(fds[1]);
+    p.pid = pid;
+    p.pipe = fds[0];
     return p;
 }
 
@@ -64,11 +105,38 @@ secure_func_t spawn_secure(void (*func)(void *, int), void *arg)
 // actually read bytes.
 int complete_secure(secure_func_t f, char *buf, size_t buflen)
 {
-    // FIXME: read from the child pipe
-    // FIXME: waitpid() for the child to exit
-    return -1;
+    if (f.pid < 0)
+        return -1;
+    // We read until the child closes its end, which it does when it
+    // exits, or until buf is full
+    size_t len = 0;
+    while (len < buflen)
+    {
+        ssize_t n = read(f.pipe, buf + len, buflen - len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        len += n;
+    }
+    close(f.pipe);
+
+    // A child that was killed (e.g., by seccomp) failed, even if it
+    // wrote something before
+    int status;
+    while (waitpid(f.pid, &status, 0) < 0)
+    {
+        if (errno != EINTR)
+            return -1;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+    return len;
 }
 
+////////////////////////////////////////////////////////////////
+// Functions
+
 // Test function that is valid
 void ok(void *arg, int fd)
 {
@@ -82,8 +150,419 @@ void fail(void *arg, int fd)
     close(fd2);
 }
 
+// Write the argument (a string) back
+void echo(void *arg, int fd)
+{
+    if (arg)
+        write(fd, arg, strlen(arg));
+}
+
+enum
+{
+    FUNC_OK,
+    FUNC_FAIL,
+    FUNC_ECHO,
+};
+
+// The functions that a pool can call, by their index
+typedef void (*secure_fn_t)(void *, int);
+
+static secure_fn_t secure_funcs[] = {
+    [FUNC_OK] = ok,
+    [FUNC_FAIL] = fail,
+    [FUNC_ECHO] = echo,
+};
+static const unsigned secure_nfuncs =
+    sizeof(secure_funcs) / sizeof(secure_funcs[0]);
+
+////////////////////////////////////////////////////////////////
+// Worker Pool
+
+// spawn_secure() pays for a fork(2), a close_range(2), and a
+// seccomp(2) in every call. A pool, like the zygote of Android, does
+// this ahead of time: It forks n workers, which enter the sandbox
+// and then wait for calls on their request pipe. A call is the ID of a
+// function (an index into secure_funcs[]) and an argument of up to
+// POOL_ARG_MAX bytes, which the worker passes on as a string. The
+// function writes its result to an fd, as with spawn_secure(), but this
+// is the write end of a private, non-blocking pipe of the worker: Once
+// the function returns, the worker drains that pipe and sends the
+// result, with its length in front, on its response pipe.
+//
+// As the sandbox only allows read(2) and write(2), a function must not
+// allocate memory (no brk or mmap) or open files. If it tries, seccomp
+// kills the worker; the caller sees EOF on the response pipe, gets -1,
+// and we fork a replacement. We do the same when we find a worker dead
+// before a call. The price for the speed: Calls that run in the same
+// worker are not isolated from each other. A function could leave
+// something behind for the next caller. Results are limited to
+// POOL_RESULT_MAX bytes. As the private pipe is non-blocking, a longer
+// write would not block but end short with EAGAIN. Therefore, the pipe
+// holds twice as much: If the worker finds more than POOL_RESULT_MAX
+// bytes in it, the result is too large, and the call fails.
+
+#define POOL_ARG_MAX 4096
+#define POOL_RESULT_MAX 65536
+#define POOL_TOO_LARGE UINT32_MAX // Result length for too large results
+
+struct pool_request
+{
+    uint32_t func;   // Index into secure_funcs[]
+    uint32_t arglen; // Bytes of argument that follow
+};
+
+typedef struct
+{
+    pid_t pid;
+    int req;   // Write end of the request pipe
+    int resp;  // Read end of the response pipe
+    bool busy; // A call is in flight
+} pool_worker_t;
+
+typedef struct
+{
+    pool_worker_t *workers;
+    unsigned n;
+    unsigned long replaced; // Workers that we had to replace
+} secure_pool_t;
+
+static bool read_full(int fd, void *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf = (char *)buf + n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf = (const char *)buf + n;
+        len -= n;
+    }
+    return true;
+}
+
+// The main loop of a sandboxed worker. It uses no library function
+// that could issue a system call besides read(2) and write(2).
+static void worker_loop(int req, int resp, int out_rd, int out_wr)
+{
+    // Static, as we must not allocate and a 64 KiB result is a lot of
+    // stack
+    static char arg[POOL_ARG_MAX + 1];
+    static struct
+    {
+        uint32_t len;
+        char data[POOL_RESULT_MAX];
+    } result;
+    static char rest[4096];
+    struct pool_request r;
+    while (read_full(req, &r, sizeof(r)))
+    {
+        if (r.func >= secure_nfuncs || r.arglen > POOL_ARG_MAX ||
+            !read_full(req, arg, r.arglen))
+            break;
+        arg[r.arglen] = 0;
+        secure_funcs[r.func](arg, out_wr);
+
+        // out_rd is non-blocking, so we stop at an empty pipe. Whatever
+        // is left beyond POOL_RESULT_MAX, we drain for the next call.
+        result.len = 0;
+        ssize_t n;
+        while (result.len < POOL_RESULT_MAX &&
+               (n = read(out_rd, result.data + result.len,
+                         POOL_RESULT_MAX - result.len)) > 0)
+            result.len += n;
+        bool too_large = false;
+        while (read(out_rd, rest, sizeof(rest)) > 0)
+            too_large = true;
+        if (too_large)
+            result.len = POOL_TOO_LARGE;
+        if (!write_full(resp, &result,
+                        sizeof(result.len) + (too_large ? 0 : result.len)))
+            break;
+    }
+    // The pool is gone, or it sent garbage
+    syscall(__NR_exit, 0);
+}
+
+// Fork the i-th worker of the pool
+static bool pool_spawn(secure_pool_t *pool, unsigned i)
+{
+    pool_worker_t *w = &pool->workers[i];
+    int req[2], resp[2], out[2];
+    if (pipe2(req, O_CLOEXEC) < 0)
+        return false;
+    if (pipe2(resp, O_CLOEXEC) < 0)
+    {
+        close(req[0]);
+        close(req[1]);
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(req[0]);
+        close(req[1]);
+        close(resp[0]);
+        close(resp[1]);
+        return false;
+    }
+    if (pid == 0)
+    {
+        // We move our four fds to 0..3, which also closes what we
+        // inherited there. F_DUPFD to 10 first keeps them out of the
+        // way of each other.
+        int keep[4] = {req[0], resp[1]};
+        if (pipe2(out, O_NONBLOCK) < 0 ||
+            fcntl(out[1], F_SETPIPE_SZ, 2 * POOL_RESULT_MAX) < 0)
+            syscall(__NR_exit, 1);
+        keep[2] = out[0];
+        keep[3] = out[1];
+        for (int j = 0; j < 4; j++)
+            keep[j] = fcntl(keep[j], F_DUPFD, 10 + j);
+        for (int j = 0; j < 4; j++)
+            dup2(keep[j], j);
+        int all[4] = {0, 1, 2, 3};
+        close_all_but(all, 4);
+        enter_sandbox();
+        worker_loop(0, 1, 2, 3);
+    }
+    close(req[0]);
+    close(resp[1]);
+    *w = (pool_worker_t){.pid = pid, .req = req[1], .resp = resp[0]};
+    return true;
+}
+
+// Reap a dead (or misbehaving) worker and fork a replacement
+static bool pool_replace(secure_pool_t *pool, unsigned i)
+{
+    pool_worker_t *w = &pool->workers[i];
+    close(w->req);
+    close(w->resp);
+    kill(w->pid, SIGKILL);
+    while (waitpid(w->pid, NULL, 0) < 0 && errno == EINTR)
+        ;
+    pool->replaced++;
+    return pool_spawn(pool, i);
+}
+
+bool pool_init(secure_pool_t *pool, unsigned n)
+{
+    // A write to a dead worker should fail with EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+    *pool = (secure_pool_t){.workers = calloc(n, sizeof(pool_worker_t)),
+                            .n = n};
+    if (!pool->workers)
+        return false;
+    for (unsigned i = 0; i < n; i++)
+    {
+        if (!pool_spawn(pool, i))
+            return false;
+    }
+    return true;
+}
+
+void pool_destroy(secure_pool_t *pool)
+{
+    // Closing the request pipe makes a worker exit
+    for (unsigned i = 0; i < pool->n; i++)
+        close(pool->workers[i].req);
+    for (unsigned i = 0; i < pool->n; i++)
+    {
+        close(pool->workers[i].resp);
+        waitpid(pool->workers[i].pid, NULL, 0);
+    }
+    free(pool->workers);
+}
+
+// Start the function func with an idle worker. Returns the worker,
+// which complete_pool() takes, or -1 if all workers are busy.
+int call_pool(secure_pool_t *pool, unsigned func, const char *arg)
+{
+    size_t arglen = arg ? strlen(arg) : 0;
+    if (func >= secure_nfuncs || arglen > POOL_ARG_MAX)
+        return -1;
+    for (unsigned i = 0; i < pool->n; i++)
+    {
+        pool_worker_t *w = &pool->workers[i];
+        if (w->busy)
+            continue;
+        struct pool_request r = {func, arglen};
+        // The request is small, so the worker gets it as a whole (or
+        // we find that it has died while idle, and try once more with
+        // its replacement)
+        for (int attempt = 0; attempt < 2; attempt++)
+        {
+            if (write_full(w->req, &r, sizeof(r)) &&
+                write_full(w->req, arg, arglen))
+            {
+                w->busy = true;
+                return i;
+            }
+            if (!pool_replace(pool, i))
+                return -1;
+        }
+        return -1;
+    }
+    return -1;
+}
+
+// Like complete_secure(), but for a call with call_pool()
+int complete_pool(secure_pool_t *pool, int worker, char *buf, size_t buflen)
+{
+    if (worker < 0)
+        return -1;
+    pool_worker_t *w = &pool->workers[worker];
+    w->busy = false;
+    uint32_t len;
+    if (!read_full(w->resp, &len, sizeof(len)))
+    {
+        // The worker died during the call
+        pool_replace(pool, worker);
+        return -1;
+    }
+    if (len == POOL_TOO_LARGE)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    // We keep what fits, and drop the rest
+    size_t keep = len < buflen ? len : buflen;
+    static char drop[4096];
+    if (!read_full(w->resp, buf, keep))
+    {
+        pool_replace(pool, worker);
+        return -1;
+    }
+    for (size_t left = len - keep; left > 0;)
+    {
+        size_t n = left < sizeof(drop) ? left : sizeof(drop);
+        if (!read_full(w->resp, drop, n))
+        {
+            pool_replace(pool, worker);
+            return -1;
+        }
+        left -= n;
+    }
+    return keep;
+}
+
+////////////////////////////////////////////////////////////////
+// Benchmark
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char *name, uint64_t *latency, unsigned calls,
+                   uint64_t ns, int failed)
+{
+    qsort(latency, calls, sizeof(*latency), compare_u64);
+    printf("%-24s %8.0f calls/s, latency p50 %6.1f us, p99 %6.1f us, "
+           "max %7.1f us, %d failed\n",
+           name, calls / (ns / 1e9), latency[calls / 2] / 1e3,
+           latency[calls * 99 / 100] / 1e3, latency[calls - 1] / 1e3, failed);
+}
+
+// CALLS calls of func, DEPTH (default 1) at a time, with fork and with a
+// pool of DEPTH workers. The latency of a call runs from its start to
+// its completion.
+static int bench(unsigned func, const char *label)
+{
+    char *CALLS = getenv("CALLS"), *DEPTH = getenv("DEPTH");
+    unsigned calls = CALLS ? atoi(CALLS) : 10000;
+    unsigned depth = DEPTH && atoi(DEPTH) > 0 ? atoi(DEPTH) : 1;
+    if (calls < depth)
+        calls = depth;
+    uint64_t *latency = calloc(calls, sizeof(*latency));
+    uint64_t *started = calloc(depth, sizeof(*started));
+    secure_func_t *spawned = calloc(depth, sizeof(*spawned));
+    int *workers = calloc(depth, sizeof(*workers));
+    if (!latency || !started || !spawned || !workers)
+        die("calloc");
+    char buf[128], name[64];
+
+    // One-shot fork: a batch of depth children at a time
+    int failed = 0;
+    uint64_t start = now_ns();
+    for (unsigned i = 0; i < calls; i += depth)
+    {
+        unsigned n = calls - i < depth ? calls - i : depth;
+        for (unsigned j = 0; j < n; j++)
+        {
+            started[j] = now_ns();
+            spawned[j] = spawn_secure(secure_funcs[func], (void *)"Hallo");
+        }
+        for (unsigned j = 0; j < n; j++)
+        {
+            if (complete_secure(spawned[j], buf, sizeof(buf)) < 0)
+                failed++;
+            latency[i + j] = now_ns() - started[j];
+        }
+    }
+    snprintf(name, sizeof(name), "fork %s x%u:", label, depth);
+    report(name, latency, calls, now_ns() - start, failed);
+
+    // The pool. Its startup is not part of the measurement.
+    secure_pool_t pool;
+    if (!pool_init(&pool, depth))
+        die("pool_init");
+    failed = 0;
+    start = now_ns();
+    for (unsigned i = 0; i < calls; i += depth)
+    {
+        unsigned n = calls - i < depth ? calls - i : depth;
+        for (unsigned j = 0; j < n; j++)
+        {
+            started[j] = now_ns();
+            workers[j] = call_pool(&pool, func, "Hallo");
+        }
+        for (unsigned j = 0; j < n; j++)
+        {
+            if (complete_pool(&pool, workers[j], buf, sizeof(buf)) < 0)
+                failed++;
+            latency[i + j] = now_ns() - started[j];
+        }
+    }
+    snprintf(name, sizeof(name), "pool %s x%u:", label, depth);
+    report(name, latency, calls, now_ns() - start, failed);
+    printf("%-24s %lu workers replaced\n", "", pool.replaced);
+    pool_destroy(&pool);
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
+    if (argc == 2 && !strcmp(argv[1], "bench"))
+    {
+        bench(FUNC_ECHO, "echo");
+        bench(FUNC_FAIL, "fail");
+        return 0;
+    }
+
     char buf[128];
     int len;
     secure_func_t p1 = spawn_secure(ok, NULL);
@@ -107,4 +586,25 @@ int main(int argc, char *argv[])
     {
         printf("fail failed: %d\n", len);
     }
+
+    // The same with a pool of one worker, which fail kills and which
+    // we then replace for the echo
+    secure_pool_t pool;
+    if (!pool_init(&pool, 1))
+        die("pool_init");
+    unsigned funcs[] = {FUNC_OK, FUNC_FAIL, FUNC_ECHO};
+    const char *names[] = {"ok", "fail", "echo"};
+    for (unsigned i = 0; i < 3; i++)
+    {
+        int w = call_pool(&pool, funcs[i], "Hallo Pool");
+        if ((len = complete_pool(&pool, w, buf, sizeof(buf) - 1)) >= 0)
+        {
+            buf[len] = 0;
+            printf("pool %s: %s\n", names[i], buf);
+        }
+        else
+            printf("pool %s failed: %d\n", names[i], len);
+    }
+    printf("pool: %lu workers replaced\n", pool.replaced);
+    pool_destroy(&pool);
 }